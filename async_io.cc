@@ -0,0 +1,416 @@
+// ================================================================
+// Description: Asynchronous file I/O class.
+// Copyright:   Copyright (c) 2012 by Joe Linoff
+// Version:     1.3.0
+// Author:      Joe Linoff
+//
+// LICENSE
+//   The cipher package is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of the
+//   License, or (at your option) any later version.
+//
+//   The cipher package is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details. You should have received
+//   a copy of the GNU General Public License along with the change
+//   tool; if not, write to the Free Software Foundation, Inc., 59
+//   Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+// ================================================================
+#include "async_io.h"
+#include <stdexcept>
+#include <cerrno>
+#include <climits>        // LONG_MIN
+#include <cstdlib>        // posix_memalign, free
+#include <cstring>        // memset, strerror
+#include <unistd.h>       // pread, pwrite, close
+#include <sys/mman.h>     // mmap
+#ifdef __linux__
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define ASYNC_IO_URING
+#endif
+#endif
+#endif
+using namespace std;
+
+namespace
+{
+  // ================================================================
+  // Report a failed operation.
+  // ================================================================
+  void io_error(const char* op, int err)
+  {
+    string msg = string(op) + " failed: " + strerror(err);
+    throw runtime_error(msg);
+  }
+
+#ifdef ASYNC_IO_URING
+  // ================================================================
+  // The io_uring system calls, glibc does not wrap them.
+  // ================================================================
+  int uring_setup(unsigned entries, struct io_uring_params* p)
+  {
+    return syscall(__NR_io_uring_setup, entries, p);
+  }
+
+  int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+  {
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, 0, 0);
+  }
+
+  int uring_register(int fd, unsigned op, void* arg, unsigned n)
+  {
+    return syscall(__NR_io_uring_register, fd, op, arg, n);
+  }
+#endif
+}
+
+// ================================================================
+// Constructor.
+// ================================================================
+AsyncIO::AsyncIO(uint depth, size_t bufsize, Backend backend)
+  : m_bufsize(bufsize),
+    m_fixed(false),
+    m_fd(-1),
+    m_sq_map(0),
+    m_sq_size(0),
+    m_cq_map(0),
+    m_cq_size(0),
+    m_sqes(0),
+    m_sqes_size(0),
+    m_sq_head(0),
+    m_sq_tail(0),
+    m_sq_mask(0),
+    m_sq_array(0),
+    m_cq_head(0),
+    m_cq_tail(0),
+    m_cq_mask(0),
+    m_cqes(0)
+{
+  // The buffers are page aligned so the kernel can pin them.
+  slot_t idle = {IDLE, false, -1, 0, 0, 0};
+  m_slots.resize(depth ? depth : 1, idle);
+  for(uint i=0;i<m_slots.size();++i) {
+    void* p = 0;
+    if (posix_memalign(&p, 4096, bufsize ? bufsize : 1)) {
+      for(uint j=0;j<m_bufs.size();++j) {
+        free(m_bufs[j]);
+      }
+      throw runtime_error("AsyncIO(): out of memory");
+    }
+    m_bufs.push_back((uchar*)p);
+  }
+  if (backend != PREAD) {
+    setup();
+  }
+}
+
+// ================================================================
+// Destructor.
+// ================================================================
+AsyncIO::~AsyncIO()
+{
+  // The kernel may still be using the buffers.
+  for(uint i=0;i<m_slots.size();++i) {
+    try {
+      wait(i);
+    }
+    catch (...) {
+    }
+  }
+  if (m_fd >= 0) {
+    if (m_sqes) {
+      munmap(m_sqes, m_sqes_size);
+    }
+    if (m_cq_map && m_cq_map != m_sq_map) {
+      munmap(m_cq_map, m_cq_size);
+    }
+    if (m_sq_map) {
+      munmap(m_sq_map, m_sq_size);
+    }
+    close(m_fd);
+  }
+  for(uint i=0;i<m_bufs.size();++i) {
+    free(m_bufs[i]);
+  }
+}
+
+// ================================================================
+// setup
+// ================================================================
+bool AsyncIO::setup()
+{
+#ifdef ASYNC_IO_URING
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = uring_setup(m_slots.size(), &p);
+  if (fd < 0) {
+    return false;
+  }
+
+  // Map the submission queue, the completion queue (it shares the
+  // mapping on newer kernels) and the submission entries.
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && cq_size > sq_size) {
+    sq_size = cq_size;
+  }
+  void* sq = mmap(0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  void* cq = sq;
+  if (!single) {
+    cq = mmap(0, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) {
+      munmap(sq, sq_size);
+      close(fd);
+      return false;
+    }
+  }
+  size_t sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    if (cq != sq) {
+      munmap(cq, cq_size);
+    }
+    munmap(sq, sq_size);
+    close(fd);
+    return false;
+  }
+  m_fd        = fd;
+  m_sq_map    = sq;
+  m_sq_size   = sq_size;
+  m_cq_map    = cq;
+  m_cq_size   = cq_size;
+  m_sqes      = sqes;
+  m_sqes_size = sqes_size;
+  m_sq_head   = (unsigned*)((char*)sq + p.sq_off.head);
+  m_sq_tail   = (unsigned*)((char*)sq + p.sq_off.tail);
+  m_sq_mask   = (unsigned*)((char*)sq + p.sq_off.ring_mask);
+  m_sq_array  = (unsigned*)((char*)sq + p.sq_off.array);
+  m_cq_head   = (unsigned*)((char*)cq + p.cq_off.head);
+  m_cq_tail   = (unsigned*)((char*)cq + p.cq_off.tail);
+  m_cq_mask   = (unsigned*)((char*)cq + p.cq_off.ring_mask);
+  m_cqes      = (char*)cq + p.cq_off.cqes;
+
+  // Registered buffers save the kernel from mapping them for each
+  // operation. It can fail if the locked memory limit is low, the
+  // plain vectored operations are used then.
+  m_iov.resize(m_bufs.size());
+  for(uint i=0;i<m_bufs.size();++i) {
+    m_iov[i].iov_base = m_bufs[i];
+    m_iov[i].iov_len  = m_bufsize;
+  }
+  m_fixed = uring_register(m_fd, IORING_REGISTER_BUFFERS, &m_iov[0], m_iov.size()) == 0;
+  return true;
+#else
+  return false;
+#endif
+}
+
+// ================================================================
+// read
+// ================================================================
+void AsyncIO::read(uint i, int fd, off_t off, size_t len)
+{
+  wait(i);
+  slot_t& s = m_slots[i];
+  s.op  = READ;
+  s.fd  = fd;
+  s.off = off;
+  s.len = len < m_bufsize ? len : m_bufsize;
+  s.res = 0;
+  if (m_fd >= 0) {
+    submit(i, READ);
+    return;
+  }
+  s.res = pread(fd, m_bufs[i], s.len, off);
+  s.res = s.res < 0 ? -errno : s.res;
+  s.pending = true;
+}
+
+// ================================================================
+// write
+// ================================================================
+void AsyncIO::write(uint i, int fd, off_t off, size_t len)
+{
+  wait(i);
+  slot_t& s = m_slots[i];
+  s.op  = WRITE;
+  s.fd  = fd;
+  s.off = off;
+  s.len = len < m_bufsize ? len : m_bufsize;
+  s.res = 0;
+  if (m_fd >= 0) {
+    submit(i, WRITE);
+    return;
+  }
+  s.res = pwrite(fd, m_bufs[i], s.len, off);
+  s.res = s.res < 0 ? -errno : s.res;
+  s.pending = true;
+}
+
+// ================================================================
+// wait
+// ================================================================
+size_t AsyncIO::wait(uint i)
+{
+  slot_t& s = m_slots[i];
+  if (!s.pending) {
+    return 0;
+  }
+  while (m_fd >= 0 && s.res == LONG_MIN) {
+    reap(true);
+  }
+  s.pending = false;
+  finish(i);
+  return s.res;
+}
+
+// ================================================================
+// submit
+// ================================================================
+void AsyncIO::submit(uint i, int op)
+{
+#ifdef ASYNC_IO_URING
+  // There is one entry per buffer and each buffer has at most one
+  // operation in flight so the submission queue is never full.
+  slot_t& s = m_slots[i];
+  unsigned tail = *m_sq_tail;
+  unsigned idx  = tail & *m_sq_mask;
+  struct io_uring_sqe* sqe = (struct io_uring_sqe*)m_sqes + idx;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->fd        = s.fd;
+  sqe->off       = s.off;
+  sqe->user_data = i;
+  if (m_fixed) {
+    sqe->opcode    = op == READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+    sqe->addr      = (unsigned long)m_bufs[i];
+    sqe->len       = s.len;
+    sqe->buf_index = i;
+  }
+  else {
+    // The iovec stays valid while the operation is in flight.
+    m_iov[i].iov_len = s.len;
+    sqe->opcode = op == READ ? IORING_OP_READV : IORING_OP_WRITEV;
+    sqe->addr   = (unsigned long)&m_iov[i];
+    sqe->len    = 1;
+  }
+  m_sq_array[idx] = idx;
+  __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+  s.res     = LONG_MIN; // in flight
+  s.pending = true;
+  for(;;) {
+    int n = uring_enter(m_fd, 1, 0, 0);
+    if (n >= 0) {
+      break;
+    }
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      s.pending = false;
+      s.res = 0;
+      io_error("io_uring_enter()", errno);
+    }
+    reap(false); // make room in the completion queue
+  }
+#else
+  (void)i;
+  (void)op;
+#endif
+}
+
+// ================================================================
+// reap
+// ================================================================
+void AsyncIO::reap(bool block)
+{
+#ifdef ASYNC_IO_URING
+  unsigned head = *m_cq_head;
+  if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+    if (!block) {
+      return;
+    }
+    if (uring_enter(m_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+      io_error("io_uring_enter()", errno);
+    }
+  }
+  while (head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe* cqe = (struct io_uring_cqe*)m_cqes + (head & *m_cq_mask);
+    if (cqe->user_data < m_slots.size()) {
+      m_slots[cqe->user_data].res = cqe->res;
+    }
+    ++head;
+  }
+  __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+#else
+  (void)block;
+#endif
+}
+
+// ================================================================
+// finish
+// ================================================================
+void AsyncIO::finish(uint i)
+{
+  // Complete a short read or write synchronously. A read that
+  // returns 0 is the end of the file.
+  slot_t& s = m_slots[i];
+  const char* op = s.op == READ ? "read" : "write";
+  if (s.res < 0) {
+    int err = -s.res;
+    s.res = 0;
+    io_error(op, err);
+  }
+  size_t done = s.res;
+  while (done < s.len) {
+    ssize_t n = s.op == READ
+      ? pread(s.fd, m_bufs[i] + done, s.len - done, s.off + done)
+      : pwrite(s.fd, m_bufs[i] + done, s.len - done, s.off + done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      s.res = done;
+      io_error(op, errno);
+    }
+    if (n == 0) {
+      if (s.op == WRITE) {
+        s.res = done;
+        io_error(op, EIO);
+      }
+      break;
+    }
+    done += n;
+  }
+  s.res = done;
+}
+
+// ================================================================
+// name
+// ================================================================
+const char* AsyncIO::name(Backend backend)
+{
+  switch (backend) {
+  case IO_URING: return "io_uring";
+  case PREAD:    return "pread";
+  default:       return "auto";
+  }
+}
+
+// ================================================================
+// available
+// ================================================================
+bool AsyncIO::available()
+{
+  AsyncIO io(1, 1);
+  return io.backend() == IO_URING;
+}
@@ -0,0 +1,189 @@
+// ================================================================
+// Description: Asynchronous file I/O class.
+// Copyright:   Copyright (c) 2012 by Joe Linoff
+// Version:     1.3.0
+// Author:      Joe Linoff
+//
+// LICENSE
+//   The cipher package is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of the
+//   License, or (at your option) any later version.
+//
+//   The cipher package is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details. You should have received
+//   a copy of the GNU General Public License along with the change
+//   tool; if not, write to the Free Software Foundation, Inc., 59
+//   Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+// ================================================================
+#ifndef async_io_h
+#define async_io_h
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <sys/types.h> // off_t
+#include <sys/uio.h>   // iovec
+
+/**
+ * Queued file reads and writes on a fixed set of buffers.
+ *
+ * On Linux it uses an io_uring with the buffers registered with
+ * the kernel so many reads and writes can be in flight from one
+ * thread without blocking it. The system calls are made directly
+ * so there is no dependency on liburing. If io_uring is not
+ * available (old kernels, other systems or a seccomp filter that
+ * blocks it) each operation is done with pread() or pwrite() when
+ * it is queued instead.
+ *
+ * Each buffer has at most one operation in flight. The operations
+ * are at explicit offsets so they only work for regular files.
+ *
+ * Here is how you would use it.
+ * @code
+ *   AsyncIO io(4, 65536);
+ *   for(uint i=0;i<io.depth();++i) {
+ *     io.read(i, fd, i * 65536, 65536); // read ahead
+ *   }
+ *   size_t n = io.wait(0); // throws if the read failed
+ *   process(io.buffer(0), n);
+ * @endcode
+ * @author Joe Linoff
+ */
+class AsyncIO
+{
+public:
+  typedef unsigned int uint;
+  typedef unsigned char uchar;
+
+  /**
+   * The implementations.
+   */
+  enum Backend
+  {
+    AUTO,     ///< io_uring if it is available, otherwise PREAD.
+    IO_URING, ///< Linux io_uring.
+    PREAD     ///< Synchronous pread() and pwrite().
+  };
+public:
+  /**
+   * Constructor.
+   * @param depth    The number of buffers.
+   * @param bufsize  The size of each buffer.
+   * @param backend  The implementation. IO_URING behaves like
+   *                 AUTO if io_uring is not available.
+   */
+  AsyncIO(uint depth, size_t bufsize, Backend backend=AUTO);
+
+  /**
+   * Destructor.
+   * It waits for the operations that are still in flight.
+   */
+  ~AsyncIO();
+
+  /**
+   * Queue a read into a buffer.
+   * @param i    The buffer.
+   * @param fd   The file descriptor.
+   * @param off  The file offset.
+   * @param len  The number of bytes, at most buffer_size().
+   */
+  void read(uint i, int fd, off_t off, size_t len);
+
+  /**
+   * Queue a write from a buffer.
+   * @param i    The buffer.
+   * @param fd   The file descriptor.
+   * @param off  The file offset.
+   * @param len  The number of bytes, at most buffer_size().
+   */
+  void write(uint i, int fd, off_t off, size_t len);
+
+  /**
+   * Wait for the operation on a buffer to finish. Short reads
+   * and writes are completed, a read is only short at the end
+   * of the file.
+   * @param i  The buffer.
+   * @returns The number of bytes read or written, 0 if there
+   *          was no operation.
+   * @throws runtime_error If the operation failed.
+   */
+  size_t wait(uint i);
+
+  /**
+   * Get a buffer.
+   * @param i  The buffer.
+   */
+  uchar* buffer(uint i) {return m_bufs[i];}
+
+  /**
+   * Get the number of buffers.
+   */
+  uint depth() const {return m_bufs.size();}
+
+  /**
+   * Get the size of each buffer.
+   */
+  size_t buffer_size() const {return m_bufsize;}
+
+  /**
+   * Get the implementation in use.
+   * @returns IO_URING or PREAD.
+   */
+  Backend backend() const {return m_fd >= 0 ? IO_URING : PREAD;}
+
+  /**
+   * Get the name of an implementation.
+   * @returns "auto", "io_uring" or "pread".
+   */
+  static const char* name(Backend backend);
+
+  /**
+   * Can an io_uring be created?
+   * @returns True if it can.
+   */
+  static bool available();
+private:
+  AsyncIO(const AsyncIO&);
+  AsyncIO& operator=(const AsyncIO&);
+  bool setup();
+  void submit(uint i, int op);
+  void reap(bool block);
+  void finish(uint i);
+private:
+  enum {IDLE, READ, WRITE};
+  struct slot_t
+  {
+    int    op;
+    bool   pending;
+    int    fd;
+    off_t  off;
+    size_t len;
+    long   res;
+  };
+  std::vector<uchar*> m_bufs;
+  std::vector<slot_t> m_slots;
+  std::vector<iovec>  m_iov;
+  size_t              m_bufsize;
+  bool                m_fixed;
+  // The io_uring, m_fd is -1 for the PREAD backend.
+  int       m_fd;
+  void*     m_sq_map;
+  size_t    m_sq_size;
+  void*     m_cq_map;
+  size_t    m_cq_size;
+  void*     m_sqes;
+  size_t    m_sqes_size;
+  unsigned* m_sq_head;
+  unsigned* m_sq_tail;
+  unsigned* m_sq_mask;
+  unsigned* m_sq_array;
+  unsigned* m_cq_head;
+  unsigned* m_cq_tail;
+  unsigned* m_cq_mask;
+  void*     m_cqes;
+};
+
+#endif
@@ -0,0 +1,422 @@
+// ================================================================
+// Description: Base64 (MIME) codec.
+// Copyright:   Copyright (c) 2012 by Joe Linoff
+// Version:     1.3.0
+// Author:      Joe Linoff
+//
+// LICENSE
+//   The cipher package is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of the
+//   License, or (at your option) any later version.
+//
+//   The cipher package is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details. You should have received
+//   a copy of the GNU General Public License along with the change
+//   tool; if not, write to the Free Software Foundation, Inc., 59
+//   Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+// ================================================================
+#include "base64.h"
+#include <string>
+#include <stdexcept>
+using namespace std;
+
+// The vector versions need the gcc/clang target attributes.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define BASE64_X86 1
+#include <immintrin.h>
+#endif
+
+namespace
+{
+  typedef unsigned char uchar;
+
+  const char b64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  // ================================================================
+  // MIME character values: 0..63 for the alphabet, -2 for white
+  // space, -3 for the '=' pad and -1 for anything else.
+  // ================================================================
+  const signed char b64_values[256] = {
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -2,  -2,  -1,  -1,  -2,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -2,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  62,  -1,  -1,  -1,  63,
+     52,  53,  54,  55,  56,  57,  58,  59,  60,  61,  -1,  -1,  -1,  -3,  -1,  -1,
+     -1,   0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,
+     15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25,  -1,  -1,  -1,  -1,  -1,
+     -1,  26,  27,  28,  29,  30,  31,  32,  33,  34,  35,  36,  37,  38,  39,  40,
+     41,  42,  43,  44,  45,  46,  47,  48,  49,  50,  51,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+  };
+
+  // ================================================================
+  // Encode up to one line (48 bytes) without the new line.
+  // It is the same as EVP_EncodeBlock().
+  // ================================================================
+  size_t encode_block(const uchar* in, size_t len, uchar* out)
+  {
+    uchar* beg = out;
+    for(;len >= 3;len -= 3, in += 3) {
+      unsigned long v = (in[0] << 16) | (in[1] << 8) | in[2];
+      *out++ = b64_chars[(v >> 18) & 0x3f];
+      *out++ = b64_chars[(v >> 12) & 0x3f];
+      *out++ = b64_chars[(v >> 6) & 0x3f];
+      *out++ = b64_chars[v & 0x3f];
+    }
+    if (len) {
+      unsigned long v = in[0] << 16;
+      if (len == 2) {
+        v |= in[1] << 8;
+      }
+      *out++ = b64_chars[(v >> 18) & 0x3f];
+      *out++ = b64_chars[(v >> 12) & 0x3f];
+      *out++ = len == 2 ? b64_chars[(v >> 6) & 0x3f] : '=';
+      *out++ = '=';
+    }
+    return out - beg;
+  }
+
+  // ================================================================
+  // Vector inner loops.
+  //
+  // encode_line encodes 48 bytes into 64 characters, it reads 4
+  // bytes past the end of the line. decode_run decodes 16 or 32
+  // character blocks until it finds a character that is not in
+  // the alphabet (a new line, a pad or an error) which the scalar
+  // code handles. It writes 4 or 8 bytes past the decoded data so
+  // it stops while that is still covered by decode_size().
+  // ================================================================
+  typedef void (*encode_line_fn)(const uchar* in, uchar* out);
+  typedef size_t (*decode_run_fn)(const uchar* in, size_t len, uchar* out, size_t* outlen);
+
+  encode_line_fn g_encode_line = 0; // 0 is scalar
+  decode_run_fn  g_decode_run  = 0;
+  Base64::Impl   g_impl        = Base64::SCALAR;
+
+#ifdef BASE64_X86
+  // ================================================================
+  // SSE4.1: 12 bytes to 16 characters.
+  // The bytes of each 3 byte group are spread over a 32 bit lane
+  // and the four 6 bit indices are moved into place with
+  // multiplies. The indices are mapped to characters by adding
+  // an offset that is looked up by range.
+  // ================================================================
+  __attribute__((target("sse4.1")))
+  inline __m128i enc_sse41(__m128i in)
+  {
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                           4, 5, 3, 4, 1, 2, 0, 1));
+    __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    __m128i idx = _mm_or_si128(t1, t3);
+
+    const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+                                        '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                        '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                        '/' - 63, 'A', 0, 0);
+    __m128i r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+    __m128i lt = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+    r = _mm_or_si128(r, _mm_and_si128(lt, _mm_set1_epi8(13)));
+    return _mm_add_epi8(idx, _mm_shuffle_epi8(shift, r));
+  }
+
+  __attribute__((target("sse4.1")))
+  void encode_line_sse41(const uchar* in, uchar* out)
+  {
+    for(int i=0;i<4;++i) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(in + 12 * i));
+      _mm_storeu_si128((__m128i*)(out + 16 * i), enc_sse41(v));
+    }
+  }
+
+  // ================================================================
+  // SSE4.1: 16 characters to 12 bytes.
+  // The characters are classified by their high and low nibbles,
+  // a character is valid if the two class masks do not overlap.
+  // The 6 bit values are packed with multiply-add instructions.
+  // ================================================================
+  __attribute__((target("sse4.1"), always_inline))
+  inline bool dec_sse41(const uchar* in, uchar* out)
+  {
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                         0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                         0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                           0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_2f = _mm_set1_epi8(0x2f);
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                       -1, -1, -1, -1);
+    __m128i s  = _mm_loadu_si128((const __m128i*)in);
+    __m128i hn = _mm_and_si128(_mm_srli_epi32(s, 4), mask_2f);
+    __m128i ln = _mm_and_si128(s, mask_2f);
+    __m128i hi = _mm_shuffle_epi8(lut_hi, hn);
+    __m128i lo = _mm_shuffle_epi8(lut_lo, ln);
+    if (!_mm_testz_si128(lo, hi)) {
+      return false;
+    }
+    __m128i eq = _mm_cmpeq_epi8(s, mask_2f);
+    s = _mm_add_epi8(s, _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq, hn)));
+    s = _mm_maddubs_epi16(s, _mm_set1_epi32(0x01400140));
+    s = _mm_madd_epi16(s, _mm_set1_epi32(0x00011000));
+    _mm_storeu_si128((__m128i*)out, _mm_shuffle_epi8(s, pack));
+    return true;
+  }
+
+  __attribute__((target("sse4.1")))
+  size_t decode_run_sse41(const uchar* in, size_t len, uchar* out, size_t* outlen)
+  {
+    size_t i = 0;
+    uchar* p = out;
+    for(;len - i >= 32 && dec_sse41(in + i, p);i += 16, p += 12) {
+    }
+    *outlen = p - out;
+    return i;
+  }
+
+  // ================================================================
+  // AVX2: the same as SSE4.1 with two 128 bit lanes, 24 bytes to
+  // 32 characters and back.
+  // ================================================================
+  __attribute__((target("avx2")))
+  void encode_line_avx2(const uchar* in, uchar* out)
+  {
+    const __m256i shuf = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                         4, 5, 3, 4, 1, 2, 0, 1,
+                                         10, 11, 9, 10, 7, 8, 6, 7,
+                                         4, 5, 3, 4, 1, 2, 0, 1);
+    const __m256i shift = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                           '/' - 63, 'A', 0, 0,
+                                           'a' - 26, '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                           '/' - 63, 'A', 0, 0);
+    for(int i=0;i<2;++i) {
+      const uchar* s = in + 24 * i;
+      __m256i v = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)s)),
+        _mm_loadu_si128((const __m128i*)(s + 12)), 1);
+      v = _mm256_shuffle_epi8(v, shuf);
+      __m256i t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+      __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+      __m256i t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+      __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+      __m256i idx = _mm256_or_si256(t1, t3);
+      __m256i r = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+      __m256i lt = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+      r = _mm256_or_si256(r, _mm256_and_si256(lt, _mm256_set1_epi8(13)));
+      r = _mm256_add_epi8(idx, _mm256_shuffle_epi8(shift, r));
+      _mm256_storeu_si256((__m256i*)(out + 32 * i), r);
+    }
+  }
+
+  __attribute__((target("avx2")))
+  size_t decode_run_avx2(const uchar* in, size_t len, uchar* out, size_t* outlen)
+  {
+    const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+                                            0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                            0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                              0, 0, 0, 0, 0, 0, 0, 0,
+                                              0, 16, 19, 4, -65, -65, -71, -71,
+                                              0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                          -1, -1, -1, -1,
+                                          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                          -1, -1, -1, -1);
+    const __m256i perm = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    size_t i = 0;
+    uchar* p = out;
+    for(;len - i >= 64;i += 32, p += 24) {
+      __m256i s  = _mm256_loadu_si256((const __m256i*)(in + i));
+      __m256i hn = _mm256_and_si256(_mm256_srli_epi32(s, 4), mask_2f);
+      __m256i ln = _mm256_and_si256(s, mask_2f);
+      __m256i hi = _mm256_shuffle_epi8(lut_hi, hn);
+      __m256i lo = _mm256_shuffle_epi8(lut_lo, ln);
+      if (!_mm256_testz_si256(lo, hi)) {
+        break;
+      }
+      __m256i eq = _mm256_cmpeq_epi8(s, mask_2f);
+      s = _mm256_add_epi8(s, _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq, hn)));
+      s = _mm256_maddubs_epi16(s, _mm256_set1_epi32(0x01400140));
+      s = _mm256_madd_epi16(s, _mm256_set1_epi32(0x00011000));
+      s = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(s, pack), perm);
+      _mm256_storeu_si256((__m256i*)p, s);
+    }
+    // Finish the line with 16 character blocks.
+    for(;len - i >= 32 && dec_sse41(in + i, p);i += 16, p += 12) {
+    }
+    *outlen = p - out;
+    return i;
+  }
+#endif
+
+  // ================================================================
+  // Select the best inner loops when the library is loaded.
+  // ================================================================
+  struct select_t
+  {
+    select_t() { Base64::select(Base64::AUTO); }
+  } g_select;
+}
+
+// ================================================================
+// encode
+// ================================================================
+size_t Base64::encode(const uchar* in, size_t len, uchar* out)
+{
+  uchar* beg = out;
+  if (g_encode_line) {
+    for(;len >= 52;len -= 48, in += 48) {
+      g_encode_line(in, out);
+      out[64] = '\n';
+      out += 65;
+    }
+  }
+  while (len) {
+    size_t n = len < 48 ? len : 48;
+    out += encode_block(in, n, out);
+    *out++ = '\n';
+    in += n;
+    len -= n;
+  }
+  return out - beg;
+}
+
+// ================================================================
+// select
+// ================================================================
+bool Base64::select(Impl impl)
+{
+  bool sse41 = false;
+  bool avx2  = false;
+#ifdef BASE64_X86
+  __builtin_cpu_init();
+  sse41 = __builtin_cpu_supports("ssse3") && __builtin_cpu_supports("sse4.1");
+  avx2  = sse41 && __builtin_cpu_supports("avx2");
+#endif
+  if (impl == AUTO) {
+    impl = avx2 ? AVX2 : sse41 ? SSE41 : SCALAR;
+  }
+  if ((impl == SSE41 && !sse41) || (impl == AVX2 && !avx2)) {
+    return false;
+  }
+  g_encode_line = 0;
+  g_decode_run  = 0;
+#ifdef BASE64_X86
+  if (impl == SSE41) {
+    g_encode_line = encode_line_sse41;
+    g_decode_run  = decode_run_sse41;
+  }
+  else if (impl == AVX2) {
+    g_encode_line = encode_line_avx2;
+    g_decode_run  = decode_run_avx2;
+  }
+#endif
+  g_impl = impl;
+  return true;
+}
+
+// ================================================================
+// impl
+// ================================================================
+string Base64::impl()
+{
+  switch (g_impl) {
+  case SSE41: return "sse4.1";
+  case AVX2:  return "avx2";
+  default:    return "scalar";
+  }
+}
+
+// ================================================================
+// Decoder::decode
+// ================================================================
+size_t Base64::Decoder::decode(const uchar* in, size_t len, uchar* out)
+{
+  uchar* beg = out;
+  for(size_t i=0;i<len;) {
+    // The vector loop runs between line breaks.
+    if (g_decode_run && m_n == 0 && !m_pad) {
+      size_t n = 0;
+      i += g_decode_run(in + i, len - i, out, &n);
+      out += n;
+      if (i == len) {
+        break;
+      }
+    }
+    int v = b64_values[in[i++]];
+    if (v >= 0) {
+      if (m_pad) {
+        throw runtime_error("invalid MIME data after the padding");
+      }
+      m_acc = (m_acc << 6) | v;
+      if (++m_n == 4) {
+        *out++ = (uchar)(m_acc >> 16);
+        *out++ = (uchar)(m_acc >> 8);
+        *out++ = (uchar)m_acc;
+        m_acc = 0;
+        m_n = 0;
+      }
+    }
+    else if (v == -3) {
+      if (!m_pad) {
+        out += flush(out);
+        m_pad = true;
+      }
+    }
+    else if (v == -1) {
+      throw runtime_error("invalid MIME data");
+    }
+  }
+  return out - beg;
+}
+
+// ================================================================
+// Decoder::finish
+// ================================================================
+size_t Base64::Decoder::finish(uchar* out)
+{
+  return flush(out);
+}
+
+// ================================================================
+// Decoder::flush - decode a partial group.
+// ================================================================
+size_t Base64::Decoder::flush(uchar* out)
+{
+  size_t n = 0;
+  if (m_n == 1) {
+    throw runtime_error("truncated MIME data");
+  }
+  else if (m_n > 1) {
+    unsigned long acc = m_acc << (6 * (4 - m_n));
+    out[n++] = (uchar)(acc >> 16);
+    if (m_n == 3) {
+      out[n++] = (uchar)(acc >> 8);
+    }
+  }
+  m_acc = 0;
+  m_n = 0;
+  return n;
+}
@@ -0,0 +1,140 @@
+// ================================================================
+// Description: Base64 (MIME) codec.
+// Copyright:   Copyright (c) 2012 by Joe Linoff
+// Version:     1.3.0
+// Author:      Joe Linoff
+//
+// LICENSE
+//   The cipher package is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of the
+//   License, or (at your option) any later version.
+//
+//   The cipher package is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details. You should have received
+//   a copy of the GNU General Public License along with the change
+//   tool; if not, write to the Free Software Foundation, Inc., 59
+//   Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+// ================================================================
+#ifndef base64_h
+#define base64_h
+
+#include <string>
+#include <cstddef>
+
+/**
+ * Base64 (MIME) encoder and decoder.
+ *
+ * It produces the same 64 column, new line terminated format as
+ * openssl enc -a (the BIO_f_base64 filter) without the overhead of
+ * a BIO chain. There are SSE4.1 and AVX2 versions of the inner
+ * loops that are selected at runtime based on the CPU and a
+ * scalar version for everything else.
+ *
+ * Here is how you would use it.
+ * @code
+ *   vector<uchar> mt(Base64::encode_size(len));
+ *   mt.resize(Base64::encode(data, len, &mt[0]));
+ *
+ *   Base64::Decoder dec;
+ *   vector<uchar> ct(Base64::decode_size(mt.size()));
+ *   size_t n = dec.decode(&mt[0], mt.size(), &ct[0]);
+ *   n += dec.finish(&ct[n]);
+ * @endcode
+ * @author Joe Linoff
+ */
+class Base64
+{
+public:
+  typedef unsigned char uchar;
+
+  /**
+   * The inner loop implementations.
+   */
+  enum Impl
+  {
+    AUTO,   ///< The best one for this CPU.
+    SCALAR, ///< Portable C++.
+    SSE41,  ///< SSSE3 and SSE4.1 instructions.
+    AVX2    ///< AVX2 instructions.
+  };
+
+  /**
+   * Incremental decoder.
+   *
+   * White space is skipped so the line breaks can fall anywhere,
+   * this covers the openssl -A (single line) format and the short
+   * (64 characters or less) messages that have no new line.
+   */
+  class Decoder
+  {
+  public:
+    Decoder() : m_acc(0), m_n(0), m_pad(false) {}
+    /**
+     * Decode the next piece of the data.
+     * @param in   The MIME text.
+     * @param len  The MIME text length.
+     * @param out  The binary data, it must have room for
+     *             decode_size(len) bytes.
+     * @returns The number of bytes written to out.
+     * @throws runtime_error If the data is not valid.
+     */
+    size_t decode(const uchar* in, size_t len, uchar* out);
+    /**
+     * Decode the last group if it was not padded.
+     * @param out  The binary data, it must have room for 2 bytes.
+     * @returns The number of bytes written to out.
+     * @throws runtime_error If the data is truncated.
+     */
+    size_t finish(uchar* out);
+  private:
+    size_t flush(uchar* out);
+  private:
+    unsigned long m_acc;
+    int           m_n;
+    bool          m_pad;
+  };
+public:
+  /**
+   * Encode whole lines of data. Every 48 input bytes become 64
+   * characters and a new line, the last line may be short. There
+   * is no state so independent segments can be encoded in parallel
+   * if they start on a 48 byte boundary.
+   * @param in   The binary data.
+   * @param len  The binary data length.
+   * @param out  The MIME text, it must have room for
+   *             encode_size(len) bytes.
+   * @returns The number of bytes written to out.
+   */
+  static size_t encode(const uchar* in, size_t len, uchar* out);
+
+  /**
+   * Get the size of the encoded data, including the new lines.
+   * @param len  The binary data length.
+   */
+  static size_t encode_size(size_t len) {return (len + 2) / 3 * 4 + (len + 47) / 48;}
+
+  /**
+   * Get the largest size of the decoded data.
+   * @param len  The MIME text length.
+   */
+  static size_t decode_size(size_t len) {return (len / 4 + 1) * 3;}
+
+  /**
+   * Select the inner loops. It is useful for testing and
+   * benchmarking, the default is AUTO.
+   * @param impl  The implementation.
+   * @returns False if the CPU does not support it.
+   */
+  static bool select(Impl impl);
+
+  /**
+   * Get the name of the selected inner loops.
+   * @returns "scalar", "sse4.1" or "avx2".
+   */
+  static std::string impl();
+};
+
+#endif
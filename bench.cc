@@ -0,0 +1,859 @@
+// ================================================================
+// Description: Cipher benchmark program.
+// Copyright:   Copyright (c) 2012 by Joe Linoff
+// Version:     1.3.0
+// Author:      Joe Linoff
+// ================================================================
+#include "cipher.h"
+#include "base64.h"
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <cstdlib> // exit, atoi, mkstemp
+#include <cstdio>  // remove
+#include <ctime>   // clock_gettime
+#include <new>
+#include <unistd.h> // close
+#include <openssl/crypto.h>
+#include <openssl/bio.h>
+#include <openssl/buffer.h>
+#include <openssl/rand.h>
+using namespace std;
+
+// ================================================================
+// Count the C++ heap allocations as well.
+// ================================================================
+namespace { unsigned long g_news = 0; }
+void* operator new(size_t n)
+{
+  ++g_news;
+  void* p = malloc(n ? n : 1);
+  if (!p) {
+    throw bad_alloc();
+  }
+  return p;
+}
+void* operator new[](size_t n) {return operator new(n);}
+void operator delete(void* p) throw() {free(p);}
+void operator delete[](void* p) throw() {free(p);}
+void operator delete(void* p, size_t) throw() {free(p);}
+void operator delete[](void* p, size_t) throw() {free(p);}
+
+namespace
+{
+  // ================================================================
+  // Count the allocations made by OpenSSL.
+  // The hooks must be installed before OpenSSL allocates anything.
+  // ================================================================
+  unsigned long g_allocs = 0;
+
+  void* count_malloc(size_t n, const char*, int)
+  {
+    ++g_allocs;
+    return malloc(n);
+  }
+  void* count_realloc(void* p, size_t n, const char*, int)
+  {
+    ++g_allocs;
+    return realloc(p, n);
+  }
+  void count_free(void* p, const char*, int)
+  {
+    free(p);
+  }
+
+  // ================================================================
+  // Monotonic time in nanoseconds.
+  // ================================================================
+  double now_ns()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+  }
+
+  // ================================================================
+  // Report one result.
+  // ================================================================
+  void report(const string& name,
+              size_t size,
+              uint iters,
+              double ns,
+              unsigned long allocs)
+  {
+    cout << left << setw(28) << name
+         << right << setw(8) << size << " B"
+         << setw(12) << fixed << setprecision(1) << ns / iters << " ns/op"
+         << setw(10) << setprecision(1) << double(size) * iters * 1e9 / ns / (1 << 20) << " MB/s"
+         << setw(10) << setprecision(2) << double(allocs) / iters << " allocs/op"
+         << endl;
+  }
+
+  // ================================================================
+  // bench_ctx_pool - encode_cipher/decode_cipher with and without
+  // the cipher context pool.
+  // ================================================================
+  void bench_ctx_pool(uint iters)
+  {
+    size_t sizes[] = {16, 256, 4096};
+    for(uint i=0;i<sizeof(sizes)/sizeof(sizes[0]);++i) {
+      string plaintext(sizes[i], 'x');
+      for(uint pool=0;pool<2;++pool) {
+        Cipher c;
+        c.ctx_pool_size(pool ? CIPHER_DEFAULT_CTX_POOL_SIZE : 0);
+        Cipher::Key k;
+        c.make_key(k, "Tally Ho!", "12345678");
+
+        unsigned long a0 = g_allocs;
+        double t0 = now_ns();
+        Cipher::kv1_t x(0, 0);
+        for(uint j=0;j<iters;++j) {
+          delete [] x.first;
+          x = c.encode_cipher(k, plaintext);
+        }
+        double t1 = now_ns();
+        report(pool ? "encode_cipher (pool)" : "encode_cipher (no pool)",
+               sizes[i], iters, t1-t0, g_allocs-a0);
+
+        a0 = g_allocs;
+        t0 = now_ns();
+        for(uint j=0;j<iters;++j) {
+          c.decode_cipher(k, x.first+16, x.second-16);
+        }
+        t1 = now_ns();
+        report(pool ? "decode_cipher (pool)" : "decode_cipher (no pool)",
+               sizes[i], iters, t1-t0, g_allocs-a0);
+        delete [] x.first;
+      }
+    }
+  }
+
+  // ================================================================
+  // bench_buffer_api - the string and the buffer versions of
+  // encrypt() and decrypt(). The allocations include the C++ heap.
+  // ================================================================
+  void bench_buffer_api(uint iters)
+  {
+    size_t sizes[] = {16, 256, 4096};
+    for(uint i=0;i<sizeof(sizes)/sizeof(sizes[0]);++i) {
+      string plaintext(sizes[i], 'x');
+      Cipher c;
+      string ct = c.encrypt(plaintext, "Tally Ho!", "12345678"); // derive the key
+
+      unsigned long a0 = g_allocs + g_news;
+      double t0 = now_ns();
+      for(uint j=0;j<iters;++j) {
+        c.encrypt(plaintext, "Tally Ho!", "12345678");
+      }
+      double t1 = now_ns();
+      report("encrypt (string)", sizes[i], iters, t1-t0, g_allocs+g_news-a0);
+
+      a0 = g_allocs + g_news;
+      t0 = now_ns();
+      for(uint j=0;j<iters;++j) {
+        c.decrypt(ct, "Tally Ho!");
+      }
+      t1 = now_ns();
+      report("decrypt (string)", sizes[i], iters, t1-t0, g_allocs+g_news-a0);
+
+      vector<Cipher::uchar> out(c.max_output_size(plaintext.size()));
+      vector<Cipher::uchar> back(c.max_output_size(out.size(), false));
+      const Cipher::uchar* pt = (const Cipher::uchar*)plaintext.data();
+      size_t n = 0;
+      a0 = g_allocs + g_news;
+      t0 = now_ns();
+      for(uint j=0;j<iters;++j) {
+        n = c.encrypt(pt, plaintext.size(), &out[0], out.size(), "Tally Ho!", "12345678");
+      }
+      t1 = now_ns();
+      report("encrypt (buffer)", sizes[i], iters, t1-t0, g_allocs+g_news-a0);
+
+      a0 = g_allocs + g_news;
+      t0 = now_ns();
+      for(uint j=0;j<iters;++j) {
+        c.decrypt(&out[0], n, &back[0], back.size(), "Tally Ho!");
+      }
+      t1 = now_ns();
+      report("decrypt (buffer)", sizes[i], iters, t1-t0, g_allocs+g_news-a0);
+    }
+  }
+
+  // ================================================================
+  // The BIO_f_base64 chain that encode_base64() and decode_base64()
+  // used before the Base64 codec.
+  // ================================================================
+  string bio_encode(const Cipher::uchar* in, size_t len)
+  {
+    BIO* b64 = BIO_push(BIO_new(BIO_f_base64()), BIO_new(BIO_s_mem()));
+    BIO_write(b64, in, len);
+    BIO_flush(b64);
+    BUF_MEM *bptr=0;
+    BIO_get_mem_ptr(b64, &bptr);
+    string ret(bptr->data, bptr->length-1);
+    BIO_free_all(b64);
+    return ret;
+  }
+
+  size_t bio_decode(const string& mt, Cipher::uchar* out)
+  {
+    BIO* b64 = BIO_new(BIO_f_base64());
+    if (mt.size() <= 64) {
+      BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
+    }
+    BIO* bm = BIO_push(b64, BIO_new_mem_buf(mt.data(), mt.size()));
+    int n = BIO_read(bm, out, mt.size());
+    BIO_free_all(bm);
+    return n > 0 ? n : 0;
+  }
+
+  // ================================================================
+  // bench_base64 - the BIO chain and the Base64 implementations.
+  // ================================================================
+  void bench_base64(uint iters)
+  {
+    typedef Cipher::uchar uchar;
+    size_t sizes[] = {48, 4096, 65536};
+    for(uint i=0;i<sizeof(sizes)/sizeof(sizes[0]);++i) {
+      vector<uchar> data(sizes[i]);
+      for(size_t j=0;j<data.size();++j) {
+        data[j] = (uchar)(j * 131);
+      }
+      uint n = iters * 48 / sizes[i] + 1; // about the same bytes per size
+      vector<uchar> mt(Base64::encode_size(sizes[i]));
+      vector<uchar> out(Base64::decode_size(mt.size()));
+      string ref = bio_encode(&data[0], data.size());
+
+      double t0 = now_ns();
+      for(uint j=0;j<n;++j) {
+        bio_encode(&data[0], data.size());
+      }
+      double t1 = now_ns();
+      report("base64 encode (BIO)", sizes[i], n, t1-t0, 0);
+      t0 = now_ns();
+      for(uint j=0;j<n;++j) {
+        bio_decode(ref, &out[0]);
+      }
+      t1 = now_ns();
+      report("base64 decode (BIO)", sizes[i], n, t1-t0, 0);
+
+      Base64::Impl impls[] = {Base64::SCALAR, Base64::SSE41, Base64::AVX2};
+      for(uint k=0;k<sizeof(impls)/sizeof(impls[0]);++k) {
+        if (!Base64::select(impls[k])) {
+          continue;
+        }
+        size_t len = 0;
+        t0 = now_ns();
+        for(uint j=0;j<n;++j) {
+          len = Base64::encode(&data[0], data.size(), &mt[0]);
+        }
+        t1 = now_ns();
+        report("base64 encode (" + Base64::impl() + ")", sizes[i], n, t1-t0, 0);
+        t0 = now_ns();
+        for(uint j=0;j<n;++j) {
+          Base64::Decoder dec;
+          dec.decode(&mt[0], len, &out[0]);
+        }
+        t1 = now_ns();
+        report("base64 decode (" + Base64::impl() + ")", sizes[i], n, t1-t0, 0);
+      }
+      Base64::select(Base64::AUTO);
+    }
+  }
+
+  // ================================================================
+  // Report a record rate.
+  // ================================================================
+  void report_rate(const string& name, size_t size, size_t n, double ns)
+  {
+    cout << left << setw(28) << name
+         << right << setw(8) << size << " B"
+         << setw(12) << fixed << setprecision(1) << ns / n << " ns/op"
+         << setw(12) << setprecision(0) << n * 1e9 / ns << " records/s"
+         << endl;
+  }
+
+  // ================================================================
+  // bench_batch - many 200 byte records, one call per record and
+  // one call per batch.
+  // ================================================================
+  void bench_batch(uint iters)
+  {
+    const size_t size = 200;
+    size_t n = iters / 10 + 1;
+    vector<string> records(n, string(size, 'x'));
+    vector<string> ct;
+    vector<string> pt;
+    string pass = "Tally Ho!";
+    string salt = "12345678";
+    Cipher c;
+
+    // The batch calls reuse the output strings, warm them up
+    // with the longest (shared key) records.
+    c.encrypt_batch(records, ct, pass, "", true);
+    c.decrypt_batch(ct, pt, pass, "", true);
+
+    double t0 = now_ns();
+    for(size_t i=0;i<n;++i) {
+      c.encrypt(records[i], pass);
+    }
+    report_rate("encrypt (random salt)", size, n, now_ns()-t0);
+    t0 = now_ns();
+    for(size_t i=0;i<n;++i) {
+      c.encrypt(records[i], pass, salt);
+    }
+    report_rate("encrypt (fixed salt)", size, n, now_ns()-t0);
+    t0 = now_ns();
+    c.encrypt_batch(records, ct, pass);
+    report_rate("encrypt_batch (random salt)", size, n, now_ns()-t0);
+    t0 = now_ns();
+    c.encrypt_batch(records, ct, pass, salt);
+    report_rate("encrypt_batch (fixed salt)", size, n, now_ns()-t0);
+    t0 = now_ns();
+    for(size_t i=0;i<n;++i) {
+      c.decrypt(ct[i], pass);
+    }
+    report_rate("decrypt", size, n, now_ns()-t0);
+    t0 = now_ns();
+    c.decrypt_batch(ct, pt, pass);
+    report_rate("decrypt_batch", size, n, now_ns()-t0);
+    t0 = now_ns();
+    c.encrypt_batch(records, ct, pass, "", true);
+    report_rate("encrypt_batch (shared key)", size, n, now_ns()-t0);
+    t0 = now_ns();
+    c.decrypt_batch(ct, pt, pass, "", true);
+    report_rate("decrypt_batch (shared key)", size, n, now_ns()-t0);
+  }
+
+  // ================================================================
+  // bench_salt - 8 byte salts straight from RAND_bytes() and from
+  // the per-thread pool.
+  // ================================================================
+  void bench_salt(uint iters)
+  {
+    typedef Cipher::uchar uchar;
+    uchar salt[8];
+    size_t n = iters * 10 + 1;
+    double t0 = now_ns();
+    for(size_t i=0;i<n;++i) {
+      RAND_bytes(salt, sizeof(salt));
+    }
+    report_rate("salt (RAND_bytes)", sizeof(salt), n, now_ns()-t0);
+    t0 = now_ns();
+    for(size_t i=0;i<n;++i) {
+      Cipher::random_bytes(salt, sizeof(salt));
+    }
+    report_rate("salt (pool)", sizeof(salt), n, now_ns()-t0);
+  }
+
+  // ================================================================
+  // bench_latency - small messages through the string API with a
+  // fixed salt and a key cache so that the per call overhead is
+  // what is measured. make bench runs it against the library with
+  // and without the debug output compiled in.
+  // ================================================================
+  void bench_latency(uint iters)
+  {
+    size_t sizes[] = {16, 64, 256};
+    for(uint i=0;i<sizeof(sizes)/sizeof(sizes[0]);++i) {
+      string plaintext(sizes[i], 'x');
+      Cipher::KeyCache kc;
+      Cipher c;
+      c.key_cache(&kc);
+      string ct = c.encrypt(plaintext, "Tally Ho!", "12345678");
+
+      // Take the best of several runs to filter out the noise.
+      double best_enc = 0;
+      double best_dec = 0;
+      for(uint r=0;r<5;++r) {
+        double t0 = now_ns();
+        for(uint j=0;j<iters;++j) {
+          c.encrypt(plaintext, "Tally Ho!", "12345678");
+        }
+        double t1 = now_ns();
+        for(uint j=0;j<iters;++j) {
+          c.decrypt(ct, "Tally Ho!");
+        }
+        double t2 = now_ns();
+        if (!r || t1-t0 < best_enc) {
+          best_enc = t1-t0;
+        }
+        if (!r || t2-t1 < best_dec) {
+          best_dec = t2-t1;
+        }
+      }
+      report("encrypt (latency)", sizes[i], iters, best_enc, 0);
+      report("decrypt (latency)", sizes[i], iters, best_dec, 0);
+    }
+  }
+
+  // ================================================================
+  // The benchmark suite measures each stage of the Cipher class
+  // over a range of sizes and reports the results as JSON so that
+  // they can be compared across releases.
+  // ================================================================
+  struct result_t
+  {
+    string        stage;
+    size_t        size;
+    uint          count;
+    unsigned long iters;
+    double        ns;
+  };
+
+  // ================================================================
+  // One stage of the suite. setup() is not timed, run() is.
+  // ================================================================
+  class stage_t
+  {
+  public:
+    stage_t(const string& name) : m_name(name), m_count(1) {}
+    virtual ~stage_t() {}
+    virtual void setup(size_t size) = 0;
+    virtual void run() = 0;
+    virtual void teardown() {}
+    const string& name() const {return m_name;}
+    uint count() const {return m_count;}
+  protected:
+    static string data(size_t size)
+    {
+      string d(size, 0);
+      for(size_t i=0;i<size;++i) {
+        d[i] = char(i * 131);
+      }
+      return d;
+    }
+  protected:
+    string m_name;
+    uint   m_count;
+  };
+
+  // ================================================================
+  // Run a stage until it has taken at least min_ns.
+  // ================================================================
+  result_t measure(stage_t& st, size_t size, double min_ns)
+  {
+    st.setup(size);
+    st.run(); // warm up
+    unsigned long n = 1;
+    double ns = 0;
+    while (true) {
+      double t0 = now_ns();
+      for(unsigned long i=0;i<n;++i) {
+        st.run();
+      }
+      ns = now_ns() - t0;
+      if (ns >= min_ns || n >= 100000000) {
+        break;
+      }
+      // Aim a little past the target so that it converges quickly.
+      double scale = ns > 0 ? 1.2 * min_ns / ns : 100;
+      n = scale > 100 ? n * 100 : (unsigned long)(n * scale) + 1;
+    }
+    st.teardown();
+    result_t r;
+    r.stage = st.name();
+    r.size = size;
+    r.count = st.count();
+    r.iters = n;
+    r.ns = ns;
+    return r;
+  }
+
+  // ================================================================
+  // Cipher stages.
+  // ================================================================
+  class encode_cipher_t : public stage_t
+  {
+  public:
+    encode_cipher_t() : stage_t("encode_cipher") {}
+    virtual void setup(size_t size)
+    {
+      m_pt = data(size);
+      m_c.make_key(m_k, "Tally Ho!", "12345678");
+    }
+    virtual void run()
+    {
+      Cipher::kv1_t x = m_c.encode_cipher(m_k, m_pt);
+      delete [] x.first;
+    }
+    virtual void teardown() {string().swap(m_pt);}
+  private:
+    Cipher      m_c;
+    Cipher::Key m_k;
+    string      m_pt;
+  };
+
+  class decode_cipher_t : public stage_t
+  {
+  public:
+    decode_cipher_t() : stage_t("decode_cipher"), m_ct(0, 0) {}
+    virtual void setup(size_t size)
+    {
+      m_c.make_key(m_k, "Tally Ho!", "12345678");
+      m_ct = m_c.encode_cipher(m_k, data(size));
+    }
+    virtual void run()
+    {
+      m_c.decode_cipher(m_k, m_ct.first+16, m_ct.second-16); // skip the salt prefix
+    }
+    virtual void teardown()
+    {
+      delete [] m_ct.first;
+      m_ct.first = 0;
+    }
+  private:
+    Cipher        m_c;
+    Cipher::Key   m_k;
+    Cipher::kv1_t m_ct;
+  };
+
+  class encode_base64_t : public stage_t
+  {
+  public:
+    encode_base64_t() : stage_t("encode_base64") {}
+    virtual void setup(size_t size) {m_data = data(size);}
+    virtual void run()
+    {
+      m_c.encode_base64((Cipher::uchar*)&m_data[0], m_data.size());
+    }
+    virtual void teardown() {string().swap(m_data);}
+  private:
+    Cipher m_c;
+    string m_data;
+  };
+
+  class decode_base64_t : public stage_t
+  {
+  public:
+    decode_base64_t() : stage_t("decode_base64") {}
+    virtual void setup(size_t size)
+    {
+      string d = data(size);
+      m_mt = m_c.encode_base64((Cipher::uchar*)&d[0], d.size());
+    }
+    virtual void run()
+    {
+      Cipher::kv1_t x = m_c.decode_base64(m_mt);
+      delete [] x.first;
+    }
+    virtual void teardown() {string().swap(m_mt);}
+  private:
+    Cipher m_c;
+    string m_mt;
+  };
+
+  // ================================================================
+  // The string API end to end: the old two pass path that
+  // materializes the whole intermediate buffer and the fused
+  // path that encrypt() and decrypt() use now.
+  // ================================================================
+  class two_pass_t : public stage_t
+  {
+  public:
+    two_pass_t(bool enc) : stage_t(enc ? "encrypt_two_pass" : "decrypt_two_pass"), m_enc(enc) {}
+    virtual void setup(size_t size)
+    {
+      m_pt = data(size);
+      m_mt = m_c.encrypt(m_pt, "Tally Ho!", "12345678");
+      m_c.make_key(m_k, "Tally Ho!", "12345678");
+    }
+    virtual void run()
+    {
+      if (m_enc) {
+        Cipher::kv1_t x = m_c.encode_cipher(m_k, m_pt);
+        m_c.encode_base64(x.first, x.second);
+        delete [] x.first;
+      }
+      else {
+        Cipher::kv1_t x = m_c.decode_base64(m_mt);
+        m_c.decode_cipher(m_k, x.first+16, x.second-16); // skip the salt prefix
+        delete [] x.first;
+      }
+    }
+    virtual void teardown()
+    {
+      string().swap(m_pt);
+      string().swap(m_mt);
+    }
+  private:
+    Cipher      m_c;
+    Cipher::Key m_k;
+    bool        m_enc;
+    string      m_pt;
+    string      m_mt;
+  };
+
+  class fused_t : public stage_t
+  {
+  public:
+    fused_t(bool enc) : stage_t(enc ? "encrypt_fused" : "decrypt_fused"), m_enc(enc) {}
+    virtual void setup(size_t size)
+    {
+      m_pt = data(size);
+      m_mt = m_c.encrypt(m_pt, "Tally Ho!", "12345678");
+    }
+    virtual void run()
+    {
+      if (m_enc) {
+        m_c.encrypt(m_pt, "Tally Ho!", "12345678");
+      }
+      else {
+        m_c.decrypt(m_mt, "Tally Ho!");
+      }
+    }
+    virtual void teardown()
+    {
+      string().swap(m_pt);
+      string().swap(m_mt);
+    }
+  private:
+    Cipher m_c;
+    bool   m_enc;
+    string m_pt;
+    string m_mt;
+  };
+
+  // ================================================================
+  // Key derivation. init() is private so it is measured through
+  // encrypt() with an empty plaintext and no key cache.
+  // ================================================================
+  class init_t : public stage_t
+  {
+  public:
+    init_t(uint count) : stage_t("init"), m_c("aes-256-cbc", "sha256", count) {m_count=count;}
+    virtual void setup(size_t) {}
+    virtual void run() {m_c.encrypt(string(), "Tally Ho!", "12345678");}
+  private:
+    Cipher m_c;
+  };
+
+  // ================================================================
+  // End to end file stages. The files are created in TMPDIR.
+  // ================================================================
+  string temp_file()
+  {
+    const char* dir = getenv("TMPDIR");
+    string fn = string(dir && dir[0] ? dir : "/tmp") + "/bench.XXXXXX";
+    vector<char> buf(fn.begin(), fn.end());
+    buf.push_back(0);
+    int fd = mkstemp(&buf[0]);
+    if (fd < 0) {
+      throw runtime_error("cannot create temporary file: "+fn);
+    }
+    close(fd);
+    return &buf[0];
+  }
+
+  class file_stage_t : public stage_t
+  {
+  public:
+    file_stage_t(const string& name, bool enc) : stage_t(name), m_enc(enc) {}
+    virtual void setup(size_t size)
+    {
+      m_pfn = temp_file();
+      m_cfn = temp_file();
+      m_ofn = temp_file();
+      m_c.file_write(m_pfn, data(size));
+      m_c.encrypt_file(m_pfn, m_cfn, "Tally Ho!", "12345678");
+    }
+    virtual void run()
+    {
+      if (m_enc) {
+        m_c.encrypt_file(m_pfn, m_ofn, "Tally Ho!", "12345678");
+      }
+      else {
+        m_c.decrypt_file(m_cfn, m_ofn, "Tally Ho!");
+      }
+    }
+    virtual void teardown()
+    {
+      remove(m_pfn.c_str());
+      remove(m_cfn.c_str());
+      remove(m_ofn.c_str());
+    }
+  private:
+    Cipher m_c;
+    bool   m_enc;
+    string m_pfn;
+    string m_cfn;
+    string m_ofn;
+  };
+
+  // ================================================================
+  // Write the results as JSON.
+  // ================================================================
+  void write_json(ostream& os, const vector<result_t>& results)
+  {
+    os << "{\n"
+       << "  \"cipher_version\": \"" << Cipher::get_version() << "\",\n"
+       << "  \"ssl_version\": \"" << Cipher::get_ssl_version() << "\",\n"
+       << "  \"cipher\": \"" << CIPHER_DEFAULT_CIPHER << "\",\n"
+       << "  \"digest\": \"" << CIPHER_DEFAULT_DIGEST << "\",\n"
+       << "  \"base64\": \"" << Base64::impl() << "\",\n"
+       << "  \"results\": [";
+    for(size_t i=0;i<results.size();++i) {
+      const result_t& r = results[i];
+      double ns_op = r.ns / r.iters;
+      double mbs = r.size ? double(r.size) * r.iters * 1e9 / r.ns / (1 << 20) : 0;
+      os << (i ? ",\n" : "\n")
+         << "    {\"stage\": \"" << r.stage << "\""
+         << ", \"size\": " << r.size
+         << ", \"count\": " << r.count
+         << ", \"iters\": " << r.iters
+         << fixed << setprecision(1)
+         << ", \"ns_per_op\": " << ns_op
+         << ", \"mb_per_s\": " << mbs
+         << "}";
+    }
+    os << "\n  ]\n}\n";
+  }
+
+  // ================================================================
+  // bench_suite - every stage from 16 bytes up to max bytes.
+  // ================================================================
+  void bench_suite(size_t max, double min_ns, const string& ofn, bool verbose)
+  {
+    vector<result_t> results;
+
+    encode_cipher_t ec;
+    decode_cipher_t dc;
+    encode_base64_t eb;
+    decode_base64_t db;
+    two_pass_t   e2(true);
+    two_pass_t   d2(false);
+    fused_t      efu(true);
+    fused_t      dfu(false);
+    file_stage_t ef("encrypt_file", true);
+    file_stage_t df("decrypt_file", false);
+    stage_t* stages[] = {&ec, &dc, &eb, &db, &e2, &efu, &d2, &dfu, &ef, &df};
+
+    // Powers of 16 from 16 bytes and the maximum itself.
+    vector<size_t> sizes;
+    for(size_t size=16; size<max; size*=16) {
+      sizes.push_back(size);
+    }
+    sizes.push_back(max);
+
+    for(size_t i=0;i<sizeof(stages)/sizeof(stages[0]);++i) {
+      for(size_t j=0;j<sizes.size();++j) {
+        size_t size = sizes[j];
+        results.push_back(measure(*stages[i], size, min_ns));
+        if (verbose) {
+          const result_t& r = results.back();
+          cerr << left << setw(28) << r.stage
+               << right << setw(12) << r.size << " B"
+               << setw(14) << fixed << setprecision(1) << r.ns / r.iters << " ns/op"
+               << setw(10) << setprecision(1) << double(r.size) * r.iters * 1e9 / r.ns / (1 << 20) << " MB/s"
+               << endl;
+        }
+      }
+    }
+
+    uint counts[] = {1, 1000, 10000};
+    for(uint i=0;i<sizeof(counts)/sizeof(counts[0]);++i) {
+      init_t st(counts[i]);
+      results.push_back(measure(st, 0, min_ns));
+      if (verbose) {
+        const result_t& r = results.back();
+        cerr << left << setw(28) << "init" << right << setw(12) << r.count << " rounds"
+             << setw(14) << fixed << setprecision(1) << r.ns / r.iters << " ns/op" << endl;
+      }
+    }
+
+    if (ofn.empty() || ofn == "-") {
+      write_json(cout, results);
+    }
+    else {
+      ofstream ofs(ofn.c_str());
+      write_json(ofs, results);
+      if (!ofs) {
+        throw runtime_error("cannot write file: "+ofn);
+      }
+    }
+  }
+
+  // ================================================================
+  // Parse a size with an optional K, M or G suffix.
+  // ================================================================
+  size_t parse_size(const string& s)
+  {
+    char* end = 0;
+    double n = strtod(s.c_str(), &end);
+    switch (*end) {
+    case 'k': case 'K': n *= 1 << 10; break;
+    case 'm': case 'M': n *= 1 << 20; break;
+    case 'g': case 'G': n *= 1 << 30; break;
+    case 0: break;
+    default:
+      throw runtime_error("invalid size: "+s);
+    }
+    return size_t(n);
+  }
+}
+
+// ================================================================
+// MAIN
+// ================================================================
+int main(int argc,char** argv)
+{
+  CRYPTO_set_mem_functions(count_malloc, count_realloc, count_free);
+  uint iters = 100000;
+  bool suite = false;
+  bool latency = false;
+  bool verbose = false;
+  size_t max = size_t(1) << 30;
+  double min_ms = 250;
+  string ofn;
+  for(int i=1;i<argc;++i) {
+    string opt = argv[i];
+    if (opt=="-n" && i+1<argc) {
+      iters = atoi(argv[++i]);
+    }
+    else if (opt=="-s") {
+      suite = true;
+    }
+    else if (opt=="-l") {
+      latency = true;
+    }
+    else if (opt=="-m" && i+1<argc) {
+      max = parse_size(argv[++i]);
+    }
+    else if (opt=="-t" && i+1<argc) {
+      min_ms = atof(argv[++i]);
+    }
+    else if (opt=="-o" && i+1<argc) {
+      ofn = argv[++i];
+    }
+    else if (opt=="-v") {
+      verbose = true;
+    }
+    else {
+      cout << "ERROR: unrecognized option " << opt << endl;
+      exit(1);
+    }
+  }
+  try {
+    if (suite) {
+      bench_suite(max, min_ms * 1e6, ofn, verbose);
+      return 0;
+    }
+    if (latency) {
+      bench_latency(iters);
+      return 0;
+    }
+    bench_ctx_pool(iters);
+    bench_buffer_api(iters);
+    bench_base64(iters);
+    bench_batch(iters);
+    bench_salt(iters);
+  }
+  catch (exception& e) {
+    cerr << "ERROR: " << e.what() << endl;
+    return 1;
+  }
+  return 0;
+}
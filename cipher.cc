@@ -19,6 +19,9 @@
 //   Temple Place, Suite 330, Boston, MA 02111-1307 USA.
 // ================================================================
 #include "cipher.h"
+#include "thread_pool.h"
+#include "base64.h"
+#include "async_io.h"
 #include <fstream>
 #include <iostream>
 #include <iomanip>
@@ -26,18 +29,39 @@
 #include <vector>
 #include <stdexcept>
 #include <sstream>
+#include <deque>
 #include <cstring>        // strlen
+#include <cctype>         // isspace
+#include <cerrno>         // errno
 #include <cstdlib>        // getenv
 #include <unistd.h>       // getdomainname
+#include <sys/stat.h>     // stat
+#include <sys/mman.h>     // mmap
+#include <fcntl.h>        // open
+#include <cstdio>         // rename, remove
+#include <ctime>          // clock_gettime, nanosleep
+#include <sched.h>        // sched_yield
+#include <sys/syscall.h>  // SYS_getrandom
+#include <stdint.h>       // uint32_t
 #include <openssl/aes.h>
-#include <openssl/bio.h>
+#include <openssl/crypto.h>
 #include <openssl/evp.h>
-#include <openssl/buffer.h>
+#include <openssl/rand.h>
+#ifdef CIPHER_HAVE_ARGON2
+#include <openssl/core_names.h>
+#include <openssl/kdf.h>
+#include <openssl/params.h>
+#include <openssl/thread.h>
+#endif
 using namespace std;
 
 // ================================================================
 // MACROS
+// The debug output is only compiled in if CIPHER_DEBUG is
+// defined (the dbg/ build), otherwise the macros are empty and
+// debug() has no effect.
 // ================================================================
+#ifdef CIPHER_DEBUG
 #define DBG_PRE __FILE__ << ":" << __LINE__ << ": "
 #define DBG_FCT(fct)    if(m_debug) cout << DBG_PRE << "FCT " << fct << endl
 #define DBG_TDUMP(v)    if(m_debug) tdump(__FILE__, __LINE__, #v, v)
@@ -47,11 +71,33 @@ using namespace std;
 #define DBG_MDUMP(a)    if(m_debug) bdump(__FILE__, __LINE__, #a, (unsigned char*)a.c_str(), a.size())
 #define DBG_MADEIT       cout << DBG_PRE << "MADE IT" << endl
 #define PKV(v)           vdump(__FILE__, __LINE__, #v, v)
+#else
+#define DBG_FCT(fct)
+#define DBG_TDUMP(v)
+#define DBG_PKV(v)
+#define DBG_PKVR(k, v)
+#define DBG_BDUMP(a, x)
+#define DBG_MDUMP(a)
+#define DBG_MADEIT
+#endif
 
 #define SALTED_PREFIX    "Salted__"
+#define AEAD_MAGIC       "CTAEAD"
+#define AEAD_MAGIC_B64   "Q1RBRUFE" // AEAD_MAGIC MIME encoded
+#define AEAD_VERSION     1
+#define AEAD_HEADER_LEN  32
+#define AEAD_NONCE_LEN   12
+#define AEAD_TAG_LEN     16
+#define AEAD_MAX_CHUNK   (64 * 1024 * 1024)
+#define FUSED_BLOCK      (48 * 1024) // binary bytes per block, 64K MIME
+#define PIPE_DEPTH       4           // chunks in flight per pipeline stage
+#define AIO_DEPTH        8           // reads or writes in flight per file
+#define RAND_POOL_SIZE   4096        // random bytes buffered per thread
+#define SCRYPT_MAX_MEM   (1ULL << 30) // scrypt bytes in use at once, like maxmem
 
 namespace
 {
+#ifdef CIPHER_DEBUG
   // ================================================================
   // DEBUG mode only.
   // Formated dump of a general type.
@@ -81,7 +127,7 @@ namespace
   }
   // ================================================================
   // DEBUG mode only.
-  // Dump for fixed sized types like m_salt and m_key.
+  // Dump for fixed sized types like the salt and the key.
   // ================================================================
   template<typename T> void tdump(const string& fn,
                                   uint ln,
@@ -141,118 +187,3588 @@ namespace
     }
     cout << " (" << len << ")" << endl;
   }
-}
+#endif
 
-// ================================================================
-// Constructor.
-// ================================================================
-Cipher::Cipher()
-  : m_cipher(CIPHER_DEFAULT_CIPHER),
-    m_digest(CIPHER_DEFAULT_DIGEST),
-    m_count(CIPHER_DEFAULT_COUNT),
-    m_embed(true), // compatible with openssl
-    m_debug(false)
-{
-}
+  // ================================================================
+  // Load the algorithm tables once.
+  // OpenSSL 1.1 and later do it automatically.
+  // ================================================================
+  void load_algorithms()
+  {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    static bool loaded = false;
+    if (!loaded) {
+      OpenSSL_add_all_algorithms();
+      loaded = true;
+    }
+#endif
+  }
 
-// ================================================================
-// Constructor.
-// ================================================================
-Cipher::Cipher(const std::string& cipher,
-	       const std::string& digest,
-	       uint count,
-	       bool embed)
-  : m_cipher(cipher),
-    m_digest(digest),
-    m_count(count),
-    m_embed(embed),
-    m_debug(false)
-{
-}
+  // ================================================================
+  // Resolve a cipher by name.
+  // On OpenSSL 3 the result must be released with free_cipher().
+  // ================================================================
+  const EVP_CIPHER* fetch_cipher(const string& name)
+  {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    return EVP_CIPHER_fetch(NULL, name.c_str(), NULL);
+#else
+    return EVP_get_cipherbyname(name.c_str());
+#endif
+  }
 
-// ================================================================
-// Destructor.
-// ================================================================
-Cipher::~Cipher()
-{
-}
+  void free_cipher(const EVP_CIPHER* p)
+  {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_CIPHER_free(const_cast<EVP_CIPHER*>(p));
+#endif
+  }
 
-// ================================================================
-// encrypt
-// ================================================================
-string Cipher::encrypt(const string& plaintext,
-		       const string& pass,
-		       const string& salt)
-{
-  DBG_FCT("encrypt");
-  set_salt(salt);
-  init(pass);
-  kv1_t  x     = encode_cipher(plaintext);
-  uchar* ct    = x.first;
-  uint   ctlen = x.second;
-  DBG_BDUMP(ct, ctlen);
-
-  string ret = encode_base64(ct, ctlen);
-  delete [] ct;
-  DBG_MDUMP(ret);
-  return ret;
+  // ================================================================
+  // Resolve a digest by name.
+  // On OpenSSL 3 the result must be released with free_digest().
+  // ================================================================
+  const EVP_MD* fetch_digest(const string& name)
+  {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    return EVP_MD_fetch(NULL, name.c_str(), NULL);
+#else
+    return EVP_get_digestbyname(name.c_str());
+#endif
+  }
+
+  void free_digest(const EVP_MD* p)
+  {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_MD_free(const_cast<EVP_MD*>(p));
+#endif
+  }
+
+  // ================================================================
+  // Initialize a cipher context for a new message.
+  // If the context was last used with the same cipher only the
+  // key and IV are changed. That avoids tearing down and
+  // rebuilding the cipher state which is where most of the
+  // per-message allocations come from.
+  // ================================================================
+  bool cipher_init(EVP_CIPHER_CTX* ctx,
+                   const EVP_CIPHER* cipher,
+                   const unsigned char* key,
+                   const unsigned char* iv,
+                   int enc)
+  {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    const EVP_CIPHER* cur = EVP_CIPHER_CTX_get0_cipher(ctx);
+#else
+    const EVP_CIPHER* cur = EVP_CIPHER_CTX_cipher(ctx);
+#endif
+    if (cur == cipher) {
+      return 1 == EVP_CipherInit_ex(ctx, NULL, NULL, key, iv, enc);
+    }
+    EVP_CIPHER_CTX_reset(ctx);
+    return 1 == EVP_CipherInit_ex(ctx, cipher, NULL, key, iv, enc);
+  }
+
+  // ================================================================
+  // The AEAD ciphers that the framed format supports and their
+  // algorithm ids in the header. The ids are part of the file
+  // format, do not change them.
+  // ================================================================
+  struct aead_alg_t
+  {
+    unsigned char id;
+    int           nid;
+    const char*   name;
+  };
+  const aead_alg_t g_aead_algs[] = {
+    {1, NID_aes_128_gcm, "aes-128-gcm"},
+    {2, NID_aes_192_gcm, "aes-192-gcm"},
+    {3, NID_aes_256_gcm, "aes-256-gcm"},
+#ifdef NID_chacha20_poly1305
+    {4, NID_chacha20_poly1305, "chacha20-poly1305"},
+#endif
+  };
+  const size_t g_aead_algs_size = sizeof(g_aead_algs) / sizeof(g_aead_algs[0]);
+
+  // ================================================================
+  // Look up an AEAD algorithm by its nid or its header id.
+  // Returns 0 if it is not supported.
+  // ================================================================
+  const aead_alg_t* aead_alg(int nid)
+  {
+    for(size_t i=0;i<g_aead_algs_size;++i) {
+      if (g_aead_algs[i].nid == nid) {
+        return &g_aead_algs[i];
+      }
+    }
+    return 0;
+  }
+  const aead_alg_t* aead_alg_by_id(unsigned char id)
+  {
+    for(size_t i=0;i<g_aead_algs_size;++i) {
+      if (g_aead_algs[i].id == id) {
+        return &g_aead_algs[i];
+      }
+    }
+    return 0;
+  }
+
+  // ================================================================
+  // Check an AEAD header and get its algorithm and chunk size.
+  // ================================================================
+  const aead_alg_t* aead_header(const unsigned char* hdr, size_t* chunk)
+  {
+    if (memcmp(hdr, AEAD_MAGIC, 6) != 0) {
+      throw runtime_error("decrypt(): not in the AEAD format");
+    }
+    if (hdr[6] != AEAD_VERSION) {
+      throw runtime_error("decrypt(): unsupported AEAD format version");
+    }
+    const aead_alg_t* alg = aead_alg_by_id(hdr[7]);
+    if (!alg) {
+      throw runtime_error("decrypt(): unsupported AEAD algorithm");
+    }
+    *chunk = 0;
+    for(int i=0;i<4;++i) {
+      *chunk = (*chunk << 8) | hdr[8 + i];
+    }
+    if (*chunk == 0 || *chunk > AEAD_MAX_CHUNK) {
+      throw runtime_error("decrypt(): invalid AEAD chunk size");
+    }
+    return alg;
+  }
+
+  // ================================================================
+  // Does the data start with the AEAD magic?
+  // ================================================================
+  bool aead_magic(const char* p, size_t len, bool armor)
+  {
+    const char* magic = armor ? AEAD_MAGIC_B64 : AEAD_MAGIC;
+    size_t n = strlen(magic);
+    return len >= n && memcmp(p, magic, n) == 0;
+  }
+
+  // ================================================================
+  // Scoped mutex lock.
+  // ================================================================
+  class lock_t
+  {
+  public:
+    lock_t(pthread_mutex_t& m) : m_mutex(m) { pthread_mutex_lock(&m_mutex); }
+    ~lock_t() { pthread_mutex_unlock(&m_mutex); }
+  private:
+    lock_t(const lock_t&);
+    lock_t& operator=(const lock_t&);
+    pthread_mutex_t& m_mutex;
+  };
+
+#ifdef CIPHER_HAVE_ARGON2
+  // ================================================================
+  // Allow OpenSSL to run n threads for the Argon2id lanes. The
+  // limit is for the whole process so it is only ever raised,
+  // when a Cipher is configured rather than for each derivation.
+  // ================================================================
+  pthread_mutex_t g_kdf_threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+  void raise_kdf_threads(uint64_t n)
+  {
+    lock_t lock(g_kdf_threads_mutex);
+    if (n > 1 && n > OSSL_get_max_threads(NULL)) {
+      OSSL_set_max_threads(NULL, n);
+    }
+  }
+#endif
+
+  // ================================================================
+  // Random bytes straight from the source: RAND_bytes(), or the
+  // kernel if OpenSSL cannot be seeded.
+  // ================================================================
+  void random_fill(unsigned char* buf, size_t len)
+  {
+    if (len == 0 || 1 == RAND_bytes(buf, len)) {
+      return;
+    }
+#ifdef SYS_getrandom
+    while (len) {
+      long n = syscall(SYS_getrandom, buf, len, 0);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      buf += n;
+      len -= n;
+    }
+    if (len == 0) {
+      return;
+    }
+#endif
+    throw runtime_error("RAND_bytes() failed");
+  }
+
+  // ================================================================
+  // Per-thread pool of random bytes. It lives in thread specific
+  // data so there is no locking and it is wiped when the thread
+  // exits. The pthread_atfork() child handler forked() bumps the
+  // generation s_gen so a pool copied into a forked child refills
+  // instead of handing out the bytes that the parent still has.
+  // ================================================================
+  class rand_pool_t
+  {
+  public:
+    rand_pool_t() : m_used(RAND_POOL_SIZE), m_gen(s_gen) {}
+    ~rand_pool_t() {OPENSSL_cleanse(m_buf, sizeof(m_buf));}
+    void get(unsigned char* buf, size_t len)
+    {
+      if (m_gen != s_gen) {
+        m_gen  = s_gen;
+        m_used = RAND_POOL_SIZE;
+      }
+      while (len) {
+        if (m_used == RAND_POOL_SIZE) {
+          random_fill(m_buf, sizeof(m_buf));
+          m_used = 0;
+        }
+        size_t n = RAND_POOL_SIZE - m_used;
+        if (n > len) {
+          n = len;
+        }
+        memcpy(buf, m_buf + m_used, n);
+        OPENSSL_cleanse(m_buf + m_used, n); // hand out each byte once
+        m_used += n;
+        buf += n;
+        len -= n;
+      }
+    }
+    static rand_pool_t& instance()
+    {
+      pthread_once(&s_once, make_key);
+      rand_pool_t* p = (rand_pool_t*)pthread_getspecific(s_key);
+      if (!p) {
+        p = new rand_pool_t;
+        pthread_setspecific(s_key, p);
+      }
+      return *p;
+    }
+  private:
+    rand_pool_t(const rand_pool_t&);
+    rand_pool_t& operator=(const rand_pool_t&);
+    static void make_key()
+    {
+      pthread_key_create(&s_key, destroy);
+      pthread_atfork(0, 0, forked);
+    }
+    static void destroy(void* p) {delete (rand_pool_t*)p;}
+    static void forked() {++s_gen;}
+    unsigned char m_buf[RAND_POOL_SIZE];
+    size_t        m_used;
+    unsigned long m_gen;
+    static pthread_once_t s_once;
+    static pthread_key_t  s_key;
+    static volatile unsigned long s_gen;
+  };
+  pthread_once_t rand_pool_t::s_once = PTHREAD_ONCE_INIT;
+  pthread_key_t  rand_pool_t::s_key;
+  volatile unsigned long rand_pool_t::s_gen = 0;
+
+  // ================================================================
+  // Scoped timer for one stage of the statistics. The call is
+  // counted as an error unless done() was called. It does
+  // nothing if the statistics are not being collected.
+  // ================================================================
+  class stage_timer_t
+  {
+  public:
+    stage_timer_t(Cipher::Stats* st, Cipher::Stats::Stage stage, size_t bytes=0)
+      : m_st(st), m_stage(stage), m_bytes(bytes), m_t0(0), m_done(false)
+    {
+      if (m_st) {
+        m_t0 = now();
+      }
+    }
+    ~stage_timer_t()
+    {
+      if (m_st) {
+        m_st->add(m_stage, now() - m_t0, m_bytes, !m_done);
+      }
+    }
+    void bytes(size_t n) {m_bytes = n;}
+    void done() {m_done = true;}
+    static unsigned long long now()
+    {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+  private:
+    stage_timer_t(const stage_timer_t&);
+    stage_timer_t& operator=(const stage_timer_t&);
+    Cipher::Stats*       m_st;
+    Cipher::Stats::Stage m_stage;
+    size_t               m_bytes;
+    unsigned long long   m_t0;
+    bool                 m_done;
+  };
+
+  // ================================================================
+  // Scoped timer for a fused loop that alternates between stages
+  // block by block. The time between two calls to stage() is
+  // charged to the earlier stage and each stage that was entered
+  // is recorded as one call. If done() was not called the call
+  // of the current stage is counted as an error. Stats::STAGES
+  // pauses it, for example while init() records its own call.
+  // ================================================================
+  class stage_split_t
+  {
+  public:
+    stage_split_t(Cipher::Stats* st, Cipher::Stats::Stage stage)
+      : m_st(st), m_cur(stage), m_t0(0), m_done(false)
+    {
+      for(uint i=0;i<=Cipher::Stats::STAGES;++i) {
+        m_ns[i] = m_bytes[i] = 0;
+        m_used[i] = false;
+      }
+      m_used[stage] = true;
+      if (m_st) {
+        m_t0 = stage_timer_t::now();
+      }
+    }
+    ~stage_split_t()
+    {
+      if (m_st) {
+        m_ns[m_cur] += stage_timer_t::now() - m_t0;
+        for(uint i=0;i<Cipher::Stats::STAGES;++i) {
+          if (m_used[i]) {
+            m_st->add(Cipher::Stats::Stage(i), m_ns[i], m_bytes[i], !m_done && i == (uint)m_cur);
+          }
+        }
+      }
+    }
+    void stage(Cipher::Stats::Stage stage)
+    {
+      if (m_st && stage != m_cur) {
+        unsigned long long t = stage_timer_t::now();
+        m_ns[m_cur] += t - m_t0;
+        m_t0 = t;
+      }
+      m_cur = stage;
+      m_used[stage] = true;
+    }
+    void bytes(Cipher::Stats::Stage stage, size_t n) {m_bytes[stage] += n;}
+    void done() {m_done = true;}
+  private:
+    stage_split_t(const stage_split_t&);
+    stage_split_t& operator=(const stage_split_t&);
+    Cipher::Stats*       m_st;
+    Cipher::Stats::Stage m_cur;
+    unsigned long long   m_t0;
+    unsigned long long   m_ns[Cipher::Stats::STAGES + 1];
+    unsigned long long   m_bytes[Cipher::Stats::STAGES + 1];
+    bool                 m_used[Cipher::Stats::STAGES + 1];
+    bool                 m_done;
+  };
+
+  // ================================================================
+  // The mode of a new file, 0666 less the umask. umask() can only
+  // be read by setting it so that is done once.
+  // ================================================================
+  pthread_once_t g_umask_once = PTHREAD_ONCE_INIT;
+  mode_t         g_umask = 022;
+
+  void read_umask()
+  {
+    g_umask = umask(022);
+    umask(g_umask);
+  }
+
+  mode_t new_file_mode()
+  {
+    pthread_once(&g_umask_once, read_umask);
+    return 0666 & ~g_umask;
+  }
+
+  // ================================================================
+  // Stream buffer that reads a regular file through AsyncIO. All
+  // of the buffers are kept busy reading ahead, each one is
+  // queued again for the next unread chunk as soon as its data
+  // has been consumed.
+  // ================================================================
+  class aio_in_t : public streambuf
+  {
+  public:
+    aio_in_t() : m_aio(0), m_fd(-1), m_cur(0), m_off(0), m_busy(false), m_last(false) {}
+    ~aio_in_t()
+    {
+      delete m_aio; // waits for the reads in flight
+      if (m_fd >= 0) {
+        ::close(m_fd);
+      }
+    }
+    // Open a regular file, it fails for anything else so the
+    // caller can fall back to the streams.
+    bool open(const string& fn, size_t chunk)
+    {
+      int fd = ::open(fn.c_str(), O_RDONLY);
+      if (fd < 0) {
+        return false;
+      }
+      struct stat st;
+      if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        ::close(fd);
+        return false;
+      }
+      m_fd  = fd;
+      m_aio = new AsyncIO(AIO_DEPTH, chunk);
+      for(uint i=0;i<m_aio->depth();++i) {
+        queue(i);
+      }
+      return true;
+    }
+  protected:
+    virtual int_type underflow()
+    {
+      if (gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+      }
+      if (m_busy) {
+        queue(m_cur);
+        m_cur = (m_cur + 1) % m_aio->depth();
+        m_busy = false;
+      }
+      size_t n = m_aio->wait(m_cur);
+      if (n == 0) {
+        return traits_type::eof();
+      }
+      m_last = m_last || n < m_aio->buffer_size();
+      m_busy = true;
+      char* p = (char*)m_aio->buffer(m_cur);
+      setg(p, p, p + n);
+      return traits_type::to_int_type(*gptr());
+    }
+  private:
+    // Read the next chunk into a buffer. Only the last read can be
+    // short so nothing is queued after it.
+    void queue(uint i)
+    {
+      if (!m_last) {
+        m_aio->read(i, m_fd, m_off, m_aio->buffer_size());
+        m_off += m_aio->buffer_size();
+      }
+    }
+    aio_in_t(const aio_in_t&);
+    aio_in_t& operator=(const aio_in_t&);
+    AsyncIO* m_aio;
+    int      m_fd;
+    uint     m_cur;
+    off_t    m_off;
+    bool     m_busy;
+    bool     m_last;
+  };
+
+  // ================================================================
+  // Stream buffer that writes a file through AsyncIO. A full
+  // buffer is queued and the next one is used while it is being
+  // written, it only waits if all of them are still busy.
+  // ================================================================
+  class aio_out_t : public streambuf
+  {
+  public:
+    aio_out_t() : m_aio(0), m_fd(-1), m_cur(0), m_off(0) {}
+    ~aio_out_t() {close();}
+    void open(int fd, size_t chunk)
+    {
+      m_fd  = fd;
+      m_aio = new AsyncIO(AIO_DEPTH, chunk);
+      char* p = (char*)m_aio->buffer(0);
+      setp(p, p + m_aio->buffer_size());
+    }
+    // Write the rest and wait for all of the writes.
+    void finish()
+    {
+      flush();
+      for(uint i=0;i<m_aio->depth();++i) {
+        m_aio->wait(i);
+      }
+    }
+    // Wait for the writes in flight and release the buffers.
+    void close()
+    {
+      delete m_aio;
+      m_aio = 0;
+    }
+  protected:
+    virtual int_type overflow(int_type ch)
+    {
+      flush();
+      if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+      }
+      return traits_type::not_eof(ch);
+    }
+  private:
+    void flush()
+    {
+      size_t n = pptr() - pbase();
+      if (n == 0) {
+        return;
+      }
+      m_aio->write(m_cur, m_fd, m_off, n);
+      m_off += n;
+      m_cur = (m_cur + 1) % m_aio->depth();
+      m_aio->wait(m_cur); // throws if its last write failed
+      char* p = (char*)m_aio->buffer(m_cur);
+      setp(p, p + m_aio->buffer_size());
+    }
+    aio_out_t(const aio_out_t&);
+    aio_out_t& operator=(const aio_out_t&);
+    AsyncIO* m_aio;
+    int      m_fd;
+    uint     m_cur;
+    off_t    m_off;
+  };
+
+  // ================================================================
+  // Output file for the streaming functions.
+  // A regular file is written to a temporary file in the same
+  // directory that replaces it when commit() is called, so a
+  // failure (a wrong passphrase, a tampered AEAD chunk) leaves the
+  // old file as it was and no partial output. That also allows
+  // the input file to be the output file. Devices and pipes are
+  // written directly.
+  // ================================================================
+  class ofile_t
+  {
+  public:
+    ofile_t(const string& ofn,
+            Cipher::Io io=Cipher::IO_STREAMS,
+            size_t chunk=CIPHER_DEFAULT_CHUNK_SIZE)
+      : m_ofn(ofn),
+        m_tmp(ofn),
+        m_fd(-1),
+        m_os(&m_out),
+        m_done(false)
+    {
+      struct stat st;
+      bool exists = stat(ofn.c_str(), &st) == 0;
+      if (exists && !S_ISREG(st.st_mode)) {
+        m_ofs.open(ofn.c_str(), ios::out | ios::binary | ios::trunc);
+        if (!m_ofs) {
+          string msg="Cannot write file '"+ofn+"'";
+          throw runtime_error(msg);
+        }
+        return;
+      }
+
+      // Replace the file a symbolic link points to, not the link.
+      if (exists) {
+        char* rp = realpath(ofn.c_str(), 0);
+        if (rp) {
+          m_ofn = rp;
+          free(rp);
+        }
+      }
+      size_t slash = m_ofn.rfind('/');
+      string dir  = slash == string::npos ? "" : m_ofn.substr(0, slash + 1);
+      string base = slash == string::npos ? m_ofn : m_ofn.substr(slash + 1);
+      vector<char> tmp(dir.size() + base.size() + 9);
+      snprintf(&tmp[0], tmp.size(), "%s.%s.XXXXXX", dir.c_str(), base.c_str());
+      int fd = mkstemp(&tmp[0]);
+      if (fd < 0) {
+        string msg="Cannot write file '"+ofn+"'";
+        throw runtime_error(msg);
+      }
+      m_tmp = &tmp[0];
+      fchmod(fd, exists ? (st.st_mode & 07777) : new_file_mode());
+
+      // The queued writes are at offsets, the temporary file is
+      // always a regular file.
+      if (io == Cipher::IO_URING) {
+        m_fd = fd;
+        m_out.open(m_fd, chunk);
+        return;
+      }
+      ::close(fd);
+      m_ofs.open(m_tmp.c_str(), ios::out | ios::binary | ios::trunc);
+      if (!m_ofs) {
+        remove(m_tmp.c_str());
+        string msg="Cannot write file '"+ofn+"'";
+        throw runtime_error(msg);
+      }
+    }
+    ~ofile_t()
+    {
+      m_ofs.close();
+      m_out.close();
+      if (m_fd >= 0) {
+        ::close(m_fd);
+      }
+      if (!m_done && m_tmp != m_ofn) {
+        remove(m_tmp.c_str());
+      }
+    }
+    ostream& stream() { return m_fd >= 0 ? m_os : (ostream&)m_ofs; }
+    void commit()
+    {
+      if (m_fd >= 0) {
+        m_out.finish();
+        m_out.close();
+        int rc = ::close(m_fd);
+        m_fd = -1;
+        if (rc || !m_os) {
+          string msg="Cannot write file '"+m_ofn+"'";
+          throw runtime_error(msg);
+        }
+      }
+      else {
+        m_ofs.close();
+        if (!m_ofs) {
+          string msg="Cannot write file '"+m_ofn+"'";
+          throw runtime_error(msg);
+        }
+      }
+      if (m_tmp != m_ofn && rename(m_tmp.c_str(), m_ofn.c_str())) {
+        string msg="Cannot write file '"+m_ofn+"'";
+        throw runtime_error(msg);
+      }
+      m_done = true;
+    }
+  private:
+    string    m_ofn;
+    string    m_tmp;
+    int       m_fd;
+    aio_out_t m_out;
+    ostream   m_os;
+    ofstream  m_ofs;
+    bool      m_done;
+  };
+
+  // ================================================================
+  // Read only stream buffer over a memory mapped file.
+  // The whole file is the get area so reads come straight from
+  // the page cache. stream_next() hands out pointers into the
+  // mapping so the data is not copied at all.
+  // ================================================================
+  class mmap_buf_t : public streambuf
+  {
+  public:
+    mmap_buf_t() : m_map(0), m_size(0) {}
+    ~mmap_buf_t()
+    {
+      if (m_map) {
+        munmap(m_map, m_size);
+      }
+    }
+    // Map a file. It fails for anything that is not a non-empty
+    // regular file (pipes, devices) so the caller can fall back
+    // to buffered reads.
+    bool open(const string& fn)
+    {
+      int fd = ::open(fn.c_str(), O_RDONLY);
+      if (fd < 0) {
+        return false;
+      }
+      struct stat st;
+      if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+          m_map  = (char*)p;
+          m_size = st.st_size;
+          madvise(m_map, m_size, MADV_SEQUENTIAL);
+          setg(m_map, m_map, m_map + m_size);
+        }
+      }
+      ::close(fd);
+      return m_map != 0;
+    }
+    bool mapped() const {return m_map != 0;}
+    // Get the next len bytes at most without copying them.
+    size_t next(const char** p, size_t len)
+    {
+      size_t avail = egptr() - gptr();
+      size_t n = len < avail ? len : avail;
+      *p = gptr();
+      setg(eback(), gptr() + n, egptr());
+      return n;
+    }
+    // Get the unread bytes without consuming them.
+    size_t peek(const char** p) const
+    {
+      *p = gptr();
+      return egptr() - gptr();
+    }
+    const char* data() const {return m_map;}
+    size_t size() const {return m_size;}
+  private:
+    mmap_buf_t(const mmap_buf_t&);
+    mmap_buf_t& operator=(const mmap_buf_t&);
+    char*  m_map;
+    size_t m_size;
+  };
+
+  // ================================================================
+  // Input file for the streaming functions.
+  // Regular files are memory mapped, or read through AsyncIO for
+  // the IO_URING backend, anything else is read with an ifstream.
+  // ================================================================
+  class ifile_t
+  {
+  public:
+    ifile_t(const string& fn,
+            Cipher::Io io=Cipher::IO_STREAMS,
+            size_t chunk=CIPHER_DEFAULT_CHUNK_SIZE)
+      : m_ms(&m_mb), m_as(&m_ab), m_async(false)
+    {
+      if (io == Cipher::IO_URING && m_ab.open(fn, chunk)) {
+        m_async = true;
+      }
+      else if (!m_mb.open(fn)) {
+        m_ifs.open(fn.c_str(), ios::in | ios::binary);
+        if (!m_ifs) {
+          string msg="Cannot read file '"+fn+"'";
+          throw runtime_error(msg);
+        }
+      }
+    }
+    istream& stream()
+    {
+      if (m_async) {
+        return m_as;
+      }
+      return m_mb.mapped() ? m_ms : (istream&)m_ifs;
+    }
+  private:
+    mmap_buf_t m_mb;
+    istream    m_ms;
+    aio_in_t   m_ab;
+    istream    m_as;
+    bool       m_async;
+    ifstream   m_ifs;
+  };
+
+  // ================================================================
+  // Read up to len bytes from a stream.
+  // ================================================================
+  size_t stream_read(istream& is, char* buf, size_t len)
+  {
+    is.read(buf, len);
+    if (is.bad()) {
+      throw runtime_error("stream read failed");
+    }
+    return is.gcount();
+  }
+
+  // ================================================================
+  // Get the next len bytes of a stream at most.
+  // A memory mapped file is not copied, the pointer refers to the
+  // mapping and stays valid until the file is closed. Other
+  // streams are read into buf, the pointer is valid until the
+  // next call.
+  // ================================================================
+  size_t stream_next(istream& is,
+                     const unsigned char** p,
+                     vector<char>& buf,
+                     size_t len,
+                     Cipher::Stats* st=0)
+  {
+    stage_timer_t timer(st, Cipher::Stats::IO);
+    mmap_buf_t* mb = dynamic_cast<mmap_buf_t*>(is.rdbuf());
+    if (mb) {
+      const char* q = 0;
+      size_t n = mb->next(&q, len);
+      *p = (const unsigned char*)q;
+      timer.bytes(n);
+      timer.done();
+      return n;
+    }
+    if (buf.size() < len) {
+      buf.resize(len);
+    }
+    size_t n = stream_read(is, &buf[0], len);
+    *p = (const unsigned char*)&buf[0];
+    timer.bytes(n);
+    timer.done();
+    return n;
+  }
+
+  // ================================================================
+  // Is the stream a memory mapped file?
+  // ================================================================
+  bool stream_mapped(istream& is)
+  {
+    return dynamic_cast<mmap_buf_t*>(is.rdbuf()) != 0;
+  }
+
+  // ================================================================
+  // Sink that writes to a stream.
+  // ================================================================
+  class ostream_sink_t : public Cipher::Sink
+  {
+  public:
+    ostream_sink_t(ostream& os, Cipher::Stats* st=0) : m_os(os), m_st(st) {}
+    virtual void write(const unsigned char* buf, size_t len)
+    {
+      if (len) {
+        stage_timer_t timer(m_st, Cipher::Stats::IO, len);
+        m_os.write((const char*)buf, len);
+        if (!m_os) {
+          throw runtime_error("stream write failed");
+        }
+        timer.done();
+      }
+    }
+  private:
+    ostream&       m_os;
+    Cipher::Stats* m_st;
+  };
+
+  // ================================================================
+  // Sink that MIME encodes the data and passes it on to another
+  // sink. It produces the same 64 column format as the
+  // BIO_f_base64 filter, including the trailing new line.
+  // ================================================================
+  class b64_encode_sink_t : public Cipher::Sink
+  {
+  public:
+    b64_encode_sink_t(Cipher::Sink& out, Cipher::Stats* st=0)
+      : m_out(out), m_used(0), m_st(st) {}
+    virtual void write(const unsigned char* buf, size_t len)
+    {
+      // Only whole 48 byte groups are encoded, the rest is kept
+      // for the next call.
+      const size_t chunk = 48 * 1024;
+      while (len) {
+        if (m_used || len < 48) {
+          size_t n = 48 - m_used < len ? 48 - m_used : len;
+          memcpy(m_tail + m_used, buf, n);
+          m_used += n;
+          buf += n;
+          len -= n;
+          if (m_used == 48) {
+            emit(m_tail, 48);
+            m_used = 0;
+          }
+          continue;
+        }
+        size_t n = len < chunk ? len : chunk;
+        n -= n % 48;
+        emit(buf, n);
+        buf += n;
+        len -= n;
+      }
+    }
+    void finish()
+    {
+      emit(m_tail, m_used);
+      m_used = 0;
+    }
+  private:
+    void emit(const unsigned char* buf, size_t len)
+    {
+      m_buf.resize(Base64::encode_size(len));
+      if (len) {
+        stage_timer_t timer(m_st, Cipher::Stats::BASE64, len);
+        size_t n = Base64::encode(buf, len, &m_buf[0]);
+        timer.done();
+        m_out.write(&m_buf[0], n);
+      }
+    }
+    Cipher::Sink&         m_out;
+    vector<unsigned char> m_buf;
+    unsigned char         m_tail[48];
+    size_t                m_used;
+    Cipher::Stats*        m_st;
+  };
+
+  // ================================================================
+  // Wait a little longer each time a ring buffer is empty or
+  // full: spin first, then give up the CPU, then sleep so that a
+  // stage that is waiting for a slow disk does not burn a core.
+  // ================================================================
+  void backoff(uint& spins)
+  {
+    ++spins;
+    if (spins < 64) {
+      return;
+    }
+    if (spins < 128) {
+      sched_yield();
+      return;
+    }
+    struct timespec ts = {0, 50000};
+    nanosleep(&ts, 0);
+  }
+
+  // ================================================================
+  // Bounded single producer, single consumer ring buffer. It is
+  // lock free: the producer only writes m_tail, the consumer only
+  // writes m_head and each publishes its index with release
+  // semantics after touching the slot.
+  // ================================================================
+  template<class T> class spsc_ring_t
+  {
+  public:
+    spsc_ring_t(size_t n) : m_head(0), m_tail(0)
+    {
+      size_t size = 1;
+      while (size < n) {
+        size <<= 1;
+      }
+      m_slots.resize(size);
+    }
+    bool push(const T& v)
+    {
+      unsigned long t = m_tail;
+      if (t - __atomic_load_n(&m_head, __ATOMIC_ACQUIRE) == m_slots.size()) {
+        return false;
+      }
+      m_slots[t & (m_slots.size() - 1)] = v;
+      __atomic_store_n(&m_tail, t + 1, __ATOMIC_RELEASE);
+      return true;
+    }
+    bool pop(T& v)
+    {
+      unsigned long h = m_head;
+      if (__atomic_load_n(&m_tail, __ATOMIC_ACQUIRE) == h) {
+        return false;
+      }
+      v = m_slots[h & (m_slots.size() - 1)];
+      __atomic_store_n(&m_head, h + 1, __ATOMIC_RELEASE);
+      return true;
+    }
+  private:
+    vector<T>     m_slots;
+    char          m_pad0[64]; // keep the indexes on separate lines
+    unsigned long m_head;
+    char          m_pad1[64];
+    unsigned long m_tail;
+  };
+
+  // ================================================================
+  // A reusable pipeline buffer.
+  // ================================================================
+  struct pipe_chunk_t
+  {
+    vector<char> m_data;
+    size_t       m_len;
+  };
+
+  // ================================================================
+  // Input stage of the streaming pipeline. A reader thread fills
+  // PIPE_DEPTH chunks ahead of the consumer so the reads overlap
+  // the cipher work. The chunks travel to the consumer on one
+  // ring and come back empty on another.
+  // ================================================================
+  class pipe_in_t : public streambuf
+  {
+  public:
+    pipe_in_t()
+      : m_is(0), m_pool(0), m_reader(*this), m_full(PIPE_DEPTH), m_free(PIPE_DEPTH),
+        m_cur(0), m_done(false), m_abort(false), m_eof(false) {}
+    ~pipe_in_t()
+    {
+      if (m_pool) {
+        __atomic_store_n(&m_abort, true, __ATOMIC_RELEASE);
+        try {
+          m_pool->wait(&m_reader);
+        }
+        catch (...) {
+        }
+        delete m_pool;
+      }
+    }
+    // Start reading is on the reader thread.
+    void open(istream& is, size_t chunk)
+    {
+      m_is = &is;
+      for(uint i=0;i<PIPE_DEPTH;++i) {
+        m_chunks[i].m_data.resize(chunk);
+        m_free.push(&m_chunks[i]);
+      }
+      m_pool = new ThreadPool(1);
+      m_pool->submit(&m_reader);
+    }
+  protected:
+    virtual int_type underflow()
+    {
+      if (gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+      }
+      if (m_cur) {
+        m_free.push(m_cur); // never full, there are only PIPE_DEPTH chunks
+        m_cur = 0;
+      }
+      if (m_eof) {
+        return traits_type::eof();
+      }
+      pipe_chunk_t* c = 0;
+      for(uint spins=0; !m_full.pop(c); backoff(spins)) {
+        if (__atomic_load_n(&m_done, __ATOMIC_ACQUIRE) && !m_full.pop(c)) {
+          m_eof = true;
+          m_pool->wait(&m_reader); // rethrow a read error
+          return traits_type::eof();
+        }
+        if (c) {
+          break;
+        }
+      }
+      m_cur = c;
+      setg(&c->m_data[0], &c->m_data[0], &c->m_data[0] + c->m_len);
+      return traits_type::to_int_type(*gptr());
+    }
+  private:
+    class reader_t : public ThreadPool::Job
+    {
+    public:
+      reader_t(pipe_in_t& p) : m_p(p) {}
+      virtual void run()
+      {
+        try {
+          read();
+        }
+        catch (...) {
+          __atomic_store_n(&m_p.m_done, true, __ATOMIC_RELEASE);
+          throw;
+        }
+        __atomic_store_n(&m_p.m_done, true, __ATOMIC_RELEASE);
+      }
+    private:
+      void read()
+      {
+        for(;;) {
+          pipe_chunk_t* c = 0;
+          for(uint spins=0; !m_p.m_free.pop(c); backoff(spins)) {
+            if (__atomic_load_n(&m_p.m_abort, __ATOMIC_ACQUIRE)) {
+              return;
+            }
+          }
+          c->m_len = stream_read(*m_p.m_is, &c->m_data[0], c->m_data.size());
+          if (c->m_len == 0) {
+            return;
+          }
+          m_p.m_full.push(c); // never full
+          if (c->m_len < c->m_data.size()) {
+            return;
+          }
+        }
+      }
+      pipe_in_t& m_p;
+    };
+    friend class reader_t;
+    pipe_in_t(const pipe_in_t&);
+    pipe_in_t& operator=(const pipe_in_t&);
+    istream*                    m_is;
+    ThreadPool*                 m_pool;
+    reader_t                    m_reader;
+    pipe_chunk_t                m_chunks[PIPE_DEPTH];
+    spsc_ring_t<pipe_chunk_t*>  m_full;
+    spsc_ring_t<pipe_chunk_t*>  m_free;
+    pipe_chunk_t*               m_cur;
+    bool                        m_done;
+    bool                        m_abort;
+    bool                        m_eof;
+  };
+
+  // ================================================================
+  // Output stage of the streaming pipeline. The producer fills
+  // chunks and a writer thread writes them so the writes overlap
+  // the cipher work. finish() waits for the last write.
+  // ================================================================
+  class pipe_out_t : public streambuf
+  {
+  public:
+    pipe_out_t()
+      : m_os(0), m_pool(0), m_writer(*this), m_full(PIPE_DEPTH), m_free(PIPE_DEPTH),
+        m_cur(0), m_done(false), m_abort(false), m_closed(false) {}
+    ~pipe_out_t()
+    {
+      if (m_pool) {
+        __atomic_store_n(&m_abort, true, __ATOMIC_RELEASE);
+        try {
+          m_pool->wait(&m_writer);
+        }
+        catch (...) {
+        }
+        delete m_pool;
+      }
+    }
+    // Start writing to os on the writer thread.
+    void open(ostream& os, size_t chunk)
+    {
+      m_os = &os;
+      for(uint i=0;i<PIPE_DEPTH;++i) {
+        m_chunks[i].m_data.resize(chunk);
+        m_free.push(&m_chunks[i]);
+      }
+      m_pool = new ThreadPool(1);
+      m_pool->submit(&m_writer);
+      next();
+    }
+    // Write the rest and wait for the writer.
+    void finish()
+    {
+      flush();
+      __atomic_store_n(&m_closed, true, __ATOMIC_RELEASE);
+      ThreadPool* pool = m_pool;
+      m_pool = 0;
+      try {
+        pool->wait(&m_writer);
+      }
+      catch (...) {
+        delete pool;
+        throw;
+      }
+      delete pool;
+    }
+  protected:
+    virtual int_type overflow(int_type ch)
+    {
+      flush();
+      next();
+      if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+      }
+      return traits_type::not_eof(ch);
+    }
+  private:
+    // Pass the current chunk to the writer.
+    void flush()
+    {
+      if (m_cur && pptr() > pbase()) {
+        m_cur->m_len = pptr() - pbase();
+        m_full.push(m_cur); // never full
+        m_cur = 0;
+        setp(0, 0);
+      }
+    }
+    // Get an empty chunk.
+    void next()
+    {
+      if (m_cur) {
+        return;
+      }
+      pipe_chunk_t* c = 0;
+      for(uint spins=0; !m_free.pop(c); backoff(spins)) {
+        if (__atomic_load_n(&m_done, __ATOMIC_ACQUIRE)) {
+          m_pool->wait(&m_writer); // rethrow the write error
+          throw runtime_error("stream write failed");
+        }
+      }
+      m_cur = c;
+      setp(&c->m_data[0], &c->m_data[0] + c->m_data.size());
+    }
+    class writer_t : public ThreadPool::Job
+    {
+    public:
+      writer_t(pipe_out_t& p) : m_p(p) {}
+      virtual void run()
+      {
+        try {
+          write();
+        }
+        catch (...) {
+          __atomic_store_n(&m_p.m_done, true, __ATOMIC_RELEASE);
+          throw;
+        }
+        __atomic_store_n(&m_p.m_done, true, __ATOMIC_RELEASE);
+      }
+    private:
+      void write()
+      {
+        for(;;) {
+          pipe_chunk_t* c = 0;
+          for(uint spins=0; !m_p.m_full.pop(c); backoff(spins)) {
+            if (__atomic_load_n(&m_p.m_abort, __ATOMIC_ACQUIRE)) {
+              return;
+            }
+            if (__atomic_load_n(&m_p.m_closed, __ATOMIC_ACQUIRE) && !m_p.m_full.pop(c)) {
+              m_p.m_os->flush();
+              if (!*m_p.m_os) {
+                throw runtime_error("stream write failed");
+              }
+              return;
+            }
+            if (c) {
+              break;
+            }
+          }
+          m_p.m_os->write(&c->m_data[0], c->m_len);
+          if (!*m_p.m_os) {
+            throw runtime_error("stream write failed");
+          }
+          m_p.m_free.push(c); // never full
+        }
+      }
+      pipe_out_t& m_p;
+    };
+    friend class writer_t;
+    pipe_out_t(const pipe_out_t&);
+    pipe_out_t& operator=(const pipe_out_t&);
+    ostream*                    m_os;
+    ThreadPool*                 m_pool;
+    writer_t                    m_writer;
+    pipe_chunk_t                m_chunks[PIPE_DEPTH];
+    spsc_ring_t<pipe_chunk_t*>  m_full;
+    spsc_ring_t<pipe_chunk_t*>  m_free;
+    pipe_chunk_t*               m_cur;
+    bool                        m_done;
+    bool                        m_abort;
+    bool                        m_closed;
+  };
+
+  // ================================================================
+  // The streaming pipeline: a reader thread, the caller that runs
+  // the cipher and a writer thread. When it is off, or for the
+  // input of a memory mapped file that the kernel already reads
+  // ahead, the original streams are used as is.
+  // ================================================================
+  class pipeline_t
+  {
+  public:
+    pipeline_t(istream& is, ostream& os, size_t chunk, bool on)
+      : m_is(is), m_os(os), m_pis(&m_in), m_pos(&m_out),
+        m_pipe_in(on && !stream_mapped(is)), m_pipe_out(on)
+    {
+      if (m_pipe_in) {
+        m_in.open(is, chunk);
+      }
+      if (m_pipe_out) {
+        m_out.open(os, chunk);
+      }
+    }
+    istream& in() {return m_pipe_in ? m_pis : m_is;}
+    ostream& out() {return m_pipe_out ? m_pos : m_os;}
+    // Wait for the writer, it must be called on success.
+    void finish()
+    {
+      if (m_pipe_out) {
+        m_out.finish();
+      }
+    }
+  private:
+    pipeline_t(const pipeline_t&);
+    pipeline_t& operator=(const pipeline_t&);
+    istream&   m_is;
+    ostream&   m_os;
+    pipe_in_t  m_in;
+    pipe_out_t m_out;
+    istream    m_pis;
+    ostream    m_pos;
+    bool       m_pipe_in;
+    bool       m_pipe_out;
+  };
+
+  // ================================================================
+  // Read ciphertext from a stream in chunks.
+  // Armored (MIME) input is decoded as it is read, binary input
+  // is passed through as is.
+  // ================================================================
+  class ct_reader_t
+  {
+  public:
+    ct_reader_t(istream& is, size_t chunk, bool armor, Cipher::Stats* st=0)
+      : m_is(is),
+        m_chunk(chunk),
+        m_ct(armor ? Base64::decode_size(chunk) : 0),
+        m_data(0),
+        m_armor(armor),
+        m_eof(false),
+        m_st(st)
+    {
+    }
+    // Returns the number of bytes at data(), eof() is set
+    // after the last chunk.
+    size_t read()
+    {
+      const unsigned char* p = 0;
+      size_t n = stream_next(m_is, &p, m_raw, m_chunk, m_st);
+      m_eof = n == 0;
+      m_data = p;
+      if (!m_armor) {
+        return n;
+      }
+      m_data = &m_ct[0];
+      stage_timer_t timer(m_st, Cipher::Stats::BASE64, n);
+      size_t len = m_eof ? m_b64.finish(&m_ct[0]) : m_b64.decode(p, n, &m_ct[0]);
+      timer.done();
+      return len;
+    }
+    const unsigned char* data() const {return m_data;}
+    bool eof() const {return m_eof;}
+  private:
+    istream&              m_is;
+    size_t                m_chunk;
+    vector<char>          m_raw;
+    vector<unsigned char> m_ct;
+    const unsigned char*  m_data;
+    Base64::Decoder       m_b64;
+    bool                  m_armor;
+    bool                  m_eof;
+    Cipher::Stats*        m_st;
+  };
+
+  // ================================================================
+  // Read the ciphertext from a ct_reader_t in pieces of a fixed
+  // size. Only the last piece can be short.
+  // ================================================================
+  class ct_bytes_t
+  {
+  public:
+    ct_bytes_t(ct_reader_t& in) : m_in(in), m_data(0), m_avail(0) {}
+    size_t read(unsigned char* out, size_t len)
+    {
+      size_t n = 0;
+      while (n < len) {
+        if (m_avail == 0) {
+          if (m_in.eof()) {
+            break;
+          }
+          m_avail = m_in.read();
+          m_data  = m_in.data();
+          continue;
+        }
+        size_t k = len - n < m_avail ? len - n : m_avail;
+        memcpy(out + n, m_data, k);
+        m_data  += k;
+        m_avail -= k;
+        n += k;
+      }
+      return n;
+    }
+  private:
+    ct_reader_t&         m_in;
+    const unsigned char* m_data;
+    size_t               m_avail;
+  };
+
+  // ================================================================
+  // Stream buffer that returns bytes that were already read from
+  // another stream buffer before the rest of its data. It is how
+  // the format of a stream that cannot seek, like a pipe, is
+  // detected without losing the first bytes.
+  // ================================================================
+  class prefix_buf_t : public streambuf
+  {
+  public:
+    prefix_buf_t(streambuf* sb, const char* p, size_t len)
+      : m_sb(sb), m_buf(p, p + len)
+    {
+      if (len) {
+        setg(&m_buf[0], &m_buf[0], &m_buf[0] + len);
+      }
+    }
+  protected:
+    virtual int_type underflow()
+    {
+      if (gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+      }
+      m_buf.resize(4096);
+      streamsize n = m_sb->sgetn(&m_buf[0], m_buf.size());
+      if (n <= 0) {
+        return traits_type::eof();
+      }
+      setg(&m_buf[0], &m_buf[0], &m_buf[0] + n);
+      return traits_type::to_int_type(*gptr());
+    }
+    virtual streamsize xsgetn(char* s, streamsize len)
+    {
+      // Large reads go straight to the other buffer.
+      streamsize n = egptr() - gptr();
+      if (n > len) {
+        n = len;
+      }
+      if (n > 0) {
+        memcpy(s, gptr(), n);
+        gbump(n);
+      }
+      if (n < len) {
+        n += m_sb->sgetn(s + n, len - n);
+      }
+      return n;
+    }
+  private:
+    streambuf*   m_sb;
+    vector<char> m_buf;
+  };
+
+  // ================================================================
+  // Random access to the ciphertext of a file.
+  // Armored files are read by lines, the offset of a decoded byte
+  // gives the line that it is on. The line length is taken from
+  // the first line. A file without line breaks (openssl -A) is
+  // read in 4 character groups.
+  // ================================================================
+  class ct_file_t
+  {
+  public:
+    ct_file_t(const string& fn, bool armor, Cipher::Stats* st)
+      : m_armor(armor), m_bpl(3), m_stride(4), m_text(0), m_size(0), m_st(st)
+    {
+      m_ifs.open(fn.c_str(), ios::in | ios::binary);
+      if (!m_ifs) {
+        string msg="Cannot read file '"+fn+"'";
+        throw runtime_error(msg);
+      }
+      m_ifs.seekg(0, ios::end);
+      m_text = m_ifs.tellg();
+      if (!m_armor) {
+        m_size = m_text;
+        return;
+      }
+
+      // The trailing new lines and spaces are not part of the
+      // data, scan back until the last MIME character.
+      char buf[4096];
+      size_t n = 0;
+      while (m_text) {
+        n = m_text < sizeof(buf) ? m_text : sizeof(buf);
+        if (read_raw(m_text - n, buf, n) != n) {
+          throw runtime_error("Cannot read file '"+fn+"'");
+        }
+        while (n && isspace(buf[n-1])) {
+          --n;
+          --m_text;
+        }
+        if (n) {
+          break;
+        }
+      }
+      n = read_raw(0, buf, m_text < sizeof(buf) ? m_text : sizeof(buf));
+      const char* nl = (const char*)memchr(buf, '\n', n);
+      if (nl) {
+        size_t w = nl - buf;
+        size_t sep = 1;
+        if (w && buf[w-1] == '\r') {
+          --w;
+          ++sep;
+        }
+        if (w == 0 || w % 4) {
+          throw runtime_error("decrypt_range(): unsupported MIME line length");
+        }
+        m_bpl    = w / 4 * 3;
+        m_stride = w + sep;
+      }
+      if (m_text) {
+        unsigned long long last = (m_text - 1) / m_stride * m_stride;
+        m_size = last / m_stride * m_bpl + decode(last, m_text);
+      }
+    }
+    // The size of the decoded data.
+    unsigned long long size() const {return m_size;}
+    // Read len bytes of decoded data at off.
+    void read(unsigned long long off, unsigned char* out, size_t len)
+    {
+      if (off + len > m_size) {
+        throw runtime_error("decrypt_range(): read past the end of the data");
+      }
+      if (len == 0) {
+        return;
+      }
+      if (!m_armor) {
+        if (read_raw(off, (char*)out, len) != len) {
+          throw runtime_error("decrypt_range(): short read");
+        }
+        return;
+      }
+      unsigned long long line = off / m_bpl;
+      unsigned long long end  = ((off + len - 1) / m_bpl + 1) * m_stride;
+      size_t skip = off - line * m_bpl;
+      size_t n = decode(line * m_stride, end < m_text ? end : m_text);
+      if (n < skip + len) {
+        throw runtime_error("decrypt_range(): the MIME data is truncated");
+      }
+      memcpy(out, &m_ct[skip], len);
+    }
+  private:
+    size_t read_raw(unsigned long long off, char* buf, size_t len)
+    {
+      stage_timer_t timer(m_st, Cipher::Stats::IO);
+      m_ifs.clear();
+      m_ifs.seekg(off);
+      size_t n = stream_read(m_ifs, buf, len);
+      timer.bytes(n);
+      timer.done();
+      return n;
+    }
+    // Decode the text between two line boundaries into m_ct.
+    size_t decode(unsigned long long beg, unsigned long long end)
+    {
+      m_raw.resize(end - beg + 1);
+      size_t n = read_raw(beg, &m_raw[0], end - beg);
+      m_ct.resize(Base64::decode_size(n) + 2);
+      stage_timer_t timer(m_st, Cipher::Stats::BASE64, n);
+      Base64::Decoder dec;
+      size_t k = dec.decode((const unsigned char*)&m_raw[0], n, &m_ct[0]);
+      k += dec.finish(&m_ct[k]);
+      timer.done();
+      return k;
+    }
+  private:
+    ifstream              m_ifs;
+    bool                  m_armor;
+    size_t                m_bpl;    // decoded bytes per line
+    size_t                m_stride; // line length with the separator
+    unsigned long long    m_text;   // file size without the trailing new line
+    unsigned long long    m_size;
+    vector<char>          m_raw;
+    vector<unsigned char> m_ct;
+    Cipher::Stats*        m_st;
+  };
+
+  // ================================================================
+  // Sink that passes on len bytes after skipping the first skip
+  // bytes. It cuts the decrypted blocks down to the byte range
+  // that was asked for.
+  // ================================================================
+  class range_sink_t : public Cipher::Sink
+  {
+  public:
+    range_sink_t(Cipher::Sink& out, unsigned long long skip, unsigned long long len)
+      : m_out(out), m_skip(skip), m_len(len) {}
+    virtual void write(const unsigned char* buf, size_t len)
+    {
+      size_t n = m_skip < len ? m_skip : len;
+      m_skip -= n;
+      buf += n;
+      len -= n;
+      n = m_len < len ? m_len : len;
+      m_len -= n;
+      if (n) {
+        m_out.write(buf, n);
+      }
+    }
+  private:
+    Cipher::Sink&      m_out;
+    unsigned long long m_skip;
+    unsigned long long m_len;
+  };
+
+  // ================================================================
+  // Add a block count to a big-endian 128 bit counter.
+  // This is how the CTR mode IV advances through the stream.
+  // ================================================================
+  void ctr_add(unsigned char* ctr, size_t ivlen, unsigned long long n)
+  {
+    for(size_t i=ivlen; i-- > 0 && n; ) {
+      n += ctr[i];
+      ctr[i] = n & 0xff;
+      n >>= 8;
+    }
+  }
+
+  // ================================================================
+  // scrypt (RFC 7914).
+  // OpenSSL computes the p lanes one after the other, they are
+  // independent so they are computed here and run on a pool of
+  // threads. The result is the same as EVP_PBE_scrypt().
+  // ================================================================
+  inline uint32_t rotl32(uint32_t a, int b)
+  {
+    return (a << b) | (a >> (32 - b));
+  }
+
+  // ================================================================
+  // The Salsa20/8 core.
+  // ================================================================
+  void salsa20_8(uint32_t b[16])
+  {
+    uint32_t x[16];
+    memcpy(x, b, sizeof(x));
+    for(int i=0;i<8;i+=2) {
+      // Columns.
+      x[ 4] ^= rotl32(x[ 0]+x[12], 7);  x[ 8] ^= rotl32(x[ 4]+x[ 0], 9);
+      x[12] ^= rotl32(x[ 8]+x[ 4],13);  x[ 0] ^= rotl32(x[12]+x[ 8],18);
+      x[ 9] ^= rotl32(x[ 5]+x[ 1], 7);  x[13] ^= rotl32(x[ 9]+x[ 5], 9);
+      x[ 1] ^= rotl32(x[13]+x[ 9],13);  x[ 5] ^= rotl32(x[ 1]+x[13],18);
+      x[14] ^= rotl32(x[10]+x[ 6], 7);  x[ 2] ^= rotl32(x[14]+x[10], 9);
+      x[ 6] ^= rotl32(x[ 2]+x[14],13);  x[10] ^= rotl32(x[ 6]+x[ 2],18);
+      x[ 3] ^= rotl32(x[15]+x[11], 7);  x[ 7] ^= rotl32(x[ 3]+x[15], 9);
+      x[11] ^= rotl32(x[ 7]+x[ 3],13);  x[15] ^= rotl32(x[11]+x[ 7],18);
+      // Rows.
+      x[ 1] ^= rotl32(x[ 0]+x[ 3], 7);  x[ 2] ^= rotl32(x[ 1]+x[ 0], 9);
+      x[ 3] ^= rotl32(x[ 2]+x[ 1],13);  x[ 0] ^= rotl32(x[ 3]+x[ 2],18);
+      x[ 6] ^= rotl32(x[ 5]+x[ 4], 7);  x[ 7] ^= rotl32(x[ 6]+x[ 5], 9);
+      x[ 4] ^= rotl32(x[ 7]+x[ 6],13);  x[ 5] ^= rotl32(x[ 4]+x[ 7],18);
+      x[11] ^= rotl32(x[10]+x[ 9], 7);  x[ 8] ^= rotl32(x[11]+x[10], 9);
+      x[ 9] ^= rotl32(x[ 8]+x[11],13);  x[10] ^= rotl32(x[ 9]+x[ 8],18);
+      x[12] ^= rotl32(x[15]+x[14], 7);  x[13] ^= rotl32(x[12]+x[15], 9);
+      x[14] ^= rotl32(x[13]+x[12],13);  x[15] ^= rotl32(x[14]+x[13],18);
+    }
+    for(int i=0;i<16;++i) {
+      b[i] += x[i];
+    }
+  }
+
+  // ================================================================
+  // BlockMix: b and y are 2r 64 byte blocks.
+  // ================================================================
+  void scrypt_blockmix(const uint32_t* b, uint32_t* y, size_t r)
+  {
+    uint32_t x[16];
+    memcpy(x, &b[(2 * r - 1) * 16], sizeof(x));
+    for(size_t i=0;i<2*r;++i) {
+      for(int k=0;k<16;++k) {
+        x[k] ^= b[i * 16 + k];
+      }
+      salsa20_8(x);
+      // The even blocks go to the first half, the odd ones to
+      // the second half.
+      memcpy(&y[(i / 2 + (i & 1) * r) * 16], x, sizeof(x));
+    }
+  }
+
+  // ================================================================
+  // ROMix of one lane, it uses 128 * r * n bytes.
+  // ================================================================
+  class scrypt_lane_t : public ThreadPool::Job
+  {
+  public:
+    scrypt_lane_t() : m_b(0), m_r(0), m_n(0) {}
+    void setup(unsigned char* b, size_t r, unsigned long long n)
+    {
+      m_b = b;
+      m_r = r;
+      m_n = n;
+    }
+    virtual void run()
+    {
+      const size_t words = 32 * m_r;
+      vector<uint32_t> v(words * m_n);
+      vector<uint32_t> xy(2 * words);
+      uint32_t* x = &xy[0];
+      uint32_t* y = &xy[words];
+      for(size_t k=0;k<words;++k) {
+        const unsigned char* p = &m_b[4 * k];
+        x[k] = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+      }
+      for(unsigned long long i=0;i<m_n;i+=2) {
+        memcpy(&v[i * words], x, words * 4);
+        scrypt_blockmix(x, y, m_r);
+        memcpy(&v[(i + 1) * words], y, words * 4);
+        scrypt_blockmix(y, x, m_r);
+      }
+      for(unsigned long long i=0;i<m_n;i+=2) {
+        mix(x, y, v);
+        mix(y, x, v);
+      }
+      for(size_t k=0;k<words;++k) {
+        unsigned char* p = &m_b[4 * k];
+        p[0] = x[k];
+        p[1] = x[k] >> 8;
+        p[2] = x[k] >> 16;
+        p[3] = x[k] >> 24;
+      }
+      OPENSSL_cleanse(&v[0], v.size() * 4);
+      OPENSSL_cleanse(&xy[0], xy.size() * 4);
+    }
+  private:
+    // Integerify, xor the selected block in and mix.
+    void mix(uint32_t* x, uint32_t* y, const vector<uint32_t>& v)
+    {
+      const size_t words = 32 * m_r;
+      const uint32_t* last = &x[(2 * m_r - 1) * 16];
+      unsigned long long j = (last[0] | ((unsigned long long)last[1] << 32)) & (m_n - 1);
+      const uint32_t* vj = &v[j * words];
+      for(size_t k=0;k<words;++k) {
+        x[k] ^= vj[k];
+      }
+      scrypt_blockmix(x, y, m_r);
+    }
+    unsigned char*     m_b;
+    size_t             m_r;
+    unsigned long long m_n;
+  };
+
+  // ================================================================
+  // Derive len bytes with scrypt.
+  // ================================================================
+  void scrypt_derive(const string& pass,
+                     const unsigned char* salt,
+                     size_t saltlen,
+                     unsigned long long n,
+                     uint r,
+                     uint p,
+                     uint threads,
+                     unsigned char* out,
+                     size_t len)
+  {
+    // Each lane that runs at once holds 128 * r * N bytes, B holds
+    // 128 * r * p. r * p < 2^30 so the sizes need 64 bits.
+    const size_t running = threads > 1 && p > 1 ? (threads < p ? threads : p) : 1;
+    const unsigned long long blen = 128ULL * r * p;
+    const unsigned long long vlen = 128ULL * r;
+    if (blen >= SCRYPT_MAX_MEM || n > (SCRYPT_MAX_MEM - blen) / vlen / running) {
+      throw runtime_error("init(): scrypt needs too much memory, reduce the kdf_cost()");
+    }
+    vector<unsigned char> b(blen);
+    if (1 != PKCS5_PBKDF2_HMAC(pass.data(), pass.size(), salt, saltlen, 1,
+                               EVP_sha256(), b.size(), &b[0])) {
+      throw runtime_error("init(): scrypt PBKDF2 failed");
+    }
+    vector<scrypt_lane_t> lanes(p);
+    for(uint i=0;i<p;++i) {
+      lanes[i].setup(&b[(size_t)128 * r * i], r, n);
+    }
+    if (threads > 1 && p > 1) {
+      ThreadPool pool(threads < p ? threads : p);
+      for(uint i=0;i<p;++i) {
+        pool.submit(&lanes[i]);
+      }
+      for(uint i=0;i<p;++i) {
+        pool.wait(&lanes[i]);
+      }
+    }
+    else {
+      for(uint i=0;i<p;++i) {
+        lanes[i].run();
+      }
+    }
+    bool ok = 1 == PKCS5_PBKDF2_HMAC(pass.data(), pass.size(), &b[0], b.size(), 1,
+                                     EVP_sha256(), len, out);
+    OPENSSL_cleanse(&b[0], b.size());
+    if (!ok) {
+      throw runtime_error("init(): scrypt PBKDF2 failed");
+    }
+  }
+
+  // ================================================================
+  // Encrypt or decrypt one segment of a file on a worker thread.
+  // The first m_prefix bytes of the input are copied to the
+  // output as is, that is how the salt prefix is passed through.
+  // ================================================================
+  class segment_job_t : public ThreadPool::Job
+  {
+  public:
+    segment_job_t()
+      : m_data(0), m_prefix(0), m_len(0), m_outlen(0),
+        m_cipher(0), m_enc(1), m_pad(true), m_armor(false), m_st(0) {}
+    ~segment_job_t()
+    {
+      OPENSSL_cleanse(m_key, sizeof(m_key));
+    }
+    void setup(const EVP_CIPHER* cipher,
+               const unsigned char* key,
+               const unsigned char* iv,
+               int enc,
+               bool pad,
+               bool armor,
+               Cipher::Stats* st)
+    {
+      m_cipher = cipher;
+      m_st     = st;
+      memcpy(m_key, key, EVP_CIPHER_key_length(cipher));
+      memcpy(m_iv, iv, EVP_CIPHER_iv_length(cipher));
+      m_enc    = enc;
+      m_pad    = pad;
+      m_armor  = armor;
+      m_data   = 0;
+      m_prefix = 0;
+      m_len    = 0;
+      m_outlen = 0;
+    }
+    virtual void run()
+    {
+      EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+      if (!ctx) {
+        throw runtime_error("EVP_CIPHER_CTX_new() failed");
+      }
+      m_tmp.resize(m_len + EVP_MAX_BLOCK_LENGTH);
+      unsigned char* out = &m_tmp[0];
+      const unsigned char* in = m_data ? m_data : &m_in[0] + m_prefix;
+      if (m_prefix) {
+        memcpy(out, &m_in[0], m_prefix);
+      }
+      int len1 = 0;
+      int len2 = 0;
+      stage_timer_t timer(m_st, Cipher::Stats::CIPHER, m_len - m_prefix);
+      bool ok =
+        1 == EVP_CipherInit_ex(ctx, m_cipher, NULL, m_key, m_iv, m_enc) &&
+        1 == EVP_CIPHER_CTX_set_padding(ctx, m_pad) &&
+        1 == EVP_CipherUpdate(ctx, out + m_prefix, &len1,
+                              in, m_len - m_prefix) &&
+        1 == EVP_CipherFinal_ex(ctx, out + m_prefix + len1, &len2);
+      EVP_CIPHER_CTX_free(ctx);
+      if (!ok) {
+        throw runtime_error(m_enc ? "EVP_EncryptUpdate() failed" :
+                            "EVP_DecryptFinal_ex() failed");
+      }
+      timer.done();
+      size_t n = m_prefix + len1 + len2;
+      if (m_armor) {
+        stage_timer_t b64(m_st, Cipher::Stats::BASE64, n);
+        m_out.resize(Base64::encode_size(n));
+        m_outlen = Base64::encode(out, n, &m_out[0]);
+        b64.done();
+      }
+      else {
+        m_out.swap(m_tmp);
+        m_outlen = n;
+      }
+    }
+  public:
+    vector<unsigned char> m_in;
+    const unsigned char*  m_data; // the input after the prefix if it is not in m_in
+    vector<unsigned char> m_out;
+    size_t                m_prefix;
+    size_t                m_len;
+    size_t                m_outlen;
+  private:
+    const EVP_CIPHER*     m_cipher;
+    unsigned char         m_key[EVP_MAX_KEY_LENGTH];
+    unsigned char         m_iv[EVP_MAX_IV_LENGTH];
+    int                   m_enc;
+    bool                  m_pad;
+    bool                  m_armor;
+    vector<unsigned char> m_tmp;
+    Cipher::Stats*        m_st;
+  };
+
+  // ================================================================
+  // Encrypt or decrypt one chunk of the AEAD format on a worker
+  // thread. The context keeps the key schedule between chunks,
+  // only the nonce changes. The output of a decrypted chunk is
+  // only used if its tag is valid.
+  // ================================================================
+  class aead_job_t : public ThreadPool::Job
+  {
+  public:
+    aead_job_t()
+      : m_data(0), m_len(0), m_index(0), m_last(false), m_outlen(0),
+        m_cipher(0), m_enc(1), m_ctx(0), m_keyed(false), m_st(0) {}
+    ~aead_job_t()
+    {
+      OPENSSL_cleanse(m_key, sizeof(m_key));
+      EVP_CIPHER_CTX_free(m_ctx);
+    }
+    void setup(const EVP_CIPHER* cipher,
+               const unsigned char* key,
+               const unsigned char* hdr,
+               int enc,
+               Cipher::Stats* st)
+    {
+      size_t klen = EVP_CIPHER_key_length(cipher);
+      if (cipher != m_cipher || enc != m_enc || memcmp(key, m_key, klen) != 0) {
+        m_cipher = cipher;
+        m_enc    = enc;
+        m_keyed  = false;
+        memcpy(m_key, key, klen);
+      }
+      memcpy(m_hdr, hdr, AEAD_HEADER_LEN);
+      m_st     = st;
+      m_data   = 0;
+      m_len    = 0;
+      m_index  = 0;
+      m_last   = false;
+      m_outlen = 0;
+    }
+    virtual void run()
+    {
+      // The input is the plaintext or the ciphertext followed by
+      // the tag.
+      const unsigned char* in = m_data ? m_data : (m_in.empty() ? 0 : &m_in[0]);
+      size_t len = m_enc ? m_len : m_len - AEAD_TAG_LEN;
+      if (!m_ctx && !(m_ctx = EVP_CIPHER_CTX_new())) {
+        throw runtime_error("EVP_CIPHER_CTX_new() failed");
+      }
+      unsigned char nonce[AEAD_NONCE_LEN];
+      memcpy(nonce, m_hdr + 20, AEAD_NONCE_LEN);
+      for(int i=0;i<8;++i) {
+        nonce[AEAD_NONCE_LEN - 1 - i] ^= (unsigned char)(m_index >> (8 * i));
+      }
+      unsigned char aad[AEAD_HEADER_LEN + 1];
+      memcpy(aad, m_hdr, AEAD_HEADER_LEN);
+      aad[AEAD_HEADER_LEN] = m_last ? 1 : 0;
+
+      stage_timer_t timer(m_st, Cipher::Stats::CIPHER, len);
+      m_out.resize(len + AEAD_TAG_LEN);
+      unsigned char* out = &m_out[0];
+      int n1 = 0;
+      int n2 = 0;
+      int n3 = 0;
+      bool ok = m_keyed ?
+        1 == EVP_CipherInit_ex(m_ctx, NULL, NULL, NULL, nonce, m_enc) :
+        1 == EVP_CipherInit_ex(m_ctx, m_cipher, NULL, m_key, nonce, m_enc);
+      if (!ok) {
+        throw runtime_error("EVP_CipherInit_ex() failed");
+      }
+      m_keyed = true;
+      ok =
+        (m_enc || 1 == EVP_CIPHER_CTX_ctrl(m_ctx, EVP_CTRL_AEAD_SET_TAG,
+                                           AEAD_TAG_LEN, (void*)(in + len))) &&
+        1 == EVP_CipherUpdate(m_ctx, NULL, &n1, aad, sizeof(aad)) &&
+        (len == 0 || 1 == EVP_CipherUpdate(m_ctx, out, &n2, in, len)) &&
+        1 == EVP_CipherFinal_ex(m_ctx, out + n2, &n3);
+      if (!ok && !m_enc) {
+        ostringstream msg;
+        msg << "decrypt(): authentication failed for chunk " << m_index;
+        throw runtime_error(msg.str());
+      }
+      if (!ok || (m_enc && 1 != EVP_CIPHER_CTX_ctrl(m_ctx, EVP_CTRL_AEAD_GET_TAG,
+                                                    AEAD_TAG_LEN, out + len))) {
+        throw runtime_error("EVP_EncryptUpdate() failed");
+      }
+      m_outlen = m_enc ? len + AEAD_TAG_LEN : len;
+      timer.done();
+    }
+  public:
+    vector<unsigned char> m_in;
+    const unsigned char*  m_data;  // the input if it is not in m_in
+    size_t                m_len;
+    unsigned long long    m_index;
+    bool                  m_last;
+    vector<unsigned char> m_out;
+    size_t                m_outlen;
+  private:
+    aead_job_t(const aead_job_t&);
+    aead_job_t& operator=(const aead_job_t&);
+    const EVP_CIPHER*     m_cipher;
+    unsigned char         m_key[EVP_MAX_KEY_LENGTH];
+    unsigned char         m_hdr[AEAD_HEADER_LEN];
+    int                   m_enc;
+    EVP_CIPHER_CTX*       m_ctx;
+    bool                  m_keyed;
+    Cipher::Stats*        m_st;
+  };
+
+  // ================================================================
+  // Ordered queue of segment jobs.
+  // Jobs run in parallel but their output is written in the order
+  // that they were submitted. At most 2 jobs per thread are in
+  // flight which bounds the memory used. With one thread there is
+  // no pool, the jobs run on this thread when they are submitted.
+  // ================================================================
+  template<class Job> class segment_queue_t
+  {
+  public:
+    segment_queue_t(uint nthreads, Cipher::Sink& out)
+      : m_pool(nthreads > 1 ? new ThreadPool(nthreads) : 0),
+        m_window(m_pool ? 2 * m_pool->size() : 1),
+        m_out(out) {}
+    ~segment_queue_t()
+    {
+      // Wait for the running jobs before they are deleted.
+      while (!m_busy.empty()) {
+        try {
+          m_pool->wait(m_busy.front());
+        }
+        catch (...) {
+        }
+        m_busy.pop_front();
+      }
+      delete m_pool;
+      for(size_t i=0;i<m_jobs.size();++i) {
+        delete m_jobs[i];
+      }
+    }
+    Job* next()
+    {
+      if (m_idle.empty() && m_busy.size() >= m_window) {
+        drain();
+      }
+      if (m_idle.empty()) {
+        m_jobs.push_back(new Job);
+        m_idle.push_back(m_jobs.back());
+      }
+      Job* job = m_idle.back();
+      m_idle.pop_back();
+      return job;
+    }
+    void submit(Job* job)
+    {
+      if (!m_pool) {
+        m_idle.push_back(job);
+        job->run();
+        write(job);
+        return;
+      }
+      m_busy.push_back(job);
+      m_pool->submit(job);
+    }
+    void recycle(Job* job)
+    {
+      m_idle.push_back(job);
+    }
+    void finish()
+    {
+      while (!m_busy.empty()) {
+        drain();
+      }
+    }
+  private:
+    segment_queue_t(const segment_queue_t&);
+    segment_queue_t& operator=(const segment_queue_t&);
+    void drain()
+    {
+      Job* job = m_busy.front();
+      m_pool->wait(job);
+      m_busy.pop_front();
+      m_idle.push_back(job);
+      write(job);
+    }
+    void write(Job* job)
+    {
+      if (job->m_outlen) {
+        m_out.write(&job->m_out[0], job->m_outlen);
+      }
+    }
+  private:
+    ThreadPool*   m_pool;
+    size_t        m_window;
+    Cipher::Sink& m_out;
+    deque<Job*>   m_busy;
+    vector<Job*>  m_idle;
+    vector<Job*>  m_jobs; // all of them, they are deleted at the end
+  };
+
+  // ================================================================
+  // Use another cipher for the duration of a call. The AEAD
+  // format names its algorithm, it overrides the configured
+  // cipher when a file is decrypted.
+  // ================================================================
+  class cipher_swap_t
+  {
+  public:
+    cipher_swap_t(string& name, const EVP_CIPHER*& evp, const aead_alg_t* alg)
+      : m_name(name), m_evp(evp), m_saved_name(name), m_saved(evp), m_fetched(0)
+    {
+      if (EVP_CIPHER_nid(evp) != alg->nid) {
+        m_fetched = fetch_cipher(alg->name);
+        if (!m_fetched) {
+          throw runtime_error(string("decrypt(): cipher does not exist ")+alg->name);
+        }
+        m_name = alg->name;
+        m_evp  = m_fetched;
+      }
+    }
+    ~cipher_swap_t()
+    {
+      if (m_fetched) {
+        m_name = m_saved_name;
+        m_evp  = m_saved;
+        free_cipher(m_fetched);
+      }
+    }
+  private:
+    cipher_swap_t(const cipher_swap_t&);
+    cipher_swap_t& operator=(const cipher_swap_t&);
+    string&            m_name;
+    const EVP_CIPHER*& m_evp;
+    string             m_saved_name;
+    const EVP_CIPHER*  m_saved;
+    const EVP_CIPHER*  m_fetched;
+  };
+}
+
+// ================================================================
+// Constructor.
+// ================================================================
+Cipher::Cipher()
+  : m_cipher(CIPHER_DEFAULT_CIPHER),
+    m_digest(CIPHER_DEFAULT_DIGEST),
+    m_evp_cipher(0),
+    m_evp_digest(0),
+    m_count(CIPHER_DEFAULT_COUNT),
+    m_kdf(BYTES_TO_KEY),
+    m_kdf_memory(0),
+    m_kdf_lanes(1),
+    m_kdf_block(8),
+    m_chunk_size(CIPHER_DEFAULT_CHUNK_SIZE),
+    m_key_cache(0),
+    m_ctx_pool(CIPHER_DEFAULT_CTX_POOL_SIZE),
+    m_threads(1),
+    m_pipeline(false),
+    m_io(IO_STREAMS),
+    m_armor(true),
+    m_embed(true), // compatible with openssl
+    m_debug(false),
+    m_collect_stats(false)
+{
+  resolve();
+}
+
+// ================================================================
+// Constructor.
+// ================================================================
+Cipher::Cipher(const std::string& cipher,
+	       const std::string& digest,
+	       uint count,
+	       bool embed)
+  : m_cipher(cipher),
+    m_digest(digest),
+    m_evp_cipher(0),
+    m_evp_digest(0),
+    m_count(count),
+    m_kdf(BYTES_TO_KEY),
+    m_kdf_memory(0),
+    m_kdf_lanes(1),
+    m_kdf_block(8),
+    m_chunk_size(CIPHER_DEFAULT_CHUNK_SIZE),
+    m_key_cache(0),
+    m_ctx_pool(CIPHER_DEFAULT_CTX_POOL_SIZE),
+    m_threads(1),
+    m_pipeline(false),
+    m_io(IO_STREAMS),
+    m_armor(true),
+    m_embed(embed),
+    m_debug(false),
+    m_collect_stats(false)
+{
+  resolve();
+}
+
+// ================================================================
+// Copy constructor.
+// ================================================================
+Cipher::Cipher(const Cipher& c)
+  : m_cipher(c.m_cipher),
+    m_digest(c.m_digest),
+    m_evp_cipher(0),
+    m_evp_digest(0),
+    m_count(c.m_count),
+    m_kdf(c.m_kdf),
+    m_kdf_memory(c.m_kdf_memory),
+    m_kdf_lanes(c.m_kdf_lanes),
+    m_kdf_block(c.m_kdf_block),
+    m_chunk_size(c.m_chunk_size),
+    m_key_cache(c.m_key_cache),
+    m_ctx_pool(c.m_ctx_pool.max_size()),
+    m_threads(c.m_threads),
+    m_pipeline(c.m_pipeline),
+    m_io(c.m_io),
+    m_armor(c.m_armor),
+    m_embed(c.m_embed),
+    m_debug(c.m_debug),
+    m_collect_stats(c.m_collect_stats)
+{
+  resolve();
+}
+
+// ================================================================
+// Assignment.
+// ================================================================
+Cipher& Cipher::operator=(const Cipher& c)
+{
+  if (this != &c) {
+    Cipher tmp(c); // resolve first so that a failure leaves *this intact
+    release();
+    m_cipher     = tmp.m_cipher;
+    m_digest     = tmp.m_digest;
+    m_evp_cipher = tmp.m_evp_cipher;
+    m_evp_digest = tmp.m_evp_digest;
+    m_count      = tmp.m_count;
+    m_kdf        = tmp.m_kdf;
+    m_kdf_memory = tmp.m_kdf_memory;
+    m_kdf_lanes  = tmp.m_kdf_lanes;
+    m_kdf_block  = tmp.m_kdf_block;
+    m_chunk_size = tmp.m_chunk_size;
+    m_key_cache  = tmp.m_key_cache;
+    m_ctx_pool.max_size(tmp.m_ctx_pool.max_size());
+    m_threads    = tmp.m_threads;
+    m_pipeline   = tmp.m_pipeline;
+    m_io         = tmp.m_io;
+    m_armor      = tmp.m_armor;
+    m_embed      = tmp.m_embed;
+    m_debug      = tmp.m_debug;
+    m_collect_stats = tmp.m_collect_stats;
+    tmp.m_evp_cipher = 0;
+    tmp.m_evp_digest = 0;
+  }
+  return *this;
+}
+
+// ================================================================
+// Destructor.
+// ================================================================
+Cipher::~Cipher()
+{
+  release();
+}
+
+// ================================================================
+// resolve
+// ================================================================
+void Cipher::resolve()
+{
+  // Look up the algorithms once so that encrypt() and decrypt()
+  // do not pay for the name lookups. On OpenSSL 3 they are
+  // explicitly fetched so that the provider lookup is not
+  // repeated by every EVP_*Init_ex() call.
+  load_algorithms();
+  m_evp_cipher = fetch_cipher(m_cipher);
+  m_evp_digest = fetch_digest(m_digest);
+  if (!m_evp_cipher || !m_evp_digest) {
+    string msg = !m_evp_cipher ?
+      "Cipher(): cipher does not exist "+m_cipher :
+      "Cipher(): digest does not exist "+m_digest;
+    release();
+    throw runtime_error(msg);
+  }
+
+  // The key and IV must fit in the fixed size buffers. The
+  // openssl format has no room for an authentication tag so only
+  // the AEAD ciphers that the framed format knows are allowed.
+  const char* msg = 0;
+  if (EVP_CIPHER_key_length(m_evp_cipher) > (int)sizeof(aes_key_t)) {
+    msg = "Cipher(): key is too long for cipher ";
+  }
+  else if (EVP_CIPHER_iv_length(m_evp_cipher) > (int)sizeof(aes_iv_t)) {
+    msg = "Cipher(): iv is too long for cipher ";
+  }
+  else if (aead() && !aead_alg(EVP_CIPHER_nid(m_evp_cipher))) {
+    msg = "Cipher(): AEAD cipher is not supported ";
+  }
+  if (msg) {
+    release();
+    throw runtime_error(msg+m_cipher);
+  }
+}
+
+// ================================================================
+// release
+// ================================================================
+void Cipher::release()
+{
+  free_cipher(m_evp_cipher);
+  free_digest(m_evp_digest);
+  m_evp_cipher = 0;
+  m_evp_digest = 0;
+}
+
+// ================================================================
+// encrypt
+// ================================================================
+string Cipher::encrypt(const string& plaintext,
+		       const string& pass,
+		       const string& salt) const
+{
+  DBG_FCT("encrypt");
+  if (aead()) {
+    // The framed format is written by the stream code. The
+    // output has no trailing new line like the other ciphers.
+    istringstream is(plaintext);
+    ostringstream os;
+    encrypt_stream_aead(is, os, pass, salt);
+    string ret = os.str();
+    if (m_armor && !ret.empty() && ret[ret.size()-1] == '\n') {
+      ret.erase(ret.size()-1);
+    }
+    return ret;
+  }
+  // The cipher and the MIME encoding are fused by the buffer
+  // API, see seal(), so the ciphertext is never materialized.
+  size_t n = plaintext.size();
+  string ret(max_output_size(n, true), 0);
+  ret.resize(encrypt((const uchar*)plaintext.data(), n, (uchar*)&ret[0], ret.size(), pass, salt));
+  DBG_MDUMP(ret);
+  return ret;
+}
+
+// ================================================================
+// encrypt_file
+// ================================================================
+void Cipher::encrypt_file(const string& ifn,
+			  const string& ofn,
+			  const string& pass,
+			  const string& salt) const
+{
+  DBG_FCT("encrypt_file");
+  ifile_t ifs(ifn, m_io, m_chunk_size);
+  ofile_t ofs(ofn, m_io, m_chunk_size);
+  encrypt_stream(ifs.stream(), ofs.stream(), pass, salt);
+  ofs.commit();
+}
+
+// ================================================================
+// encrypt_file (stream output)
+// ================================================================
+void Cipher::encrypt_file(const string& ifn,
+			  ostream& os,
+			  const string& pass,
+			  const string& salt) const
+{
+  DBG_FCT("encrypt_file");
+  ifile_t ifs(ifn, m_io, m_chunk_size);
+  encrypt_stream(ifs.stream(), os, pass, salt);
+}
+
+// ================================================================
+// encrypt_stream
+// ================================================================
+void Cipher::encrypt_stream(istream& is,
+			    ostream& os,
+			    const string& pass,
+			    const string& salt) const
+{
+  DBG_FCT("encrypt_stream");
+  if (aead()) {
+    encrypt_stream_aead(is, os, pass, salt);
+    return;
+  }
+  if (parallel(1)) {
+    encrypt_stream_parallel(is, os, pass, salt);
+    return;
+  }
+  Encryptor enc(*this);
+  enc.begin(pass, salt);
+
+  // The buffer is sized for one chunk so the memory used is
+  // independent of the input size. Memory mapped files are
+  // encrypted in place without the buffer.
+  pipeline_t pipe(is, os, m_chunk_size, m_pipeline);
+  ostream_sink_t out(pipe.out(), stats_ptr());
+  b64_encode_sink_t b64(out, stats_ptr());
+  Sink& sink = m_armor ? (Sink&)b64 : (Sink&)out;
+  vector<char> pt_buf;
+  for(;;) {
+    const uchar* pt = 0;
+    size_t n = stream_next(pipe.in(), &pt, pt_buf, m_chunk_size, stats_ptr());
+    if (n == 0) {
+      break;
+    }
+    enc.update(pt, n, sink);
+  }
+  enc.finish(sink);
+  if (m_armor) {
+    b64.finish();
+  }
+  pipe.finish();
+}
+
+// ================================================================
+// decrypt
+// ================================================================
+string Cipher::decrypt(const string& mimetext,
+		       const string& pass,
+		       const string& salt) const
+{
+  DBG_FCT("decrypt");
+  if (aead() || aead_magic(mimetext.data(), mimetext.size(), m_armor)) {
+    istringstream is(mimetext);
+    ostringstream os;
+    decrypt_stream_aead(is, os, pass);
+    return os.str();
+  }
+  // The MIME decoding and the cipher are fused by the buffer
+  // API so the decoded ciphertext is never materialized.
+  size_t n = mimetext.size();
+  string ret(max_output_size(n, false), 0);
+  ret.resize(decrypt((const uchar*)mimetext.data(), n, (uchar*)&ret[0], ret.size(), pass, salt));
+  DBG_MDUMP(ret);
+  return ret;
+}
+
+// ================================================================
+// max_output_size
+// ================================================================
+size_t Cipher::max_output_size(size_t len, bool enc) const
+{
+  if (!enc) {
+    // The plaintext is never longer than the ciphertext.
+    return m_armor ? (len / 4 + 1) * 3 : len;
+  }
+  size_t bs = EVP_CIPHER_block_size(m_evp_cipher);
+  size_t n  = (m_embed ? 16 : 0) + (bs > 1 ? (len / bs + 1) * bs : len);
+  if (m_armor) {
+    n = (n + 2) / 3 * 4 + (n + 47) / 48; // 64 column lines
+  }
+  return n;
+}
+
+// ================================================================
+// encrypt (buffer)
+// ================================================================
+size_t Cipher::encrypt(const uchar* plaintext,
+		       size_t plaintext_len,
+		       uchar* out,
+		       size_t outlen,
+		       const string& pass,
+		       const string& salt) const
+{
+  DBG_FCT("encrypt");
+  if (aead()) {
+    throw runtime_error("encrypt(): AEAD ciphers are not supported by the buffer API");
+  }
+  if (outlen < max_output_size(plaintext_len, true)) {
+    throw runtime_error("encrypt(): the output buffer is too small");
+  }
+  state_t st(*this);
+  set_salt(st, salt);
+  init(st, pass);
+  CtxPool::Lease lease(m_ctx_pool, m_evp_cipher, st.key, st.iv, 1);
+  uchar hdr[16];
+  memcpy(&hdr[0], SALTED_PREFIX, 8);
+  memcpy(&hdr[8], st.salt, 8);
+  size_t n = seal(lease.ctx(), hdr, m_embed ? 16 : 0, plaintext, plaintext_len, out);
+  lease.done();
+  return n;
+}
+
+// ================================================================
+// seal
+// ================================================================
+size_t Cipher::seal(EVP_CIPHER_CTX* ctx,
+		    const uchar* prefix,
+		    size_t prefix_len,
+		    const uchar* plaintext,
+		    size_t plaintext_len,
+		    uchar* out) const
+{
+  // Binary output is encrypted in place. Armored output is
+  // encrypted into a stack buffer one block at a time and the
+  // whole 48 byte groups are MIME encoded from it while they
+  // are still in the cache.
+  stage_split_t timer(stats_ptr(), Stats::CIPHER);
+  timer.bytes(Stats::CIPHER, plaintext_len);
+  uchar  buf[FUSED_BLOCK + EVP_MAX_BLOCK_LENGTH];
+  uchar* ct   = m_armor ? buf : out;
+  size_t used = prefix_len;
+  if (prefix_len) {
+    memcpy(ct, prefix, prefix_len);
+  }
+  uchar* p = out;
+  int n = 0;
+  while (plaintext_len) {
+    size_t len = plaintext_len;
+    if (m_armor && len > FUSED_BLOCK - used) {
+      len = FUSED_BLOCK - used;
+    }
+    if (1 != EVP_EncryptUpdate(ctx, ct + used, &n, plaintext, len)) {
+      throw runtime_error("EVP_EncryptUpdate() failed");
+    }
+    used += n;
+    plaintext += len;
+    plaintext_len -= len;
+    if (m_armor) {
+      size_t whole = (used / 48) * 48;
+      timer.stage(Stats::BASE64);
+      timer.bytes(Stats::BASE64, whole);
+      p += Base64::encode(buf, whole, p);
+      timer.stage(Stats::CIPHER);
+      memmove(buf, buf + whole, used - whole);
+      used -= whole;
+    }
+  }
+  if (1 != EVP_EncryptFinal_ex(ctx, ct + used, &n)) {
+    throw runtime_error("EVP_EncryptFinal_ex() failed");
+  }
+  used += n;
+  if (!m_armor) {
+    timer.done();
+    return used;
+  }
+  timer.stage(Stats::BASE64);
+  timer.bytes(Stats::BASE64, used);
+  p += Base64::encode(buf, used, p);
+  timer.done();
+  return p > out ? p - out - 1 : 0; // no trailing new line, like encrypt()
+}
+
+// ================================================================
+// decrypt (buffer)
+// ================================================================
+size_t Cipher::decrypt(const uchar* ciphertext,
+		       size_t ciphertext_len,
+		       uchar* out,
+		       size_t outlen,
+		       const string& pass,
+		       const string& salt) const
+{
+  DBG_FCT("decrypt");
+  if (aead()) {
+    throw runtime_error("decrypt(): AEAD ciphers are not supported by the buffer API");
+  }
+  if (outlen < max_output_size(ciphertext_len, false)) {
+    throw runtime_error("decrypt(): the output buffer is too small");
+  }
+
+  // Armored input is MIME decoded into a stack buffer one block
+  // at a time and decrypted while it is still in the cache,
+  // binary input is decrypted as is. The first block always
+  // contains the salt header if there is one.
+  Base64::Decoder dec;
+  uchar buf[FUSED_BLOCK];
+  const uchar* ct  = ciphertext;
+  const uchar* end = ciphertext + ciphertext_len;
+  size_t len = ciphertext_len;
+  stage_split_t timer(stats_ptr(), m_armor ? Stats::BASE64 : Stats::STAGES);
+  if (m_armor) {
+    len = 0;
+    while (len < 16 && ct < end) {
+      size_t k = (sizeof(buf) - len) / 3 * 4 - 4;
+      if (k > (size_t)(end - ct)) {
+        k = end - ct;
+      }
+      len += dec.decode(ct, k, buf + len);
+      ct += k;
+    }
+    if (ct == end) {
+      len += dec.finish(buf + len);
+    }
+    timer.bytes(Stats::BASE64, ct - ciphertext);
+  }
+  state_t st(*this);
+  const uchar* first = m_armor ? buf : ciphertext;
+  if (len >= 16 && strncmp((const char*)first, SALTED_PREFIX, 8) == 0) {
+    memcpy(st.salt, &first[8], 8);
+    first += 16;
+    len -= 16;
+  }
+  else {
+    set_salt(st, salt);
+  }
+  timer.stage(Stats::STAGES);
+  init(st, pass);
+  timer.stage(Stats::CIPHER);
+  CtxPool::Lease lease(m_ctx_pool, m_evp_cipher, st.key, st.iv, 0);
+  EVP_CIPHER_CTX* ctx = lease.ctx();
+
+  uchar* p = out;
+  int n = 0;
+  for(;;) {
+    timer.bytes(Stats::CIPHER, len);
+    if (1 != EVP_DecryptUpdate(ctx, p, &n, first, len)) {
+      throw runtime_error("EVP_DecryptUpdate() failed");
+    }
+    p += n;
+    if (!m_armor || ct == end) {
+      break;
+    }
+    timer.stage(Stats::BASE64);
+    size_t k = sizeof(buf) / 3 * 4 - 4;
+    if (k > (size_t)(end - ct)) {
+      k = end - ct;
+    }
+    len = dec.decode(ct, k, buf);
+    ct += k;
+    if (ct == end) {
+      len += dec.finish(buf + len);
+    }
+    timer.bytes(Stats::BASE64, k);
+    timer.stage(Stats::CIPHER);
+    first = buf;
+  }
+  if (1 != EVP_DecryptFinal_ex(ctx, p, &n)) {
+    throw runtime_error("EVP_DecryptFinal_ex() failed");
+  }
+  p += n;
+  lease.done();
+  timer.done();
+  return p - out;
+}
+
+// ================================================================
+// encrypt_batch
+// ================================================================
+void Cipher::encrypt_batch(const vector<string>& records,
+			   vector<string>& out,
+			   const string& pass,
+			   const string& salt,
+			   bool shared) const
+{
+  DBG_FCT("encrypt_batch");
+  if (aead()) {
+    throw runtime_error("encrypt_batch(): AEAD ciphers are not supported");
+  }
+  out.resize(records.size());
+  if (records.empty()) {
+    return;
+  }
+
+  // The key is derived once unless every record needs its own
+  // random salt.
+  const bool derive = !shared && salt.empty();
+  state_t st(*this);
+  set_salt(st, salt);
+  init(st, pass);
+
+  // The per record IVs of the shared key format are generated
+  // all at once.
+  const size_t ivlen = EVP_CIPHER_iv_length(m_evp_cipher);
+  const size_t bs    = EVP_CIPHER_block_size(m_evp_cipher);
+  vector<uchar> ivs;
+  if (shared && ivlen) {
+    ivs.resize(records.size() * ivlen);
+    random_bytes(&ivs[0], ivs.size());
+  }
+
+  // One context is re-keyed for each record, the output strings
+  // keep their capacity if the caller reuses them.
+  CtxPool::Lease lease(m_ctx_pool, m_evp_cipher, st.key, st.iv, 1);
+  EVP_CIPHER_CTX* ctx = lease.ctx();
+  uchar hdr[8 + EVP_MAX_IV_LENGTH];
+  size_t hdrlen = 0;
+  for(size_t i=0;i<records.size();++i) {
+    const uchar* key = 0; // 0 keeps the current key schedule
+    const uchar* iv  = st.iv;
+    if (shared) {
+      memcpy(&hdr[0], st.salt, 8);
+      if (ivlen) {
+	memcpy(&hdr[8], &ivs[i * ivlen], ivlen);
+      }
+      iv = &hdr[8];
+      hdrlen = 8 + ivlen;
+    }
+    else {
+      if (derive && i) {
+	set_salt(st, "");
+	init(st, pass);
+	key = st.key;
+      }
+      memcpy(&hdr[0], SALTED_PREFIX, 8);
+      memcpy(&hdr[8], st.salt, 8);
+      hdrlen = m_embed ? 16 : 0;
+    }
+    if (1 != EVP_CipherInit_ex(ctx, NULL, NULL, key, iv, 1)) {
+      throw runtime_error("EVP_CipherInit_ex() failed");
+    }
+
+    const string& rec = records[i];
+    size_t n = hdrlen + (bs > 1 ? (rec.size() / bs + 1) * bs : rec.size());
+    if (m_armor) {
+      n = Base64::encode_size(n);
+    }
+    string& str = out[i];
+    str.resize(n);
+    str.resize(seal(ctx, hdr, hdrlen,
+		    (const uchar*)rec.data(), rec.size(),
+		    (uchar*)&str[0]));
+  }
+  lease.done();
+}
+
+// ================================================================
+// decrypt_batch
+// ================================================================
+void Cipher::decrypt_batch(const vector<string>& records,
+			   vector<string>& out,
+			   const string& pass,
+			   const string& salt,
+			   bool shared) const
+{
+  DBG_FCT("decrypt_batch");
+  if (aead()) {
+    throw runtime_error("decrypt_batch(): AEAD ciphers are not supported");
+  }
+  out.resize(records.size());
+  if (records.empty()) {
+    return;
+  }
+  const size_t ivlen = EVP_CIPHER_iv_length(m_evp_cipher);
+  vector<uchar> buf;
+  aes_salt_t last;
+  bool keyed = false;
+  state_t st(*this);
+  CtxPool::Lease lease(m_ctx_pool, m_evp_cipher, st.key, st.iv, 0);
+  EVP_CIPHER_CTX* ctx = lease.ctx();
+  for(size_t i=0;i<records.size();++i) {
+    const string& rec = records[i];
+    const uchar* ct = (const uchar*)rec.data();
+    size_t len = rec.size();
+    if (m_armor) {
+      stage_timer_t timer(stats_ptr(), Stats::BASE64, len);
+      buf.resize(Base64::decode_size(len));
+      Base64::Decoder dec;
+      len  = dec.decode(ct, len, &buf[0]);
+      len += dec.finish(&buf[len]);
+      ct = &buf[0];
+      timer.done();
+    }
+
+    // Get the salt and the IV from the record framing.
+    const uchar* iv = st.iv;
+    if (shared) {
+      if (len < 8 + ivlen) {
+	throw runtime_error("decrypt_batch(): the record is too short");
+      }
+      memcpy(st.salt, ct, 8);
+      iv = ct + 8;
+      ct += 8 + ivlen;
+      len -= 8 + ivlen;
+    }
+    else if (len >= 16 && strncmp((const char*)ct, SALTED_PREFIX, 8) == 0) {
+      memcpy(st.salt, &ct[8], 8);
+      ct += 16;
+      len -= 16;
+    }
+    else {
+      set_salt(st, salt);
+    }
+
+    // Consecutive records with the same salt share the key.
+    const uchar* key = 0;
+    if (!keyed || memcmp(last, st.salt, 8) != 0) {
+      init(st, pass);
+      memcpy(last, st.salt, 8);
+      keyed = true;
+      key = st.key;
+    }
+    if (1 != EVP_CipherInit_ex(ctx, NULL, NULL, key, iv, 0)) {
+      throw runtime_error("EVP_CipherInit_ex() failed");
+    }
+
+    string& str = out[i];
+    str.resize(len + EVP_MAX_BLOCK_LENGTH);
+    int n1 = 0;
+    int n2 = 0;
+    stage_timer_t timer(stats_ptr(), Stats::CIPHER, len);
+    if (1 != EVP_DecryptUpdate(ctx, (uchar*)&str[0], &n1, ct, len)) {
+      throw runtime_error("EVP_DecryptUpdate() failed");
+    }
+    if (1 != EVP_DecryptFinal_ex(ctx, (uchar*)&str[n1], &n2)) {
+      throw runtime_error("EVP_DecryptFinal_ex() failed");
+    }
+    timer.done();
+    str.resize(n1 + n2);
+  }
+  lease.done();
+}
+
+// ================================================================
+// decrypt_file
+// ================================================================
+void Cipher::decrypt_file(const string& ifn,
+			  const string& ofn,
+			  const string& pass,
+			  const string& salt) const
+{
+  DBG_FCT("decrypt_file");
+  ifile_t ifs(ifn, m_io, m_chunk_size);
+  ofile_t ofs(ofn, m_io, m_chunk_size);
+  decrypt_stream(ifs.stream(), ofs.stream(), pass, salt);
+  ofs.commit();
+}
+
+// ================================================================
+// decrypt_file (stream output)
+// ================================================================
+void Cipher::decrypt_file(const string& ifn,
+			  ostream& os,
+			  const string& pass,
+			  const string& salt) const
+{
+  DBG_FCT("decrypt_file");
+  ifile_t ifs(ifn, m_io, m_chunk_size);
+  decrypt_stream(ifs.stream(), os, pass, salt);
+}
+
+// ================================================================
+// decrypt_stream
+// ================================================================
+void Cipher::decrypt_stream(istream& is,
+			    ostream& os,
+			    const string& pass,
+			    const string& salt) const
+{
+  DBG_FCT("decrypt_stream");
+
+  // The AEAD format is recognized by its magic. The start of a
+  // memory mapped file is checked in place, the first bytes of
+  // other streams are read and put back in front of the rest.
+  char magic[8];
+  const char* p = magic;
+  size_t n = 0;
+  mmap_buf_t* mb = dynamic_cast<mmap_buf_t*>(is.rdbuf());
+  if (mb) {
+    n = mb->peek(&p);
+  }
+  else {
+    n = stream_read(is, magic, sizeof(magic));
+  }
+  prefix_buf_t pb(is.rdbuf(), magic, mb ? 0 : n);
+  istream ps(&pb);
+  istream& is2 = mb ? is : ps;
+  if (aead() || aead_magic(p, n, m_armor)) {
+    decrypt_stream_aead(is2, os, pass);
+    return;
+  }
+  if (parallel(0)) {
+    decrypt_stream_parallel(is2, os, pass, salt);
+    return;
+  }
+  Decryptor dec(*this);
+  dec.begin(pass, salt);
+
+  // The base64 decoder ignores the new lines so it also accepts
+  // the single line (openssl -A) format.
+  pipeline_t pipe(is2, os, m_chunk_size, m_pipeline);
+  ostream_sink_t out(pipe.out(), stats_ptr());
+  ct_reader_t in(pipe.in(), m_chunk_size, m_armor, stats_ptr());
+  do {
+    size_t n = in.read();
+    dec.update(in.data(), n, out);
+  } while (!in.eof());
+  dec.finish(out);
+  pipe.finish();
+}
+
+// ================================================================
+// decrypt_range
+// ================================================================
+string Cipher::decrypt_range(const string& ifn,
+			     unsigned long long offset,
+			     unsigned long long length,
+			     const string& pass,
+			     const string& salt) const
+{
+  DBG_FCT("decrypt_range");
+  ostringstream os;
+  decrypt_range(ifn, os, offset, length, pass, salt);
+  return os.str();
+}
+
+// ================================================================
+// decrypt_range (file output)
+// ================================================================
+void Cipher::decrypt_range(const string& ifn,
+			   const string& ofn,
+			   unsigned long long offset,
+			   unsigned long long length,
+			   const string& pass,
+			   const string& salt) const
+{
+  DBG_FCT("decrypt_range");
+  ofile_t ofs(ofn, m_io, m_chunk_size);
+  decrypt_range(ifn, ofs.stream(), offset, length, pass, salt);
+  ofs.commit();
+}
+
+// ================================================================
+// decrypt_range (stream output)
+// ================================================================
+void Cipher::decrypt_range(const string& ifn,
+			   ostream& os,
+			   unsigned long long offset,
+			   unsigned long long length,
+			   const string& pass,
+			   const string& salt) const
+{
+  DBG_FCT("decrypt_range");
+  ct_file_t in(ifn, m_armor, stats_ptr());
+  const unsigned long long size = in.size();
+  uchar hdr[AEAD_HEADER_LEN];
+  const size_t hdrlen = size < sizeof(hdr) ? size : sizeof(hdr);
+  in.read(0, hdr, hdrlen);
+  ostream_sink_t out(os, stats_ptr());
+  state_t st(*this);
+
+  // The AEAD chunks that cover the range are read and verified.
+  // The end of the file is only checked if the range includes
+  // the last chunk.
+  if (aead() || aead_magic((const char*)hdr, hdrlen, false)) {
+    if (hdrlen < AEAD_HEADER_LEN) {
+      throw runtime_error("decrypt(): not in the AEAD format");
+    }
+    size_t chunk = 0;
+    const aead_alg_t* alg = aead_header(hdr, &chunk);
+    cipher_swap_t swap(st.name, st.evp, alg);
+    memcpy(st.salt, &hdr[12], 8);
+    init(st, pass);
+    const size_t rec = chunk + AEAD_TAG_LEN;
+    const unsigned long long body = size - AEAD_HEADER_LEN;
+    const unsigned long long nrec = (body + rec - 1) / rec;
+    if (nrec == 0 || body - (nrec - 1) * rec < AEAD_TAG_LEN) {
+      throw runtime_error("decrypt(): the AEAD data is truncated");
+    }
+    const unsigned long long ptlen = body - nrec * AEAD_TAG_LEN;
+    if (offset >= ptlen || length == 0) {
+      return;
+    }
+    if (length > ptlen - offset) {
+      length = ptlen - offset;
+    }
+    range_sink_t sink(out, offset % chunk, length);
+    segment_queue_t<aead_job_t> queue(m_threads, sink);
+    for(unsigned long long i=offset/chunk; i<=(offset+length-1)/chunk; ++i) {
+      aead_job_t* job = queue.next();
+      job->setup(st.evp, st.key, hdr, 0, stats_ptr());
+      job->m_index = i;
+      job->m_last  = i == nrec - 1;
+      job->m_len   = job->m_last ? body - i * rec : rec;
+      job->m_in.resize(job->m_len);
+      in.read(AEAD_HEADER_LEN + i * rec, &job->m_in[0], job->m_len);
+      queue.submit(job);
+    }
+    queue.finish();
+    return;
+  }
+
+  // Only the blocks that cover the range are decrypted. CTR
+  // computes the counter from the offset, CBC uses the previous
+  // ciphertext block as the IV. The CBC padding is checked if the
+  // range includes the last block.
+  size_t base = 0;
+  if (hdrlen >= 16 && strncmp((const char*)hdr, SALTED_PREFIX, 8) == 0) {
+    memcpy(st.salt, &hdr[8], 8);
+    base = 16;
+  }
+  else {
+    set_salt(st, salt);
+  }
+  init(st, pass);
+  const int mode = EVP_CIPHER_mode(m_evp_cipher);
+  const bool cbc = mode == EVP_CIPH_CBC_MODE;
+  if (!cbc && mode != EVP_CIPH_CTR_MODE) {
+    throw runtime_error("decrypt_range(): random access needs a CBC, CTR or AEAD cipher");
+  }
+  const unsigned long long ctlen = size - base;
+  const size_t bs = cbc ? EVP_CIPHER_block_size(m_evp_cipher) : 16;
+  const int ivlen = EVP_CIPHER_iv_length(m_evp_cipher);
+  if (cbc && ctlen % bs) {
+    throw runtime_error("decrypt_range(): the ciphertext is not a whole number of blocks");
+  }
+  if (offset >= ctlen || length == 0) {
+    return;
+  }
+  if (length > ctlen - offset) {
+    length = ctlen - offset;
+  }
+  unsigned long long beg = offset / bs * bs;
+  unsigned long long end = (offset + length + bs - 1) / bs * bs;
+  if (end > ctlen) {
+    end = ctlen;
+  }
+  uchar iv[EVP_MAX_IV_LENGTH];
+  memcpy(iv, st.iv, ivlen);
+  if (cbc && beg) {
+    in.read(base + beg - bs, iv, bs);
+  }
+  else if (!cbc) {
+    ctr_add(iv, ivlen, beg / bs);
+  }
+
+  CtxPool::Lease lease(m_ctx_pool, m_evp_cipher, st.key, iv, 0);
+  EVP_CIPHER_CTX_set_padding(lease.ctx(), 0);
+  range_sink_t sink(out, offset - beg, length);
+  const size_t seg = segment_size();
+  vector<uchar> ct(seg);
+  vector<uchar> pt(seg + EVP_MAX_BLOCK_LENGTH);
+  for(unsigned long long pos=beg; pos<end; ) {
+    size_t n = end - pos < seg ? end - pos : seg;
+    in.read(base + pos, &ct[0], n);
+    pos += n;
+    int k = 0;
+    stage_timer_t timer(stats_ptr(), Stats::CIPHER, n);
+    if (1 != EVP_DecryptUpdate(lease.ctx(), &pt[0], &k, &ct[0], n)) {
+      throw runtime_error("EVP_DecryptUpdate() failed");
+    }
+    if (cbc && pos == ctlen) {
+      size_t pad = k ? pt[k-1] : 0;
+      bool ok = pad >= 1 && pad <= bs;
+      for(size_t i=0;ok && i<pad;++i) {
+        ok = pt[k-1-i] == pad;
+      }
+      if (!ok) {
+        throw runtime_error("EVP_DecryptFinal_ex() failed");
+      }
+      k -= pad;
+    }
+    timer.done();
+    sink.write(&pt[0], k);
+  }
+  EVP_CIPHER_CTX_set_padding(lease.ctx(), 1);
+  lease.done();
+}
+
+// ================================================================
+// parallel
+// ================================================================
+bool Cipher::parallel(int enc) const
+{
+  // Counter mode segments are independent for both directions.
+  // CBC decryption is also parallel because each plaintext block
+  // only depends on two ciphertext blocks, CBC encryption is
+  // inherently serial.
+  if (m_threads < 2) {
+    return false;
+  }
+  int mode = EVP_CIPHER_mode(m_evp_cipher);
+  return mode == EVP_CIPH_CTR_MODE || (!enc && mode == EVP_CIPH_CBC_MODE);
+}
+
+// ================================================================
+// threads
+// ================================================================
+void Cipher::threads(uint n)
+{
+  m_threads = n ? n : ThreadPool::cpus();
+#ifdef CIPHER_HAVE_ARGON2
+  if (m_kdf == ARGON2ID) {
+    raise_kdf_threads(m_threads);
+  }
+#endif
+}
+
+// ================================================================
+// segment_size
+// ================================================================
+size_t Cipher::segment_size() const
+{
+  // Segments are a multiple of 48 bytes so that each one is a
+  // whole number of MIME lines and cipher blocks.
+  size_t n = (m_chunk_size / 48) * 48;
+  return n < 48 ? 48 : n;
+}
+
+// ================================================================
+// encrypt_stream_parallel
+// ================================================================
+void Cipher::encrypt_stream_parallel(istream& is,
+				     ostream& os,
+				     const string& pass,
+				     const string& salt) const
+{
+  DBG_FCT("encrypt_stream_parallel");
+  state_t st(*this);
+  set_salt(st, salt);
+  init(st, pass);
+
+  // The first segment carries the salt prefix so it has 16 fewer
+  // plaintext bytes. That keeps the later segments aligned on
+  // MIME line boundaries.
+  const size_t seg = segment_size();
+  const size_t hdr = m_embed ? 16 : 0;
+  const int ivlen = EVP_CIPHER_iv_length(m_evp_cipher);
+  uchar ctr[EVP_MAX_IV_LENGTH];
+  memcpy(ctr, st.iv, ivlen);
+
+  // The segments of a memory mapped file refer to the mapping,
+  // other input is read into the segments.
+  const bool mapped = stream_mapped(is);
+  vector<char> unused;
+  ostream_sink_t out(os, stats_ptr());
+  segment_queue_t<segment_job_t> queue(m_threads, out);
+  for(bool first=true;;first=false) {
+    segment_job_t* job = queue.next();
+    job->setup(m_evp_cipher, st.key, ctr, 1, true, m_armor, stats_ptr());
+    job->m_in.resize(mapped ? hdr : seg);
+    if (first && hdr) {
+      memcpy(&job->m_in[0], SALTED_PREFIX, 8);
+      memcpy(&job->m_in[8], st.salt, 8);
+      job->m_prefix = hdr;
+    }
+    size_t want = seg - job->m_prefix;
+    size_t n = 0;
+    if (mapped) {
+      n = stream_next(is, &job->m_data, unused, want, stats_ptr());
+    }
+    else {
+      stage_timer_t timer(stats_ptr(), Stats::IO);
+      n = stream_read(is, (char*)&job->m_in[job->m_prefix], want);
+      timer.bytes(n);
+      timer.done();
+    }
+    job->m_len = job->m_prefix + n;
+    if (job->m_len == 0) {
+      queue.recycle(job);
+      break;
+    }
+    queue.submit(job);
+    ctr_add(ctr, ivlen, n / 16);
+    if (n < want) {
+      break;
+    }
+  }
+  queue.finish();
+}
+
+// ================================================================
+// decrypt_stream_parallel
+// ================================================================
+void Cipher::decrypt_stream_parallel(istream& is,
+				     ostream& os,
+				     const string& pass,
+				     const string& salt) const
+{
+  DBG_FCT("decrypt_stream_parallel");
+
+  // The MIME decoding is done on this thread, the decoded
+  // ciphertext is cut into segments that are decrypted in
+  // parallel. A segment is only submitted once it is known that
+  // more data follows so that the last one, the only one with
+  // padding, can be identified.
+  //
+  // Each CTR segment starts at its counter offset. Each CBC
+  // segment uses the last ciphertext block of the previous
+  // segment as its IV.
+  const size_t seg = segment_size();
+  const bool cbc = EVP_CIPHER_mode(m_evp_cipher) == EVP_CIPH_CBC_MODE;
+  const int ivlen = EVP_CIPHER_iv_length(m_evp_cipher);
+  uchar iv[EVP_MAX_IV_LENGTH];
+  vector<uchar> ct_buf;
+  size_t ctlen = 0;
+  bool ready = false;
+  state_t st(*this);
+
+  // A memory mapped binary file is already one contiguous
+  // buffer so the segments refer to it directly.
+  const bool whole = !m_armor && stream_mapped(is);
+  vector<char> unused;
+  ostream_sink_t out(os, stats_ptr());
+  segment_queue_t<segment_job_t> queue(m_threads, out);
+  ct_reader_t in(is, m_chunk_size, m_armor, stats_ptr());
+  for(bool eof=false; !eof; ) {
+    const uchar* ct = 0;
+    if (whole) {
+      ctlen = stream_next(is, &ct, unused, (size_t)-1, stats_ptr());
+      eof = true;
+    }
+    else {
+      size_t len = in.read();
+      eof = in.eof();
+      ct_buf.resize(ctlen + len);
+      if (len) {
+	memcpy(&ct_buf[ctlen], in.data(), len);
+      }
+      ctlen += len;
+      ct = ct_buf.empty() ? 0 : &ct_buf[0];
+    }
+
+    size_t off = 0;
+    if (!ready) {
+      if (ctlen < 16 && !eof) {
+	continue;
+      }
+      if (ctlen >= 16 && strncmp((const char*)ct, SALTED_PREFIX, 8) == 0) {
+	memcpy(st.salt, &ct[8], 8);
+	off = 16;
+      }
+      else {
+	set_salt(st, salt);
+      }
+      init(st, pass);
+      memcpy(iv, st.iv, ivlen);
+      ready = true;
+    }
+
+    while (ctlen - off > seg || (eof && ctlen > off)) {
+      size_t len = ctlen - off > seg ? seg : ctlen - off;
+      bool last = eof && off + len == ctlen;
+      segment_job_t* job = queue.next();
+      job->setup(m_evp_cipher, st.key, iv, 0, last, false, stats_ptr());
+      if (whole) {
+	job->m_data = ct + off;
+      }
+      else {
+	job->m_in.assign(ct + off, ct + off + len);
+      }
+      job->m_len = len;
+      queue.submit(job);
+      if (cbc) {
+	memcpy(iv, &ct[off + len - ivlen], ivlen);
+      }
+      else {
+	ctr_add(iv, ivlen, len / 16);
+      }
+      off += len;
+    }
+    if (off && !whole) {
+      memmove(&ct_buf[0], &ct_buf[off], ctlen - off);
+      ctlen -= off;
+    }
+  }
+  queue.finish();
+}
+
+// ================================================================
+// aead
+// ================================================================
+bool Cipher::aead() const
+{
+  return (EVP_CIPHER_flags(m_evp_cipher) & EVP_CIPH_FLAG_AEAD_CIPHER) != 0;
+}
+
+// ================================================================
+// encrypt_stream_aead
+// ================================================================
+void Cipher::encrypt_stream_aead(istream& is,
+				 ostream& os,
+				 const string& pass,
+				 const string& salt) const
+{
+  DBG_FCT("encrypt_stream_aead");
+  state_t st(*this);
+  set_salt(st, salt);
+  init(st, pass);
+
+  // The header is authenticated with every chunk.
+  const aead_alg_t* alg = aead_alg(EVP_CIPHER_nid(m_evp_cipher));
+  const size_t chunk = m_chunk_size < AEAD_MAX_CHUNK ? m_chunk_size : AEAD_MAX_CHUNK;
+  uchar hdr[AEAD_HEADER_LEN];
+  memcpy(&hdr[0], AEAD_MAGIC, 6);
+  hdr[6] = AEAD_VERSION;
+  hdr[7] = alg->id;
+  for(int i=0;i<4;++i) {
+    hdr[8 + i] = (uchar)(chunk >> (8 * (3 - i)));
+  }
+  memcpy(&hdr[12], st.salt, 8);
+  random_bytes(&hdr[20], AEAD_NONCE_LEN);
+  DBG_BDUMP(hdr, sizeof(hdr));
+
+  ostream_sink_t out(os, stats_ptr());
+  b64_encode_sink_t b64(out, stats_ptr());
+  Sink& sink = m_armor ? (Sink&)b64 : (Sink&)out;
+  sink.write(hdr, sizeof(hdr));
+
+  // A chunk is held back until the next read shows whether it is
+  // the last one. Empty input is a single empty last chunk. The
+  // chunks of a memory mapped file refer to the mapping, other
+  // input is read into the chunks.
+  const bool mapped = stream_mapped(is);
+  vector<char> unused;
+  segment_queue_t<aead_job_t> queue(m_threads, sink);
+  aead_job_t* prev = 0;
+  for(unsigned long long i=0;;++i) {
+    aead_job_t* job = queue.next();
+    job->setup(m_evp_cipher, st.key, hdr, 1, stats_ptr());
+    job->m_index = i;
+    size_t n = 0;
+    if (mapped) {
+      n = stream_next(is, &job->m_data, unused, chunk, stats_ptr());
+    }
+    else {
+      job->m_in.resize(chunk);
+      stage_timer_t timer(stats_ptr(), Stats::IO);
+      n = stream_read(is, (char*)&job->m_in[0], chunk);
+      timer.bytes(n);
+      timer.done();
+    }
+    job->m_len = n;
+    if (prev) {
+      if (n == 0) {
+        queue.recycle(job);
+        prev->m_last = true;
+        queue.submit(prev);
+        break;
+      }
+      queue.submit(prev);
+    }
+    if (n < chunk) {
+      job->m_last = true;
+      queue.submit(job);
+      break;
+    }
+    prev = job;
+  }
+  queue.finish();
+  if (m_armor) {
+    b64.finish();
+  }
+}
+
+// ================================================================
+// decrypt_stream_aead
+// ================================================================
+void Cipher::decrypt_stream_aead(istream& is,
+				 ostream& os,
+				 const string& pass) const
+{
+  DBG_FCT("decrypt_stream_aead");
+  ct_reader_t reader(is, m_chunk_size, m_armor, stats_ptr());
+  ct_bytes_t in(reader);
+  uchar hdr[AEAD_HEADER_LEN];
+  if (in.read(hdr, sizeof(hdr)) != sizeof(hdr)) {
+    throw runtime_error("decrypt(): not in the AEAD format");
+  }
+  DBG_BDUMP(hdr, sizeof(hdr));
+  size_t chunk = 0;
+  const aead_alg_t* alg = aead_header(hdr, &chunk);
+
+  // The header decides the cipher, not the configuration.
+  state_t st(*this);
+  cipher_swap_t swap(st.name, st.evp, alg);
+  memcpy(st.salt, &hdr[12], 8);
+  init(st, pass);
+
+  // A chunk is held back until the next read shows whether it is
+  // the last one. That is checked by the tag so a file that was
+  // truncated on a chunk boundary is detected.
+  const size_t rec = chunk + AEAD_TAG_LEN;
+  ostream_sink_t out(os, stats_ptr());
+  segment_queue_t<aead_job_t> queue(m_threads, out);
+  aead_job_t* prev = 0;
+  for(unsigned long long i=0;;++i) {
+    aead_job_t* job = queue.next();
+    job->setup(st.evp, st.key, hdr, 0, stats_ptr());
+    job->m_index = i;
+    job->m_in.resize(rec);
+    size_t n = in.read(&job->m_in[0], rec);
+    job->m_len = n;
+    if (prev) {
+      if (n == 0) {
+        queue.recycle(job);
+        prev->m_last = true;
+        queue.submit(prev);
+        break;
+      }
+      queue.submit(prev);
+    }
+    if (n < rec) {
+      if (n < AEAD_TAG_LEN) {
+        throw runtime_error("decrypt(): the AEAD data is truncated");
+      }
+      job->m_last = true;
+      queue.submit(job);
+      break;
+    }
+    prev = job;
+  }
+  queue.finish();
+}
+
+// ================================================================
+// Encryptor::Encryptor
+// ================================================================
+Cipher::Encryptor::Encryptor(const Cipher& cipher)
+  : m_cipher(cipher),
+    m_ctx(EVP_CIPHER_CTX_new()),
+    m_header(false),
+    m_active(false)
+{
+  if (!m_ctx) {
+    throw runtime_error("EVP_CIPHER_CTX_new() failed");
+  }
+}
+
+// ================================================================
+// Encryptor::~Encryptor
+// ================================================================
+Cipher::Encryptor::~Encryptor()
+{
+  EVP_CIPHER_CTX_free(m_ctx);
+}
+
+// ================================================================
+// Encryptor::begin
+// ================================================================
+void Cipher::Encryptor::begin(const string& pass,
+			      const string& salt)
+{
+  if (m_cipher.aead()) {
+    throw runtime_error("Encryptor::begin(): AEAD ciphers are not supported");
+  }
+  state_t st(m_cipher);
+  m_cipher.set_salt(st, salt);
+  m_cipher.init(st, pass);
+  if (!cipher_init(m_ctx, m_cipher.m_evp_cipher, st.key, st.iv, 1)) {
+    throw runtime_error("EVP_EncryptInit_ex() init key/iv failed");
+  }
+  memcpy(m_salt, st.salt, sizeof(m_salt));
+  m_header = m_cipher.m_embed;
+  m_active = true;
+}
+
+// ================================================================
+// Encryptor::update
+// ================================================================
+void Cipher::Encryptor::update(const uchar* buf, size_t len, Sink& sink)
+{
+  if (!m_active) {
+    throw runtime_error("Encryptor::update(): begin() was not called");
+  }
+  write_header(sink);
+
+  // Large inputs are encrypted in chunk sized slices so that
+  // the output buffer stays bounded.
+  const size_t chunk = m_cipher.m_chunk_size;
+  m_buf.resize(chunk + EVP_MAX_BLOCK_LENGTH);
+  while (len) {
+    size_t n = len < chunk ? len : chunk;
+    int ctlen = 0;
+    stage_timer_t timer(m_cipher.stats_ptr(), Stats::CIPHER, n);
+    if (1 != EVP_EncryptUpdate(m_ctx, &m_buf[0], &ctlen, buf, n)) {
+      m_active = false;
+      throw runtime_error("EVP_EncryptUpdate() failed");
+    }
+    timer.done();
+    sink.write(&m_buf[0], ctlen);
+    buf += n;
+    len -= n;
+  }
+}
+
+// ================================================================
+// Encryptor::finish
+// ================================================================
+void Cipher::Encryptor::finish(Sink& sink)
+{
+  if (!m_active) {
+    throw runtime_error("Encryptor::finish(): begin() was not called");
+  }
+  write_header(sink);
+  m_active = false;
+  uchar pad[EVP_MAX_BLOCK_LENGTH];
+  int padlen = 0;
+  stage_timer_t timer(m_cipher.stats_ptr(), Stats::CIPHER);
+  if (1 != EVP_EncryptFinal_ex(m_ctx, pad, &padlen)) {
+    throw runtime_error("EVP_EncryptFinal_ex() failed");
+  }
+  timer.done();
+  sink.write(pad, padlen);
+}
+
+// ================================================================
+// Encryptor::write_header
+// ================================================================
+void Cipher::Encryptor::write_header(Sink& sink)
+{
+  // In order to be compatible with openssl, the output starts
+  // with the "Salted__" prefix followed by the 8 byte salt.
+  if (m_header) {
+    uchar hdr[16];
+    memcpy(&hdr[0], SALTED_PREFIX, 8);
+    memcpy(&hdr[8], m_salt, 8);
+    sink.write(hdr, sizeof(hdr));
+    m_header = false;
+  }
+}
+
+// ================================================================
+// Decryptor::Decryptor
+// ================================================================
+Cipher::Decryptor::Decryptor(const Cipher& cipher)
+  : m_cipher(cipher),
+    m_ctx(EVP_CIPHER_CTX_new()),
+    m_hdrlen(0),
+    m_ready(false),
+    m_active(false)
+{
+  if (!m_ctx) {
+    throw runtime_error("EVP_CIPHER_CTX_new() failed");
+  }
+}
+
+// ================================================================
+// Decryptor::~Decryptor
+// ================================================================
+Cipher::Decryptor::~Decryptor()
+{
+  OPENSSL_cleanse(&m_pass[0], m_pass.size());
+  EVP_CIPHER_CTX_free(m_ctx);
+}
+
+// ================================================================
+// Decryptor::begin
+// ================================================================
+void Cipher::Decryptor::begin(const string& pass,
+			      const string& salt)
+{
+  if (m_cipher.aead()) {
+    throw runtime_error("Decryptor::begin(): AEAD ciphers are not supported");
+  }
+  // The key cannot be derived until the first 16 bytes have
+  // been seen because they may contain the salt.
+  OPENSSL_cleanse(&m_pass[0], m_pass.size());
+  m_pass   = pass;
+  m_salt   = salt;
+  m_hdrlen = 0;
+  m_ready  = false;
+  m_active = true;
+}
+
+// ================================================================
+// Decryptor::update
+// ================================================================
+void Cipher::Decryptor::update(const uchar* buf, size_t len, Sink& sink)
+{
+  if (!m_active) {
+    throw runtime_error("Decryptor::update(): begin() was not called");
+  }
+  if (!m_ready) {
+    while (len && m_hdrlen < sizeof(m_hdr)) {
+      m_hdr[m_hdrlen++] = *buf++;
+      --len;
+    }
+    if (m_hdrlen < sizeof(m_hdr)) {
+      return; // wait for more data
+    }
+    start(sink);
+  }
+  decrypt(buf, len, sink);
+}
+
+// ================================================================
+// Decryptor::finish
+// ================================================================
+void Cipher::Decryptor::finish(Sink& sink)
+{
+  if (!m_active) {
+    throw runtime_error("Decryptor::finish(): begin() was not called");
+  }
+  if (!m_ready) {
+    start(sink);
+  }
+  m_active = false;
+  uchar pad[EVP_MAX_BLOCK_LENGTH];
+  int padlen = 0;
+  stage_timer_t timer(m_cipher.stats_ptr(), Stats::CIPHER);
+  if (1 != EVP_DecryptFinal_ex(m_ctx, pad, &padlen)) {
+    throw runtime_error("EVP_DecryptFinal_ex() failed");
+  }
+  timer.done();
+  sink.write(pad, padlen);
 }
 
 // ================================================================
-// encrypt_file
+// Decryptor::start
 // ================================================================
-void Cipher::encrypt_file(const string& ifn,
-			  const string& ofn,
-			  const string& pass,
-			  const string& salt)
+void Cipher::Decryptor::start(Sink& sink)
 {
-  DBG_FCT("encrypt_file");
-  string plaintext = file_read(ifn);
-  string ciphertext = encrypt(plaintext, pass, salt);
-  file_write(ofn, ciphertext, true);
+  bool salted = m_hdrlen == sizeof(m_hdr) &&
+    strncmp((const char*)m_hdr, SALTED_PREFIX, 8) == 0;
+  state_t st(m_cipher);
+  if (salted) {
+    memcpy(st.salt, &m_hdr[8], 8);
+  }
+  else {
+    m_cipher.set_salt(st, m_salt);
+  }
+  m_cipher.init(st, m_pass);
+  OPENSSL_cleanse(&m_pass[0], m_pass.size());
+  m_pass.clear();
+
+  if (!cipher_init(m_ctx, m_cipher.m_evp_cipher, st.key, st.iv, 0)) {
+    m_active = false;
+    throw runtime_error("EVP_DecryptInit_ex() failed");
+  }
+  m_ready = true;
+
+  // Without the prefix the header bytes are ciphertext.
+  if (!salted) {
+    decrypt(m_hdr, m_hdrlen, sink);
+  }
 }
 
 // ================================================================
-// decrypt
+// Decryptor::decrypt
 // ================================================================
-string Cipher::decrypt(const string& mimetext,
-		       const string& pass,
-		       const string& salt)
+void Cipher::Decryptor::decrypt(const uchar* buf, size_t len, Sink& sink)
 {
-  DBG_FCT("decrypt");
-  kv1_t  x     = decode_base64(mimetext);
-  uchar* ct    = x.first;
-  uchar* ctbeg = ct;
-  uint   ctlen = x.second;
-  DBG_BDUMP(ct, ctlen);
-
-  if (strncmp((const char*)ct, SALTED_PREFIX, 8) == 0) {
-    memcpy(m_salt, &ct[8], 8);
-    ct += 16;
-    ctlen -= 16;
-  }
-  else {
-    set_salt(salt);
+  const size_t chunk = m_cipher.m_chunk_size;
+  m_buf.resize(chunk + EVP_MAX_BLOCK_LENGTH);
+  while (len) {
+    size_t n = len < chunk ? len : chunk;
+    int ptlen = 0;
+    stage_timer_t timer(m_cipher.stats_ptr(), Stats::CIPHER, n);
+    if (1 != EVP_DecryptUpdate(m_ctx, &m_buf[0], &ptlen, buf, n)) {
+      m_active = false;
+      throw runtime_error("EVP_DecryptUpdate() failed");
+    }
+    timer.done();
+    sink.write(&m_buf[0], ptlen);
+    buf += n;
+    len -= n;
   }
-  init(pass);
-  string ret = decode_cipher(ct, ctlen);
-  delete [] ctbeg;
-  DBG_MDUMP(ret);
-  return ret;
 }
 
 // ================================================================
-// decrypt_file
+// StringSink::write
 // ================================================================
-void Cipher::decrypt_file(const string& ifn,
-			  const string& ofn,
-			  const string& pass,
-			  const string& salt)
+void Cipher::StringSink::write(const uchar* buf, size_t len)
 {
-  DBG_FCT("decrypt_file");
-  string ciphertext = file_read(ifn);
-  string plaintext = decrypt(ciphertext, pass, salt);
-  file_write(ofn, plaintext);
+  m_str.append((const char*)buf, len);
 }
 
 // ================================================================
@@ -262,25 +3778,13 @@ string Cipher::encode_base64(uchar* ciphertext,
 			     uint   ciphertext_len) const
 {
   DBG_FCT("encode_base64");
-  BIO* b64 = BIO_new(BIO_f_base64());
-  BIO* bm  = BIO_new(BIO_s_mem());
-  b64 = BIO_push(b64, bm);
-  if (BIO_write(b64, ciphertext, ciphertext_len)<2) {
-    throw runtime_error("BIO_write() failed");
-  }
-  if (BIO_flush(b64)<1) {
-    throw runtime_error("BIO_flush() failed");
-  }
-  BUF_MEM *bptr=0;
-  BIO_get_mem_ptr(b64, &bptr);
-  uint len=bptr->length;
-  char* mimetext = new char[len+1];
-  memcpy(mimetext, bptr->data, bptr->length-1);
-  mimetext[bptr->length-1]=0;
-  BIO_free_all(b64);
-
-  string ret = mimetext;
-  delete [] mimetext;
+  stage_timer_t timer(stats_ptr(), Stats::BASE64, ciphertext_len);
+  string ret(Base64::encode_size(ciphertext_len), 0);
+  size_t n = ciphertext_len ? Base64::encode(ciphertext, ciphertext_len, (uchar*)&ret[0]) : 0;
+  timer.done();
+
+  // Drop the trailing new line.
+  ret.resize(n ? n - 1 : 0);
   return ret;
 }
 
@@ -290,38 +3794,33 @@ string Cipher::encode_base64(uchar* ciphertext,
 Cipher::kv1_t Cipher::decode_base64(const string& mimetext) const
 {
   DBG_FCT("decode_base64");
+  stage_timer_t timer(stats_ptr(), Stats::BASE64, mimetext.size());
   kv1_t x;
-  int SZ=mimetext.size(); // this will always be smaller
-  x.first = new uchar[SZ];
-  char* tmpbuf = new char[SZ+1];
-  strcpy(tmpbuf, mimetext.c_str());
-  BIO* b64 = BIO_new(BIO_f_base64());
-
-  // This patch was suggested by Mihai Todor.
-  // It was added to the code on 2013-11-21.
-  // Please see this post for details:
-  //    http://joelinoff.com/blog/?p=664
-  if (SZ <= 64) {
-    // If the string is less len 64 or less,
-    // then the -A switch must be used in
-    // openssl.
-    BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
-  }
-
-  BIO* bm  = BIO_new_mem_buf(tmpbuf, mimetext.size());
-  bm = BIO_push(b64, bm);
-  x.second = BIO_read(bm, x.first, SZ);
-  BIO_free_all(bm);
-  delete [] tmpbuf;
+  x.first = new uchar[Base64::decode_size(mimetext.size())];
+
+  // White space is skipped so the single line format that
+  // openssl -A expects (and produces for 64 characters or less)
+  // is accepted as well as the 64 column format.
+  try {
+    Base64::Decoder dec;
+    x.second  = dec.decode((const uchar*)mimetext.data(), mimetext.size(), x.first);
+    x.second += dec.finish(x.first + x.second);
+  }
+  catch (...) {
+    delete [] x.first;
+    throw;
+  }
+  timer.done();
   return x;
 }
 
 // ================================================================
 // encode_cipher
 // ================================================================
-Cipher::kv1_t Cipher::encode_cipher(const string& plaintext) const
+Cipher::kv1_t Cipher::encode_cipher(const Key& k, const string& plaintext) const
 {
   DBG_FCT("encode_cipher");
+  stage_timer_t timer(stats_ptr(), Stats::CIPHER, plaintext.size());
   uint SZ = plaintext.size() + AES_BLOCK_SIZE + 20;  // leave some padding
   uchar* ciphertext = new uchar[SZ];
   bzero(ciphertext, SZ);
@@ -335,20 +3834,16 @@ Cipher::kv1_t Cipher::encode_cipher(const string& plaintext) const
   uint off = 0;
   if (m_embed) {
     memcpy(&ciphertext[0], SALTED_PREFIX, 8);
-    memcpy(&ciphertext[8], m_salt, 8);
+    memcpy(&ciphertext[8], k.m_salt, 8);
     off = 16;
     ciphertext += off;
   }
 
+  // The context comes from the pool and is returned to it
+  // when the lease goes out of scope.
   int ciphertext_len=0;
-  EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-  const EVP_CIPHER* cipher = EVP_aes_256_cbc();
-  EVP_CIPHER_CTX_init(ctx);
-  if (1 != EVP_EncryptInit_ex(ctx, cipher, NULL, m_key, m_iv)) {
-    EVP_CIPHER_CTX_free(ctx);
-    throw runtime_error("EVP_EncryptInit_ex() init key/iv failed");
-  }
-  EVP_CIPHER_CTX_set_key_length(ctx, EVP_MAX_KEY_LENGTH);
+  CtxPool::Lease lease(m_ctx_pool, m_evp_cipher, k.m_key, k.m_iv, 1);
+  EVP_CIPHER_CTX* ctx = lease.ctx();
 
   // Encrypt the plaintext data all at once.
   // It would be straightforward to chunk it but that
@@ -356,77 +3851,92 @@ Cipher::kv1_t Cipher::encode_cipher(const string& plaintext) const
   uchar* pt_buf = (uchar*)plaintext.c_str();
   uint   pt_len = plaintext.size();
   if (1 != EVP_EncryptUpdate(ctx, ciphertext, &ciphertext_len, pt_buf, pt_len)) {
-    EVP_CIPHER_CTX_free(ctx);
     throw runtime_error("EVP_EncryptUpdate() failed");
   }
 
   uchar* pad_buf = ciphertext + ciphertext_len; // pad at the end
   int pad_len=0;
   if (1 != EVP_EncryptFinal_ex(ctx, pad_buf, &pad_len)) {
-    EVP_CIPHER_CTX_free(ctx);
     throw runtime_error("EVP_EncryptFinal_ex() failed");
   }
 
   ciphertext_len += pad_len + off; // <off> for the Salted prefix
-  EVP_CIPHER_CTX_free(ctx);
+  lease.done();
+  timer.done();
   return kv1_t(pbeg, ciphertext_len);
 }
 
 // ================================================================
 // decode_cipher
 // ================================================================
-string Cipher::decode_cipher(uchar* ciphertext,
+string Cipher::decode_cipher(const Key& k,
+			     uchar* ciphertext,
 			     uint   ciphertext_len) const
 {
   DBG_FCT("decode_cipher");
+  stage_timer_t timer(stats_ptr(), Stats::CIPHER, ciphertext_len);
   const uint SZ = ciphertext_len+20;
   uchar* plaintext = new uchar[SZ];
   int plaintext_len = 0;
-  const EVP_CIPHER* cipher = EVP_aes_256_cbc();
-  EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-
-  bzero(plaintext, SZ);
-  EVP_CIPHER_CTX_init(ctx);
-
-  if (1 != EVP_DecryptInit_ex(ctx, cipher, NULL, m_key, m_iv)) {
-    EVP_CIPHER_CTX_free(ctx);
-    throw runtime_error("EVP_DecryptInit_ex() failed");
-  }
-  EVP_CIPHER_CTX_set_key_length(ctx, EVP_MAX_KEY_LENGTH);
 
+  CtxPool::Lease lease(m_ctx_pool, m_evp_cipher, k.m_key, k.m_iv, 0);
+  EVP_CIPHER_CTX* ctx = lease.ctx();
   if (1 != EVP_DecryptUpdate(ctx, plaintext, &plaintext_len, ciphertext, ciphertext_len)) {
-    EVP_CIPHER_CTX_free(ctx);
+    delete [] plaintext;
     throw runtime_error("EVP_DecryptUpdate() failed");
   }
 
   int plaintext_padlen=0;
   if (1 != EVP_DecryptFinal_ex(ctx, plaintext+plaintext_len, &plaintext_padlen)) {
-    EVP_CIPHER_CTX_free(ctx);
+    delete [] plaintext;
     throw runtime_error("EVP_DecryptFinal_ex() failed");
   }
+  lease.done();
   plaintext_len += plaintext_padlen;
-  plaintext[plaintext_len] = 0;
 
-  string ret = (char*)plaintext;
+  // Use the length, the plaintext may contain NUL bytes.
+  string ret((char*)plaintext, plaintext_len);
   delete [] plaintext;
-  EVP_CIPHER_CTX_free(ctx);
+  timer.done();
   return ret;
 }
 
+// ================================================================
+// state_t::state_t
+// ================================================================
+Cipher::state_t::state_t(const Cipher& c)
+  : name(c.m_cipher),
+    evp(c.m_evp_cipher)
+{
+  bzero(salt, sizeof(salt));
+  bzero(key, sizeof(key));
+  bzero(iv, sizeof(iv));
+}
+
+// ================================================================
+// state_t::~state_t
+// ================================================================
+Cipher::state_t::~state_t()
+{
+  if (!pass.empty()) {
+    OPENSSL_cleanse(&pass[0], pass.size());
+  }
+  OPENSSL_cleanse(key, sizeof(key));
+  OPENSSL_cleanse(iv, sizeof(iv));
+}
+
 // ================================================================
 // set_salt
 // ================================================================
-void Cipher::set_salt(const string& salt)
+void Cipher::set_salt(state_t& st, const string& salt) const
 {
   DBG_FCT("set_salt");
   if (salt.length() == 0) {
     // Choose a random salt.
-    for(uint i=0;i<sizeof(m_salt);++i) {
-      m_salt[i] = rand() % 256;
-    }
+    random_bytes(st.salt, sizeof(st.salt));
   }
   else if (salt.length() == 8) {
-    memcpy(m_salt, salt.c_str(), 8);
+    memcpy(st.salt, salt.c_str(), 8);
   }
   else if (salt.length()<8) {
     throw underflow_error("init(): salt is too short, must be 8 characters");
@@ -439,55 +3949,549 @@ void Cipher::set_salt(const string& salt)
 // ================================================================
 // init()
 // ================================================================
-void Cipher::init(const string& pass)
+void Cipher::init(state_t& st, const string& pass) const
 {
   DBG_FCT("init");
+  stage_timer_t timer(stats_ptr(), Stats::KDF);
 
   // Use a default passphrase if the user didn't specify one.
-  m_pass = pass;
-  if (m_pass.empty() ) {
+  st.pass = pass;
+  if (st.pass.empty() ) {
     // Default: ' deFau1t pASsw0rD'
     // Obfuscate so that a simple strings will not find it.
     char a[] = {' ', 'd', 'e', 'F', 'a', 'u', '1', 't', ' ',
 		'p', 'A', 'S', 's', 'w', '0', 'r', 'D', 0};
-    m_pass = a;
+    st.pass = a;
   }
 
   // Create the key and IV values from the passkey.
+  bzero(st.key, sizeof(st.key));
+  bzero(st.iv, sizeof(st.iv));
+
+  // Skip the derivation if it has already been done for
+  // this (pass, salt, cipher, digest, count, KDF) tuple.
+  string id;
+  if (m_key_cache) {
+    id = KeyCache::make_id(st.pass, st.salt, st.name, m_digest, m_count, kdf_id());
+    if (m_key_cache->lookup(id, st.key, st.iv)) {
+      DBG_PKV(m_key_cache->hits());
+      timer.done();
+      return;
+    }
+  }
+
+  derive(st);
+  if (m_key_cache) {
+    m_key_cache->insert(id, st.key, st.iv);
+  }
+
+  DBG_PKV(st.pass);
+  DBG_PKV(st.name);
+  DBG_PKV(m_digest);
+  DBG_TDUMP(st.salt);
+  DBG_TDUMP(st.key);
+  DBG_TDUMP(st.iv);
+  DBG_PKV(m_count);
+  DBG_PKV(kdf_id());
+  timer.done();
+}
+
+// ================================================================
+// derive
+// ================================================================
+void Cipher::derive(state_t& st) const
+{
+  if (m_kdf == BYTES_TO_KEY) {
+    int ks = EVP_BytesToKey(st.evp, // cipher type
+			    m_evp_digest, // message digest
+			    st.salt,    // 8 bytes
+			    (uchar*)st.pass.c_str(), // pass value
+			    st.pass.length(),
+			    m_count,   // number of rounds
+			    st.key,
+			    st.iv);
+    if (ks!=EVP_CIPHER_key_length(st.evp)) {
+      throw runtime_error("init() failed: "
+			  "EVP_BytesToKey did not return a full length key");
+    }
+    return;
+  }
+
+  // The other KDFs derive the key followed by the IV in one
+  // call, that is what openssl enc -pbkdf2 does.
+  const size_t klen = EVP_CIPHER_key_length(st.evp);
+  const size_t ivlen = EVP_CIPHER_iv_length(st.evp);
+  uchar out[sizeof(aes_key_t) + sizeof(aes_iv_t)];
+  bool ok = true;
+  if (m_kdf == PBKDF2) {
+    ok = 1 == PKCS5_PBKDF2_HMAC(st.pass.data(), st.pass.size(),
+				st.salt, sizeof(st.salt),
+				m_count ? m_count : 1,
+				m_evp_digest,
+				klen + ivlen,
+				out);
+  }
+  else if (m_kdf == SCRYPT) {
+    unsigned long long n = m_kdf_memory ? m_kdf_memory : 16384;
+    if (n < 2 || (n & (n - 1))) {
+      throw runtime_error("init(): the scrypt N must be a power of 2");
+    }
+    scrypt_derive(st.pass, st.salt, sizeof(st.salt), n,
+		  m_kdf_block, m_kdf_lanes, m_threads,
+		  out, klen + ivlen);
+  }
+  else {
+#ifdef CIPHER_HAVE_ARGON2
+    // The lanes are filled in parallel by OpenSSL threads, the
+    // limit was raised by kdf() and threads().
+    EVP_KDF* kdf = EVP_KDF_fetch(NULL, "ARGON2ID", NULL);
+    EVP_KDF_CTX* kctx = kdf ? EVP_KDF_CTX_new(kdf) : 0;
+    uint32_t iter     = m_count ? m_count : 1;
+    uint32_t lanes    = m_kdf_lanes;
+    uint32_t threads  = m_threads < m_kdf_lanes ? m_threads : m_kdf_lanes;
+    uint32_t memcost  = m_kdf_memory ? m_kdf_memory : 65536;
+    OSSL_PARAM params[7];
+    OSSL_PARAM* p = params;
+    *p++ = OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_PASSWORD,
+					     (void*)st.pass.data(), st.pass.size());
+    *p++ = OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SALT,
+					     st.salt, sizeof(st.salt));
+    *p++ = OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ITER, &iter);
+    *p++ = OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ARGON2_LANES, &lanes);
+    *p++ = OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_THREADS, &threads);
+    *p++ = OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ARGON2_MEMCOST, &memcost);
+    *p = OSSL_PARAM_construct_end();
+    ok = kctx && 1 == EVP_KDF_derive(kctx, out, klen + ivlen, params);
+    EVP_KDF_CTX_free(kctx);
+    EVP_KDF_free(kdf);
+#else
+    throw runtime_error("init(): Argon2id needs OpenSSL 3.2 or later");
+#endif
+  }
+  if (!ok) {
+    OPENSSL_cleanse(out, sizeof(out));
+    throw runtime_error("init() failed: the key derivation failed");
+  }
+  memcpy(st.key, out, klen);
+  memcpy(st.iv, out + klen, ivlen);
+  OPENSSL_cleanse(out, sizeof(out));
+}
+
+// ================================================================
+// kdf
+// ================================================================
+void Cipher::kdf(Kdf k)
+{
+#ifndef CIPHER_HAVE_ARGON2
+  if (k == ARGON2ID) {
+    throw runtime_error("kdf(): Argon2id needs OpenSSL 3.2 or later");
+  }
+#else
+  if (k == ARGON2ID) {
+    raise_kdf_threads(m_threads);
+  }
+#endif
+  m_kdf = k;
+}
+
+// ================================================================
+// Key::Key
+// ================================================================
+Cipher::Key::Key()
+{
+  bzero(m_salt, sizeof(m_salt));
   bzero(m_key, sizeof(m_key));
   bzero(m_iv, sizeof(m_iv));
-  OpenSSL_add_all_algorithms();
-  const EVP_CIPHER* cipher = EVP_get_cipherbyname(m_cipher.c_str());
-  const EVP_MD*     digest = EVP_get_digestbyname(m_digest.c_str());
-  if (!cipher) {
-    string msg = "init(): cipher does not exist "+m_cipher;
-    throw runtime_error(msg);
+}
+
+// ================================================================
+// Key::~Key
+// ================================================================
+Cipher::Key::~Key()
+{
+  OPENSSL_cleanse(m_key, sizeof(m_key));
+  OPENSSL_cleanse(m_iv, sizeof(m_iv));
+}
+
+// ================================================================
+// make_key
+// ================================================================
+void Cipher::make_key(Key& k, const string& pass, const string& salt) const
+{
+  DBG_FCT("make_key");
+  state_t st(*this);
+  set_salt(st, salt);
+  init(st, pass);
+  memcpy(k.m_salt, st.salt, sizeof(k.m_salt));
+  memcpy(k.m_key, st.key, sizeof(k.m_key));
+  memcpy(k.m_iv, st.iv, sizeof(k.m_iv));
+}
+
+// ================================================================
+// prefetch
+// ================================================================
+void Cipher::prefetch(const string& pass, const string& salt) const
+{
+  DBG_FCT("prefetch");
+  if (!m_key_cache) {
+    return;
   }
-  if (!digest) {
-    string msg = "init(): digest does not exist "+m_digest;
-    throw runtime_error(msg);
+  state_t st(*this);
+  set_salt(st, salt);
+  init(st, pass);
+}
+
+// ================================================================
+// kdf_cost
+// ================================================================
+void Cipher::kdf_cost(unsigned long long memory, uint lanes, uint block)
+{
+  // The scrypt limit is r * p < 2^30 (RFC 7914), N is checked
+  // when it is used because it is the memory size for Argon2id.
+  if (lanes == 0 || block == 0 ||
+      (unsigned long long)lanes * block >= (1ULL << 30)) {
+    throw runtime_error("kdf_cost(): invalid lanes or block size");
   }
+  m_kdf_memory = memory;
+  m_kdf_lanes  = lanes;
+  m_kdf_block  = block;
+}
 
-  int ks = EVP_BytesToKey(cipher,    // cipher type
-			  digest,    // message digest
-			  m_salt,    // 8 bytes
-			  (uchar*)m_pass.c_str(), // pass value
-			  m_pass.length(),
-			  m_count,   // number of rounds
-			  m_key,
-			  m_iv);
-  if (ks!=32) {
-    throw runtime_error("init() failed: "
-			"EVP_BytesToKey did not return a 32 byte key");
+// ================================================================
+// kdf_id
+// ================================================================
+string Cipher::kdf_id() const
+{
+  // EVP_BytesToKey has no id so the existing cache ids do not
+  // change.
+  ostringstream os;
+  switch (m_kdf) {
+  case BYTES_TO_KEY:
+    break;
+  case PBKDF2:
+    os << "pbkdf2";
+    break;
+  case SCRYPT:
+    os << "scrypt:" << m_kdf_memory << ":" << m_kdf_block << ":" << m_kdf_lanes;
+    break;
+  case ARGON2ID:
+    os << "argon2id:" << m_kdf_memory << ":" << m_kdf_lanes;
+    break;
   }
+  return os.str();
+}
 
-  DBG_PKV(m_pass);
-  DBG_PKV(m_cipher);
-  DBG_PKV(m_digest);
-  DBG_TDUMP(m_salt);
-  DBG_TDUMP(m_key);
-  DBG_TDUMP(m_iv);
-  DBG_PKV(m_count);
+// ================================================================
+// Stats::clear
+// ================================================================
+void Cipher::Stats::clear()
+{
+  for(uint i=0;i<STAGES;++i) {
+    m_ns[i] = m_bytes[i] = m_calls[i] = m_errors[i] = 0;
+  }
+}
+
+// ================================================================
+// Stats::add
+// ================================================================
+void Cipher::Stats::add(Stage st,
+			unsigned long long ns,
+			unsigned long long bytes,
+			bool error)
+{
+  __sync_fetch_and_add(&m_ns[st], ns);
+  __sync_fetch_and_add(&m_bytes[st], bytes);
+  __sync_fetch_and_add(&m_calls[st], 1ULL);
+  if (error) {
+    __sync_fetch_and_add(&m_errors[st], 1ULL);
+  }
+}
+
+// ================================================================
+// Stats::operator+=
+// ================================================================
+Cipher::Stats& Cipher::Stats::operator+=(const Stats& x)
+{
+  for(uint i=0;i<STAGES;++i) {
+    __sync_fetch_and_add(&m_ns[i], x.m_ns[i]);
+    __sync_fetch_and_add(&m_bytes[i], x.m_bytes[i]);
+    __sync_fetch_and_add(&m_calls[i], x.m_calls[i]);
+    __sync_fetch_and_add(&m_errors[i], x.m_errors[i]);
+  }
+  return *this;
+}
+
+// ================================================================
+// Stats::name
+// ================================================================
+const char* Cipher::Stats::name(Stage st)
+{
+  switch (st) {
+  case KDF:    return "kdf";
+  case CIPHER: return "cipher";
+  case BASE64: return "base64";
+  case IO:     return "io";
+  default:     return "?";
+  }
+}
+
+// ================================================================
+// Stats::str
+// ================================================================
+string Cipher::Stats::str() const
+{
+  ostringstream os;
+  os << left << setw(8) << "stage"
+     << right << setw(10) << "calls"
+     << setw(8) << "errors"
+     << setw(14) << "bytes"
+     << setw(12) << "ms"
+     << setw(10) << "MB/s" << endl;
+  for(uint i=0;i<STAGES;++i) {
+    double mbs = m_ns[i] ? m_bytes[i] * 1e9 / m_ns[i] / (1 << 20) : 0;
+    os << left << setw(8) << name(Stage(i))
+       << right << setw(10) << m_calls[i]
+       << setw(8) << m_errors[i]
+       << setw(14) << m_bytes[i]
+       << setw(12) << fixed << setprecision(3) << m_ns[i] / 1e6
+       << setw(10) << setprecision(1) << mbs << endl;
+  }
+  return os.str();
+}
+
+// ================================================================
+// CtxPool::CtxPool
+// ================================================================
+Cipher::CtxPool::CtxPool(uint max_size)
+  : m_max_size(max_size),
+    m_allocs(0)
+{
+  pthread_mutex_init(&m_mutex, 0);
+}
+
+// ================================================================
+// CtxPool::~CtxPool
+// ================================================================
+Cipher::CtxPool::~CtxPool()
+{
+  max_size(0);
+  pthread_mutex_destroy(&m_mutex);
+}
+
+// ================================================================
+// CtxPool::max_size
+// ================================================================
+void Cipher::CtxPool::max_size(uint n)
+{
+  lock_t lock(m_mutex);
+  m_max_size = n;
+  while (m_free.size() > m_max_size) {
+    EVP_CIPHER_CTX_free(m_free.back());
+    m_free.pop_back();
+  }
+}
+
+// ================================================================
+// CtxPool::acquire
+// ================================================================
+EVP_CIPHER_CTX* Cipher::CtxPool::acquire(const EVP_CIPHER* cipher,
+					 const uchar* key,
+					 const uchar* iv,
+					 int enc)
+{
+  // Only try the lock, a thread that would have to wait
+  // allocates a context instead.
+  EVP_CIPHER_CTX* ctx = 0;
+  if (pthread_mutex_trylock(&m_mutex) == 0) {
+    if (!m_free.empty()) {
+      ctx = m_free.back();
+      m_free.pop_back();
+    }
+    pthread_mutex_unlock(&m_mutex);
+  }
+  if (!ctx) {
+    ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) {
+      throw runtime_error("EVP_CIPHER_CTX_new() failed");
+    }
+    __sync_add_and_fetch(&m_allocs, 1);
+  }
+  if (!cipher_init(ctx, cipher, key, iv, enc)) {
+    EVP_CIPHER_CTX_free(ctx);
+    throw runtime_error(enc ? "EVP_EncryptInit_ex() init key/iv failed" :
+			"EVP_DecryptInit_ex() failed");
+  }
+  return ctx;
+}
+
+// ================================================================
+// CtxPool::release
+// ================================================================
+void Cipher::CtxPool::release(EVP_CIPHER_CTX* ctx, bool reuse)
+{
+  // Contexts from failed operations are in an unknown state
+  // so they are not reused.
+  if (reuse && pthread_mutex_trylock(&m_mutex) == 0) {
+    if (m_free.size() < m_max_size) {
+      m_free.push_back(ctx);
+      ctx = 0;
+    }
+    pthread_mutex_unlock(&m_mutex);
+  }
+  if (ctx) {
+    EVP_CIPHER_CTX_free(ctx);
+  }
+}
+
+// ================================================================
+// KeyCache::KeyCache
+// ================================================================
+Cipher::KeyCache::KeyCache(uint capacity)
+  : m_capacity(capacity ? capacity : 1),
+    m_hits(0),
+    m_misses(0)
+{
+  pthread_mutex_init(&m_mutex, 0);
+}
+
+// ================================================================
+// KeyCache::~KeyCache
+// ================================================================
+Cipher::KeyCache::~KeyCache()
+{
+  clear();
+  pthread_mutex_destroy(&m_mutex);
+}
+
+// ================================================================
+// KeyCache::make_id
+// ================================================================
+string Cipher::KeyCache::make_id(const string& pass,
+				 const aes_salt_t salt,
+				 const string& cipher,
+				 const string& digest,
+				 uint count,
+				 const string& kdf)
+{
+  // The entries are keyed on a SHA-256 hash so that the
+  // passphrase is never stored in the cache. The lengths are
+  // included so that the field boundaries are unambiguous.
+  EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+  uint lens[4] = {(uint)pass.size(), (uint)cipher.size(),
+		  (uint)digest.size(), count};
+  uchar md[EVP_MAX_MD_SIZE];
+  uint mdlen = 0;
+  bool ok = ctx &&
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) &&
+    EVP_DigestUpdate(ctx, lens, sizeof(lens)) &&
+    EVP_DigestUpdate(ctx, pass.data(), pass.size()) &&
+    EVP_DigestUpdate(ctx, salt, sizeof(aes_salt_t)) &&
+    EVP_DigestUpdate(ctx, cipher.data(), cipher.size()) &&
+    EVP_DigestUpdate(ctx, digest.data(), digest.size()) &&
+    (kdf.empty() || EVP_DigestUpdate(ctx, kdf.data(), kdf.size())) &&
+    EVP_DigestFinal_ex(ctx, md, &mdlen);
+  EVP_MD_CTX_free(ctx);
+  if (!ok) {
+    throw runtime_error("KeyCache::make_id(): SHA-256 failed");
+  }
+  return string((const char*)md, mdlen);
+}
+
+// ================================================================
+// KeyCache::lookup
+// ================================================================
+bool Cipher::KeyCache::lookup(const string& id,
+			      aes_key_t key,
+			      aes_iv_t iv)
+{
+  lock_t lock(m_mutex);
+  map_t::iterator it = m_map.find(id);
+  if (it == m_map.end()) {
+    ++m_misses;
+    return false;
+  }
+  ++m_hits;
+  m_lru.splice(m_lru.begin(), m_lru, it->second); // most recent
+  memcpy(key, it->second->key, sizeof(aes_key_t));
+  memcpy(iv, it->second->iv, sizeof(aes_iv_t));
+  return true;
+}
+
+// ================================================================
+// KeyCache::insert
+// ================================================================
+void Cipher::KeyCache::insert(const string& id,
+			      const aes_key_t key,
+			      const aes_iv_t iv)
+{
+  lock_t lock(m_mutex);
+  map_t::iterator it = m_map.find(id);
+  if (it != m_map.end()) {
+    m_lru.splice(m_lru.begin(), m_lru, it->second);
+    return;
+  }
+  while (m_lru.size() >= m_capacity) {
+    evict();
+  }
+  m_lru.push_front(entry_t());
+  entry_t& e = m_lru.front();
+  e.id = id;
+  memcpy(e.key, key, sizeof(aes_key_t));
+  memcpy(e.iv, iv, sizeof(aes_iv_t));
+  m_map[id] = m_lru.begin();
+}
+
+// ================================================================
+// KeyCache::clear
+// ================================================================
+void Cipher::KeyCache::clear()
+{
+  lock_t lock(m_mutex);
+  while (!m_lru.empty()) {
+    evict();
+  }
+}
+
+// ================================================================
+// KeyCache::size
+// ================================================================
+size_t Cipher::KeyCache::size() const
+{
+  lock_t lock(m_mutex);
+  return m_lru.size();
+}
+
+// ================================================================
+// KeyCache::hits
+// ================================================================
+unsigned long Cipher::KeyCache::hits() const
+{
+  lock_t lock(m_mutex);
+  return m_hits;
+}
+
+// ================================================================
+// KeyCache::misses
+// ================================================================
+unsigned long Cipher::KeyCache::misses() const
+{
+  lock_t lock(m_mutex);
+  return m_misses;
+}
+
+// ================================================================
+// KeyCache::evict
+// ================================================================
+void Cipher::KeyCache::evict()
+{
+  // Remove the least recently used entry and zero the key
+  // material so that it does not linger in freed memory.
+  entry_t& e = m_lru.back();
+  m_map.erase(e.id);
+  OPENSSL_cleanse(e.key, sizeof(e.key));
+  OPENSSL_cleanse(e.iv, sizeof(e.iv));
+  OPENSSL_cleanse(&e.id[0], e.id.size());
+  m_lru.pop_back();
 }
 
 // ================================================================
@@ -496,13 +4500,21 @@ void Cipher::init(const string& pass)
 string Cipher::file_read(const string& fn) const
 {
   DBG_FCT("file_read");
-  ifstream ifs(fn.c_str());
-  if (!ifs) {
-    string msg="Cannot read file '"+fn+"'";
-    throw runtime_error(msg);
+  // Copy a regular file from the mapping in one piece, read
+  // anything else in chunks rather than a character at a time.
+  ifile_t ifs(fn, m_io, m_chunk_size);
+  istream& is = ifs.stream();
+  size_t chunk = stream_mapped(is) ? (size_t)-1 : m_chunk_size;
+  string str;
+  vector<char> buf;
+  for(;;) {
+    const uchar* p = 0;
+    size_t n = stream_next(is, &p, buf, chunk, stats_ptr());
+    if (n == 0) {
+      break;
+    }
+    str.append((const char*)p, n);
   }
-  string str((istreambuf_iterator<char>(ifs)),
-	     istreambuf_iterator<char>());
   return str;
 }
 
@@ -512,16 +4524,39 @@ string Cipher::file_read(const string& fn) const
 void Cipher::file_write(const string& fn, const string& data, bool nl) const
 {
   DBG_FCT("file_write");
-  ofstream ofs(fn.c_str());
-  if (!ofs) {
-    string msg="Cannot write file '"+fn+"'";
-    throw runtime_error(msg);
-  }
-  ofs << data;
+  stage_timer_t timer(stats_ptr(), Stats::IO, data.size());
+  ofile_t ofs(fn, m_io, m_chunk_size);
+  ofs.stream() << data;
   if (nl) {
-    ofs << endl;
+    ofs.stream() << endl;
+  }
+  ofs.commit();
+  timer.done();
+}
+
+// ================================================================
+// io_name
+// ================================================================
+string Cipher::io_name() const
+{
+  if (m_io == IO_STREAMS) {
+    return "streams";
+  }
+  AsyncIO io(1, 1);
+  return AsyncIO::name(io.backend());
+}
+
+// ================================================================
+// random_bytes
+// ================================================================
+void Cipher::random_bytes(uchar* buf, size_t len)
+{
+  // Bulk requests bypass the pool, it would only add a copy.
+  if (len >= RAND_POOL_SIZE / 4) {
+    random_fill(buf, len);
+    return;
   }
-  ofs.close();
+  rand_pool_t::instance().get(buf, len);
 }
 
 // ================================================================
@@ -23,15 +23,28 @@
 
 #include <string>
 #include <vector>
+#include <iosfwd>
+#include <list>
+#include <map>
 #include <utility> // pair
+#include <pthread.h>
+#include <openssl/evp.h>
 
 #define CIPHER_DEFAULT_CIPHER "aes-256-cbc"
 #define CIPHER_DEFAULT_DIGEST "sha256"
 #define CIPHER_DEFAULT_COUNT  1
+#define CIPHER_DEFAULT_CHUNK_SIZE (64*1024)
+#define CIPHER_DEFAULT_CTX_POOL_SIZE 4
+
+// Argon2id is in OpenSSL 3.2 and later.
+#if OPENSSL_VERSION_NUMBER >= 0x30200000L
+#define CIPHER_HAVE_ARGON2
+#endif
 
 /**
  * The cipher object encrypts plaintext data or decrypts ciphertext
- * data. All data is in ASCII because it is MIME encoded.
+ * data. By default the ciphertext is in ASCII because it is MIME
+ * encoded, use armor(false) for raw binary ciphertext.
  *
  * The default cipher used is AES-256-CBC from the openssl library
  * but there are many others available. The default digest used is
@@ -40,6 +53,34 @@
  * The algorithms mimic openssl so files created with this object
  * and with the openssl tool are interchangeable.
  *
+ * The AEAD ciphers (aes-128-gcm, aes-192-gcm, aes-256-gcm and
+ * chacha20-poly1305) use a framed format instead because the
+ * openssl format has no room for the authentication tags. It is
+ * a 32 byte header followed by the chunks:
+ * @verbatim
+ *   offset  size  field
+ *   0       6     magic "CTAEAD"
+ *   6       1     version, 1
+ *   7       1     algorithm: 1=aes-128-gcm, 2=aes-192-gcm,
+ *                            3=aes-256-gcm, 4=chacha20-poly1305
+ *   8       4     chunk size, big endian
+ *   12      8     salt
+ *   20      12    base nonce, random
+ *   32            chunks: ciphertext followed by a 16 byte tag
+ * @endverbatim
+ * Every chunk except the last one has chunk size bytes of
+ * plaintext. The nonce of chunk i is the base nonce with i
+ * (64 bits, big endian) XORed into its last 8 bytes. The
+ * additional authenticated data is the header followed by one
+ * byte that is 1 for the last chunk and 0 otherwise, so chunks
+ * cannot be reordered, dropped or moved to another file without
+ * the tag check failing. The key is derived from the passphrase
+ * and the salt the same way as for the other ciphers, the KDF,
+ * digest and count are not recorded. The chunks are independent so they
+ * are encrypted and decrypted in parallel if threads() is more
+ * than 1. The format is detected when decrypting, the algorithm
+ * in the header is used.
+ *
  * Here is how you would use it to encrypt and decrypt plaintext
  * data in memory.
  * @code
@@ -69,6 +110,17 @@
  *      }
  *   }
  * @endcode
+ *
+ * The encrypt and decrypt functions are const: the passphrase,
+ * salt, key and IV of each call are kept on its stack, so one
+ * object can be shared by many threads without locking once it
+ * is configured. The setters are not thread safe, call them
+ * before the object is shared.
+ * @code
+ *   const Cipher& c = shared_cipher(); // configured at startup
+ *   // in any thread
+ *   string ct = c.encrypt(record, pass);
+ * @endcode
  * @author Joe Linoff
  */
 class Cipher
@@ -80,6 +132,340 @@ public:
   typedef uchar aes_iv_t[32];
   typedef uchar aes_salt_t[8];
   typedef std::pair<uchar*,uint> kv1_t;
+
+  /**
+   * Key derivation functions.
+   */
+  enum Kdf
+  {
+    BYTES_TO_KEY, ///< EVP_BytesToKey, count rounds (openssl enc default).
+    PBKDF2,       ///< PBKDF2-HMAC, count iterations (openssl enc -pbkdf2 -iter count).
+    SCRYPT,       ///< scrypt, see kdf_cost().
+    ARGON2ID      ///< Argon2id, count passes, needs OpenSSL 3.2 or later.
+  };
+
+  /**
+   * File I/O backends.
+   */
+  enum Io
+  {
+    IO_STREAMS, ///< Memory mapped input and ofstream output (default).
+    IO_URING    ///< Queued reads and writes, see io().
+  };
+public:
+  /**
+   * Destination for the output of the incremental Encryptor and
+   * Decryptor objects. Derive from it to send the data to a
+   * socket, a file or another buffer.
+   */
+  class Sink
+  {
+  public:
+    virtual ~Sink() {}
+    /**
+     * Consume data.
+     * @param buf  The data.
+     * @param len  The number of bytes.
+     */
+    virtual void write(const uchar* buf, size_t len) = 0;
+  };
+
+  /**
+   * Sink that appends the data to a string.
+   */
+  class StringSink : public Sink
+  {
+  public:
+    virtual void write(const uchar* buf, size_t len);
+    std::string& str() {return m_str;}
+  private:
+    std::string m_str;
+  };
+
+  /**
+   * Incremental encryptor.
+   *
+   * It holds one cipher context across calls so that data can be
+   * encrypted as it arrives without buffering the whole message.
+   * The output is binary, openssl compatible, "Salted__" framed
+   * ciphertext. It uses the cipher, digest, count and embed
+   * settings of the Cipher object that created it. The AEAD
+   * ciphers are not supported, use encrypt_stream() for them.
+   * An Encryptor is used by one thread but the Encryptors of
+   * several threads can share the Cipher object.
+   *
+   * Here is how you would use it.
+   * @code
+   *   Cipher c;
+   *   Cipher::Encryptor enc(c);
+   *   Cipher::StringSink sink;
+   *   enc.begin("password");
+   *   while (get_frame(frame)) {
+   *     enc.update(frame.data(), frame.size(), sink);
+   *   }
+   *   enc.finish(sink);
+   * @endcode
+   */
+  class Encryptor
+  {
+  public:
+    Encryptor(const Cipher& cipher);
+    ~Encryptor();
+    /**
+     * Start a new message.
+     * @param pass  The passphrase.
+     * @param salt  The optional salt.
+     */
+    void begin(const std::string& pass="",
+	       const std::string& salt="");
+    /**
+     * Encrypt the next piece of the message.
+     * @param buf   The plaintext.
+     * @param len   The plaintext length.
+     * @param sink  Receives the ciphertext.
+     * @throws runtime_error If a problem occurs.
+     */
+    void update(const uchar* buf, size_t len, Sink& sink);
+    /**
+     * Finish the message. This writes the padding.
+     * @param sink  Receives the ciphertext.
+     * @throws runtime_error If a problem occurs.
+     */
+    void finish(Sink& sink);
+  private:
+    Encryptor(const Encryptor&);
+    Encryptor& operator=(const Encryptor&);
+    void write_header(Sink& sink);
+  private:
+    const Cipher&      m_cipher;
+    EVP_CIPHER_CTX*    m_ctx;
+    std::vector<uchar> m_buf;
+    aes_salt_t         m_salt;
+    bool               m_header;
+    bool               m_active;
+  };
+
+  /**
+   * Incremental decryptor.
+   *
+   * It is the inverse of the Encryptor. The salt is read from the
+   * "Salted__" prefix if it is present.
+   */
+  class Decryptor
+  {
+  public:
+    Decryptor(const Cipher& cipher);
+    ~Decryptor();
+    /**
+     * Start a new message.
+     * @param pass  The passphrase.
+     * @param salt  The optional salt, ignored if it is embedded.
+     */
+    void begin(const std::string& pass="",
+	       const std::string& salt="");
+    /**
+     * Decrypt the next piece of the message.
+     * @param buf   The ciphertext.
+     * @param len   The ciphertext length.
+     * @param sink  Receives the plaintext.
+     * @throws runtime_error If a problem occurs.
+     */
+    void update(const uchar* buf, size_t len, Sink& sink);
+    /**
+     * Finish the message. This checks and strips the padding.
+     * @param sink  Receives the plaintext.
+     * @throws runtime_error If a problem occurs.
+     */
+    void finish(Sink& sink);
+  private:
+    Decryptor(const Decryptor&);
+    Decryptor& operator=(const Decryptor&);
+    void start(Sink& sink);
+    void decrypt(const uchar* buf, size_t len, Sink& sink);
+  private:
+    const Cipher&      m_cipher;
+    EVP_CIPHER_CTX*    m_ctx;
+    std::vector<uchar> m_buf;
+    std::string        m_pass;
+    std::string        m_salt;
+    uchar              m_hdr[16];
+    uint               m_hdrlen;
+    bool               m_ready;
+    bool               m_active;
+  };
+  /**
+   * Bounded LRU cache of derived key and IV values.
+   *
+   * Key derivation dominates the cost of decrypting many small
+   * records that use the same passphrase, especially when the
+   * count is large. Attach a cache with key_cache() to skip the
+   * derivation for (pass, salt, cipher, digest, count, KDF) tuples
+   * that have been seen before. The entries are keyed on a
+   * SHA-256 hash of the tuple and the key material is zeroed
+   * when it is evicted.
+   *
+   * The cache is owned by the caller. It can be shared by
+   * several Cipher objects, it is thread safe so the objects can
+   * be used in different threads.
+   * @code
+   *   Cipher::KeyCache cache(128);
+   *   Cipher c;
+   *   c.key_cache(&cache);
+   *   for(size_t i=0;i<records.size();++i) {
+   *     out.push_back(c.decrypt(records[i], pass));
+   *   }
+   * @endcode
+   */
+  class KeyCache
+  {
+  public:
+    /**
+     * Constructor.
+     * @param capacity  The maximum number of entries.
+     */
+    KeyCache(uint capacity=64);
+    ~KeyCache();
+    /**
+     * Create the lookup id for a derivation tuple.
+     * @returns The SHA-256 hash of the tuple.
+     */
+    static std::string make_id(const std::string& pass,
+			       const aes_salt_t salt,
+			       const std::string& cipher,
+			       const std::string& digest,
+			       uint count,
+			       const std::string& kdf="");
+    /**
+     * Look up a derived key and IV.
+     * @param id   The id from make_id().
+     * @param key  Set to the cached key on a hit.
+     * @param iv   Set to the cached IV on a hit.
+     * @returns True on a hit.
+     */
+    bool lookup(const std::string& id, aes_key_t key, aes_iv_t iv);
+    /**
+     * Add a derived key and IV, evicting the least recently
+     * used entry if the cache is full.
+     */
+    void insert(const std::string& id,
+		const aes_key_t key,
+		const aes_iv_t iv);
+    /**
+     * Remove all entries.
+     */
+    void clear();
+    uint capacity() const {return m_capacity;}
+    size_t size() const;
+    unsigned long hits() const;
+    unsigned long misses() const;
+  private:
+    KeyCache(const KeyCache&);
+    KeyCache& operator=(const KeyCache&);
+    void evict();
+  private:
+    struct entry_t
+    {
+      std::string id;
+      aes_key_t   key;
+      aes_iv_t    iv;
+    };
+    typedef std::list<entry_t> lru_t;
+    typedef std::map<std::string, lru_t::iterator> map_t;
+    lru_t         m_lru; // most recently used first
+    map_t         m_map;
+    uint          m_capacity;
+    unsigned long m_hits;
+    unsigned long m_misses;
+    mutable pthread_mutex_t m_mutex;
+  };
+  /**
+   * Cumulative time, byte, call and error counters for each
+   * stage of the processing.
+   *
+   * They are collected when collect_stats() is set, otherwise
+   * the only cost is a test of the flag. The counters are
+   * updated atomically because the parallel streaming functions
+   * update them from the worker threads.
+   *
+   * The cipher stage of the buffer and batch functions includes
+   * the MIME encoding because it is interleaved with the
+   * encryption.
+   * @code
+   *   Cipher c;
+   *   c.collect_stats();
+   *   c.encrypt_file("big.tar", "big.tar.enc", pass);
+   *   cerr << c.stats().str();
+   * @endcode
+   */
+  class Stats
+  {
+  public:
+    /**
+     * The stages.
+     */
+    enum Stage
+    {
+      KDF,    ///< Key derivation, init().
+      CIPHER, ///< Encryption and decryption.
+      BASE64, ///< MIME encoding and decoding.
+      IO,     ///< File and stream reads and writes.
+      STAGES  ///< The number of stages.
+    };
+    Stats() {clear();}
+    /**
+     * Reset the counters.
+     */
+    void clear();
+    /**
+     * Record one call. It is thread safe.
+     * @param st     The stage.
+     * @param ns     The elapsed nanoseconds.
+     * @param bytes  The number of bytes processed.
+     * @param error  True if the call failed.
+     */
+    void add(Stage st, unsigned long long ns, unsigned long long bytes, bool error);
+    /**
+     * Add the counters of another object.
+     */
+    Stats& operator+=(const Stats& x);
+    unsigned long long ns(Stage st) const {return m_ns[st];}
+    unsigned long long bytes(Stage st) const {return m_bytes[st];}
+    unsigned long long calls(Stage st) const {return m_calls[st];}
+    unsigned long long errors(Stage st) const {return m_errors[st];}
+    /**
+     * Get the name of a stage.
+     * @returns "kdf", "cipher", "base64" or "io".
+     */
+    static const char* name(Stage st);
+    /**
+     * Format the counters as a table, one stage per line.
+     */
+    std::string str() const;
+  private:
+    unsigned long long m_ns[STAGES];
+    unsigned long long m_bytes[STAGES];
+    unsigned long long m_calls[STAGES];
+    unsigned long long m_errors[STAGES];
+  };
+  /**
+   * A derived key and IV and the salt they were derived from,
+   * see make_key(). It is only valid for Cipher objects with the
+   * same settings. The key material is zeroed by the destructor.
+   */
+  class Key
+  {
+  public:
+    Key();
+    ~Key();
+    const uchar* salt() const {return m_salt;}
+  private:
+    Key(const Key&);
+    Key& operator=(const Key&);
+    friend class Cipher;
+    aes_salt_t m_salt;
+    aes_key_t  m_key;
+    aes_iv_t   m_iv;
+  };
 public:
   /**
    * Constructor.
@@ -93,11 +479,22 @@ public:
    * @param count  The number of iterations (def. 1).
    * @param embed  Embed the salt. If this is false, the output will 
    *               not be compatible with openssl.
+   * @throws runtime_error If the cipher or digest does not exist.
    */
   Cipher(const std::string& cipher,
 	 const std::string& digest,
 	 uint count=1,
 	 bool embed=true);
+
+  /**
+   * Copy constructor.
+   */
+  Cipher(const Cipher& c);
+
+  /**
+   * Assignment.
+   */
+  Cipher& operator=(const Cipher& c);
   
   /**
    * Destructor.
@@ -105,19 +502,26 @@ public:
   ~Cipher();
 public:
   /**
-   * Encrypt buffer using AES 256 CBC (SHA256).
+   * Encrypt buffer using AES 256 CBC (SHA256). The cipher and the
+   * MIME encoding are done together in cache sized blocks so the
+   * data is only read once.
    * @param plaintext The plaintext buffer.
    * @param pass      The passphrase.
    * @param salt      The optional salt.
-   * @returns The ciphertext: encrypted, MIME encoded data.
+   * @returns The ciphertext: encrypted, MIME encoded data or
+   *          binary data if armor() is false.
    */
   std::string encrypt(const std::string& plaintext,
 		      const std::string& pass="",
-		      const std::string& salt="");
+		      const std::string& salt="") const;
   
   /**
    * Encrypt a file.
    *
+   * The file is streamed in chunk_size() pieces so the memory
+   * used does not depend on the size of the file. Regular files
+   * are memory mapped so they are not copied as they are read.
+   *
    * Here is a usage example.
    * @code
    *   #include "cipher.h"
@@ -157,7 +561,43 @@ public:
   void encrypt_file(const std::string& ifn,
 		    const std::string& ofn,
 		    const std::string& pass="",
-		    const std::string& salt="");
+		    const std::string& salt="") const;
+
+  /**
+   * Encrypt a file to a stream.
+   *
+   * Regular files are memory mapped and encrypted directly from
+   * the page cache, other files (pipes, devices) are read in
+   * chunk_size() pieces.
+   * @param ifn   The plaintext file.
+   * @param os    The ciphertext output stream.
+   * @param pass  The passphrase.
+   * @param salt  The optional salt.
+   * @throws runtime_error If a problem occurs.
+   */
+  void encrypt_file(const std::string& ifn,
+		    std::ostream& os,
+		    const std::string& pass="",
+		    const std::string& salt="") const;
+
+  /**
+   * Encrypt a stream.
+   *
+   * The input is read in chunk_size() pieces that are encrypted
+   * and MIME encoded as they arrive. The output is the same as
+   * encrypt() followed by a new line which is what openssl enc -a
+   * produces. If armor() is false the output is binary. AEAD
+   * ciphers produce the framed format described above.
+   * @param is    The plaintext input stream.
+   * @param os    The ciphertext output stream.
+   * @param pass  The passphrase.
+   * @param salt  The optional salt.
+   * @throws runtime_error If a problem occurs.
+   */
+  void encrypt_stream(std::istream& is,
+		      std::ostream& os,
+		      const std::string& pass="",
+		      const std::string& salt="") const;
 public:
   /**
    * Decrypt a buffer using AES 256 CBC (SHA256).
@@ -168,11 +608,15 @@ public:
    */
   std::string decrypt(const std::string& ciphertext,
 		      const std::string& pass="",
-		      const std::string& salt="");
+		      const std::string& salt="") const;
   
   /**
    * Decrypt a file.
    *
+   * The file is streamed in chunk_size() pieces so the memory
+   * used does not depend on the size of the file. Regular files
+   * are memory mapped so they are not copied as they are read.
+   *
    * Here is a usage example.
    * @code
    *   #include "cipher.h"
@@ -216,7 +660,225 @@ public:
   void decrypt_file(const std::string& ifn,
 		    const std::string& ofn,
 		    const std::string& pass="",
-		    const std::string& salt="");
+		    const std::string& salt="") const;
+
+  /**
+   * Decrypt a file to a stream.
+   *
+   * Regular files are memory mapped and decrypted directly from
+   * the page cache, other files (pipes, devices) are read in
+   * chunk_size() pieces.
+   * @param ifn   The encrypted file.
+   * @param os    The plaintext output stream.
+   * @param pass  The passphrase.
+   * @param salt  The optional salt, ignored if it is embedded.
+   * @throws runtime_error If a problem occurs.
+   */
+  void decrypt_file(const std::string& ifn,
+		    std::ostream& os,
+		    const std::string& pass="",
+		    const std::string& salt="") const;
+
+  /**
+   * Decrypt a stream.
+   *
+   * The input is read in chunk_size() pieces that are MIME
+   * decoded and decrypted as they arrive. If armor() is false the
+   * input is binary. The AEAD format is recognized by its magic,
+   * each chunk is verified before it is written.
+   * @param is    The ciphertext input stream.
+   * @param os    The plaintext output stream.
+   * @param pass  The passphrase.
+   * @param salt  The optional salt, ignored if it is embedded.
+   * @throws runtime_error If a problem occurs.
+   */
+  void decrypt_stream(std::istream& is,
+		      std::ostream& os,
+		      const std::string& pass="",
+		      const std::string& salt="") const;
+
+  /**
+   * Decrypt a byte range of an encrypted file.
+   *
+   * Only the ciphertext blocks that cover the range are read and
+   * decrypted. That works for the CTR mode ciphers where the
+   * counter is computed from the offset, for the CBC mode ciphers
+   * where the previous ciphertext block is the IV and for the
+   * AEAD format where the chunks that cover the range are
+   * verified. If armor() is true the offsets are mapped to the
+   * MIME lines, the line length is taken from the first line.
+   *
+   * Here is how you would use it to read 100 bytes from the
+   * middle of a large file.
+   * @code
+   *   Cipher c("aes-256-ctr", "sha256");
+   *   string s = c.decrypt_range("big.tar.enc", 1000000000, 100, pass);
+   * @endcode
+   * @param ifn     The encrypted file.
+   * @param offset  The plaintext offset.
+   * @param length  The maximum number of plaintext bytes, the
+   *                range is cut at the end of the plaintext.
+   * @param pass    The passphrase.
+   * @param salt    The optional salt, ignored if it is embedded.
+   * @returns The plaintext in the range.
+   * @throws runtime_error If the mode is not CBC, CTR or AEAD or
+   *                       a problem occurs.
+   */
+  std::string decrypt_range(const std::string& ifn,
+			    unsigned long long offset,
+			    unsigned long long length,
+			    const std::string& pass="",
+			    const std::string& salt="") const;
+
+  /**
+   * Decrypt a byte range of an encrypted file to a stream.
+   * @param ifn     The encrypted file.
+   * @param os      The plaintext output stream.
+   * @param offset  The plaintext offset.
+   * @param length  The maximum number of plaintext bytes.
+   * @param pass    The passphrase.
+   * @param salt    The optional salt, ignored if it is embedded.
+   * @throws runtime_error If the mode is not CBC, CTR or AEAD or
+   *                       a problem occurs.
+   */
+  void decrypt_range(const std::string& ifn,
+		     std::ostream& os,
+		     unsigned long long offset,
+		     unsigned long long length,
+		     const std::string& pass="",
+		     const std::string& salt="") const;
+
+  /**
+   * Decrypt a byte range of an encrypted file to a file.
+   * The output file is only replaced when the whole range has
+   * been decrypted.
+   * @param ifn     The encrypted file.
+   * @param ofn     The plaintext file.
+   * @param offset  The plaintext offset.
+   * @param length  The maximum number of plaintext bytes.
+   * @param pass    The passphrase.
+   * @param salt    The optional salt, ignored if it is embedded.
+   * @throws runtime_error If the mode is not CBC, CTR or AEAD or
+   *                       a problem occurs.
+   */
+  void decrypt_range(const std::string& ifn,
+		     const std::string& ofn,
+		     unsigned long long offset,
+		     unsigned long long length,
+		     const std::string& pass="",
+		     const std::string& salt="") const;
+public:
+  /**
+   * Get the size of the output buffer needed by the buffer
+   * versions of encrypt() and decrypt().
+   * @param len  The input length.
+   * @param enc  True for encrypt() or false for decrypt().
+   * @returns The largest possible output length.
+   */
+  size_t max_output_size(size_t len, bool enc=true) const;
+
+  /**
+   * Encrypt a buffer into a caller supplied buffer.
+   *
+   * The output is the same as the string version of encrypt() but
+   * there are no intermediate heap allocations so it can be used
+   * with preallocated or arena memory.
+   * @code
+   *   Cipher c;
+   *   vector<uchar> out(c.max_output_size(len));
+   *   size_t n = c.encrypt(data, len, &out[0], out.size(), pass);
+   * @endcode
+   * @param plaintext      The plaintext.
+   * @param plaintext_len  The plaintext length.
+   * @param out            The ciphertext buffer.
+   * @param outlen         The size of the ciphertext buffer, it must
+   *                       be at least max_output_size(plaintext_len).
+   * @param pass           The passphrase.
+   * @param salt           The optional salt.
+   * @returns The ciphertext length.
+   * @throws runtime_error If a problem occurs or the cipher is an
+   *                       AEAD cipher.
+   */
+  size_t encrypt(const uchar* plaintext,
+		 size_t plaintext_len,
+		 uchar* out,
+		 size_t outlen,
+		 const std::string& pass="",
+		 const std::string& salt="") const;
+
+  /**
+   * Decrypt a buffer into a caller supplied buffer.
+   * It is the inverse of the buffer version of encrypt().
+   * @param ciphertext      The ciphertext.
+   * @param ciphertext_len  The ciphertext length.
+   * @param out             The plaintext buffer.
+   * @param outlen          The size of the plaintext buffer, it must
+   *                        be at least
+   *                        max_output_size(ciphertext_len,false).
+   * @param pass            The passphrase.
+   * @param salt            The optional salt, ignored if it is embedded.
+   * @returns The plaintext length.
+   * @throws runtime_error If a problem occurs or the cipher is an
+   *                       AEAD cipher.
+   */
+  size_t decrypt(const uchar* ciphertext,
+		 size_t ciphertext_len,
+		 uchar* out,
+		 size_t outlen,
+		 const std::string& pass="",
+		 const std::string& salt="") const;
+
+  /**
+   * Encrypt many small records.
+   *
+   * It amortizes the per call setup of encrypt(): one cipher
+   * context is re-keyed for each record and the output strings
+   * are reused. By default each record is openssl compatible and
+   * can be decrypted with decrypt(), if a salt is specified the
+   * key is derived once for the whole batch otherwise each record
+   * gets a random salt and its own key.
+   *
+   * If shared is true one key is derived from the salt (a random
+   * one if it is not specified) and each record gets a random IV.
+   * The record is the 8 byte salt, the IV and the ciphertext, it
+   * is not openssl compatible, use decrypt_batch() with shared
+   * set to decrypt it. This is the fastest mode.
+   * @code
+   *   Cipher c;
+   *   vector<string> ct;
+   *   c.encrypt_batch(records, ct, pass, "", true);
+   * @endcode
+   * @param records  The plaintext records.
+   * @param out      The ciphertext records.
+   * @param pass     The passphrase.
+   * @param salt     The optional salt.
+   * @param shared   Use one key and per record IVs.
+   * @throws runtime_error If a problem occurs or the cipher is an
+   *                       AEAD cipher.
+   */
+  void encrypt_batch(const std::vector<std::string>& records,
+		     std::vector<std::string>& out,
+		     const std::string& pass="",
+		     const std::string& salt="",
+		     bool shared=false) const;
+
+  /**
+   * Decrypt many small records.
+   * It is the inverse of encrypt_batch(). The key is only derived
+   * when the salt changes from one record to the next.
+   * @param records  The ciphertext records.
+   * @param out      The plaintext records.
+   * @param pass     The passphrase.
+   * @param salt     The optional salt, ignored if it is embedded.
+   * @param shared   The records use the shared key format.
+   * @throws runtime_error If a record cannot be decrypted or the
+   *                       cipher is an AEAD cipher.
+   */
+  void decrypt_batch(const std::vector<std::string>& records,
+		     std::vector<std::string>& out,
+		     const std::string& pass="",
+		     const std::string& salt="",
+		     bool shared=false) const;
 public:
   /**
    * Base64 encode.
@@ -227,27 +889,43 @@ public:
   std::string encode_base64(uchar* ciphertext,
 			    uint   ciphertext_len) const;
   
+  /**
+   * Derive a key for encode_cipher() and decode_cipher().
+   * @param k     Set to the key, the IV and the salt.
+   * @param pass  The passphrase.
+   * @param salt  The optional salt, a random one if it is empty.
+   * @throws runtime_error If the derivation fails.
+   */
+  void make_key(Key& k,
+		const std::string& pass="",
+		const std::string& salt="") const;
+
   /**
    * Cipher encode.
+   * @param k          The key from make_key().
    * @param plaintext  ASCII data to encode.
    * @returns Binary data.
    */
-  kv1_t encode_cipher(const std::string& plaintext) const;
+  kv1_t encode_cipher(const Key& k, const std::string& plaintext) const;
   
   /**
    * Base64 decode.
    * @param mimetext  ASCII MIME text.
    * @returns Binary data.
+   * @throws runtime_error If the MIME text is not valid.
    */
   kv1_t decode_base64(const std::string& mimetext) const;
   
   /**
    * Cipher decode.
+   * @param k               The key from make_key().
    * @param ciphertext      Binary cipher text.
    * @param ciphertext_len  Length of cipher buffer.
-   * @returns The decoded ASCII string.
+   * @returns The decoded data. It is binary safe, the size of
+   *          the string is the plaintext length.
    */
-  std::string decode_cipher(uchar* ciphertext,
+  std::string decode_cipher(const Key& k,
+			    uchar* ciphertext,
 			    uint   ciphertext_len) const;
 public:
   /**
@@ -277,10 +955,26 @@ public:
    * Get the version of ssl.
    */
   static std::string get_ssl_version();
+  /**
+   * Fill a buffer with cryptographically strong random bytes.
+   *
+   * It is what the random salts, IVs and nonces come from. Small
+   * requests are served from a per-thread pool that is refilled
+   * 4K at a time so the cost of RAND_bytes() (or getrandom() if
+   * it fails) is amortized over many messages. The pool is
+   * discarded in a forked child so parent and child never share
+   * bytes.
+   * @param buf  The buffer.
+   * @param len  The number of bytes.
+   * @throws runtime_error If no random bytes are available.
+   */
+  static void random_bytes(uchar* buf, size_t len);
 public:
   /**
    * Set the internal debug flag.
-   * This is only useful for library developers.
+   * This is only useful for library developers. The debug output
+   * is only compiled in if CIPHER_DEBUG is defined, otherwise
+   * the flag is ignored.
    * @param b True for debug or false otherwise.
    */
   void debug(bool b=true) {m_debug=b;}
@@ -289,28 +983,373 @@ public:
    * @returns The current debug mode.
    */
   bool debug() const {return m_debug;}
+  /**
+   * Set the chunk size used by the streaming functions.
+   * It bounds the memory used to encrypt or decrypt a file.
+   * @param n The chunk size in bytes.
+   */
+  void chunk_size(uint n) {m_chunk_size = n ? n : CIPHER_DEFAULT_CHUNK_SIZE;}
+  /**
+   * Get the chunk size used by the streaming functions.
+   * @returns The chunk size in bytes.
+   */
+  uint chunk_size() const {return m_chunk_size;}
+  /**
+   * Attach a derived key cache.
+   * It is disabled by default.
+   * @param kc The cache or 0 to disable it.
+   */
+  void key_cache(KeyCache* kc) {m_key_cache=kc;}
+  /**
+   * Get the derived key cache.
+   * @returns The cache or 0 if it is disabled.
+   */
+  KeyCache* key_cache() const {return m_key_cache;}
+  /**
+   * Derive the key for a passphrase and salt into the key cache
+   * without encrypting anything, for example before a pool of
+   * threads starts to use the same key. It does nothing if there
+   * is no key cache.
+   * @param pass  The passphrase.
+   * @param salt  The salt, 8 characters.
+   * @throws runtime_error If the derivation fails.
+   */
+  void prefetch(const std::string& pass, const std::string& salt) const;
+  /**
+   * Set the maximum number of idle cipher contexts that are kept
+   * for reuse by encode_cipher() and decode_cipher(). Reusing a
+   * context only re-keys it which avoids the allocations of
+   * creating a new one for every message.
+   * @param n The pool size, 0 disables pooling.
+   */
+  void ctx_pool_size(uint n) {m_ctx_pool.max_size(n);}
+  /**
+   * Get the maximum number of idle cipher contexts.
+   * @returns The pool size.
+   */
+  uint ctx_pool_size() const {return m_ctx_pool.max_size();}
+  /**
+   * Get the number of cipher contexts that have been allocated.
+   * @returns The number of EVP_CIPHER_CTX_new() calls.
+   */
+  unsigned long ctx_allocs() const {return m_ctx_pool.allocs();}
+  /**
+   * Set the number of threads used by the streaming functions.
+   *
+   * Counter mode ciphers (ex. aes-256-ctr) are encrypted and
+   * decrypted in chunk_size() segments on a pool of threads,
+   * each segment starts at its own counter offset. CBC mode
+   * ciphers are decrypted in parallel, each segment uses the
+   * preceding ciphertext block as its IV. The output is the same
+   * as the serial output. Other cases ignore it.
+   * @param n The number of threads, 0 for one per CPU.
+   */
+  void threads(uint n);
+  /**
+   * Get the number of threads used by the streaming functions.
+   * @returns The number of threads.
+   */
+  uint threads() const {return m_threads;}
+  /**
+   * Overlap the I/O of the serial streaming functions with the
+   * cipher. A reader thread reads ahead and a writer thread
+   * writes behind, they exchange four chunk_size() buffers each
+   * with the caller through lock free ring buffers. The input of
+   * a memory mapped file is not piped because the kernel already
+   * reads ahead of it. The io statistics then measure how long
+   * the caller waited for the I/O threads. The default is off.
+   * @param b True to turn it on.
+   */
+  void pipeline(bool b=true) {m_pipeline=b;}
+  /**
+   * Is the streaming pipeline on?
+   * @returns True if it is on.
+   */
+  bool pipeline() const {return m_pipeline;}
+  /**
+   * Set the I/O backend of encrypt_file(), decrypt_file(),
+   * file_read() and file_write().
+   *
+   * IO_URING reads regular input files eight chunk_size()
+   * buffers ahead and writes the output files behind through a
+   * Linux io_uring with registered buffers, so the calling thread
+   * does not block on each read and write and many files can be
+   * in flight from a few threads. If io_uring is not available it
+   * falls back to pread() and pwrite(). Other input (pipes,
+   * devices) always uses the streams.
+   * @param b The backend.
+   */
+  void io(Io b) {m_io=b;}
+  /**
+   * Get the I/O backend.
+   * @returns The backend.
+   */
+  Io io() const {return m_io;}
+  /**
+   * Get the name of the I/O implementation that the file
+   * functions use.
+   * @returns "streams", "io_uring" or "pread".
+   */
+  std::string io_name() const;
+  /**
+   * Set the ciphertext format.
+   * Armored ciphertext is MIME (base64) encoded like openssl enc
+   * -a. Binary ciphertext is raw like openssl enc without -a, it
+   * is 25% smaller and avoids the encoding pass.
+   * @param b True for MIME encoded or false for binary.
+   */
+  void armor(bool b=true) {m_armor=b;}
+  /**
+   * Is the ciphertext MIME encoded?
+   * @returns The current ciphertext format.
+   */
+  bool armor() const {return m_armor;}
+  /**
+   * Set the key derivation function.
+   *
+   * The default is EVP_BytesToKey which is what openssl enc uses
+   * without -pbkdf2. PBKDF2 with the digest and count(ex. 10000)
+   * is compatible with openssl enc -pbkdf2 -iter count. scrypt and
+   * Argon2id are memory hard, their cost is set by kdf_cost().
+   * The lanes of the memory hard functions run in parallel if
+   * threads() is more than 1. The KDF is not recorded in the
+   * ciphertext, it must be the same for decryption.
+   * @param k The key derivation function.
+   * @throws runtime_error If it is not available in this OpenSSL.
+   */
+  void kdf(Kdf k);
+  /**
+   * Get the key derivation function.
+   * @returns The key derivation function.
+   */
+  Kdf kdf() const {return m_kdf;}
+  /**
+   * Set the cost of the memory hard key derivation functions.
+   * @param memory  scrypt: N, a power of 2 (def. 16384).
+   *                Argon2id: the memory in KiB (def. 65536).
+   * @param lanes   scrypt: p. Argon2id: the lanes (def. 1).
+   * @param block   scrypt: r (def. 8). Ignored by Argon2id.
+   *                scrypt uses 128 * r * N bytes for each lane that
+   *                runs at once, the total is limited to 1 GiB.
+   * @throws runtime_error If a value is out of range.
+   */
+  void kdf_cost(unsigned long long memory, uint lanes=1, uint block=8);
+  /**
+   * Get the memory cost, 0 is the default for the KDF.
+   */
+  unsigned long long kdf_memory() const {return m_kdf_memory;}
+  /**
+   * Get the number of lanes.
+   */
+  uint kdf_lanes() const {return m_kdf_lanes;}
+  /**
+   * Turn the collection of the per stage statistics on or off.
+   * It is off by default.
+   * @param b True to collect them.
+   */
+  void collect_stats(bool b=true) {m_collect_stats=b;}
+  /**
+   * Are the statistics being collected?
+   * @returns The current setting.
+   */
+  bool collect_stats() const {return m_collect_stats;}
+  /**
+   * Get the statistics collected so far.
+   * @returns The counters.
+   */
+  const Stats& stats() const {return m_stats;}
+  /**
+   * Reset the statistics.
+   */
+  void clear_stats() {m_stats.clear();}
 private:
+  /**
+   * Free list of cipher contexts. It is shared by the threads
+   * that use the Cipher object but it never blocks them: if
+   * another thread holds the list a context is allocated or
+   * freed instead.
+   */
+  class CtxPool
+  {
+  public:
+    CtxPool(uint max_size);
+    ~CtxPool();
+    /**
+     * Get a context that is initialized for a new message.
+     * @throws runtime_error If the initialization fails.
+     */
+    EVP_CIPHER_CTX* acquire(const EVP_CIPHER* cipher,
+			    const uchar* key,
+			    const uchar* iv,
+			    int enc);
+    /**
+     * Return a context to the pool.
+     * @param reuse  False if the context should be freed.
+     */
+    void release(EVP_CIPHER_CTX* ctx, bool reuse);
+    void max_size(uint n);
+    uint max_size() const {return m_max_size;}
+    unsigned long allocs() const {return m_allocs;}
+
+    /**
+     * Scoped context from the pool. The context is only reused
+     * if done() was called, errors free it.
+     */
+    class Lease
+    {
+    public:
+      Lease(CtxPool& pool,
+	    const EVP_CIPHER* cipher,
+	    const uchar* key,
+	    const uchar* iv,
+	    int enc)
+	: m_pool(pool),
+	  m_ctx(pool.acquire(cipher, key, iv, enc)),
+	  m_done(false) {}
+      ~Lease() {m_pool.release(m_ctx, m_done);}
+      EVP_CIPHER_CTX* ctx() const {return m_ctx;}
+      void done() {m_done=true;}
+    private:
+      Lease(const Lease&);
+      Lease& operator=(const Lease&);
+      CtxPool&        m_pool;
+      EVP_CIPHER_CTX* m_ctx;
+      bool            m_done;
+    };
+  private:
+    CtxPool(const CtxPool&);
+    CtxPool& operator=(const CtxPool&);
+    std::vector<EVP_CIPHER_CTX*> m_free;
+    uint                         m_max_size;
+    unsigned long                m_allocs;
+    pthread_mutex_t              m_mutex;
+  };
+private:
+  /**
+   * The state of one operation: the passphrase, the salt, the
+   * key and IV derived from them and the cipher that is used.
+   * It lives on the stack of the call so the operations do not
+   * modify the Cipher object and it can be shared by threads.
+   * The key material is zeroed by the destructor.
+   */
+  struct state_t
+  {
+    state_t(const Cipher& c);
+    ~state_t();
+    std::string       pass;
+    std::string       name;
+    const EVP_CIPHER* evp;
+    aes_salt_t        salt;
+    aes_key_t         key;
+    aes_iv_t          iv;
+  private:
+    state_t(const state_t&);
+    state_t& operator=(const state_t&);
+  };
+private:
+  /**
+   * Can the streaming functions use the parallel path?
+   * @param enc  1 to encrypt, 0 to decrypt.
+   */
+  bool parallel(int enc) const;
+  /**
+   * Get the size of a parallel segment.
+   */
+  size_t segment_size() const;
+  /**
+   * Parallel versions of encrypt_stream() and decrypt_stream().
+   */
+  void encrypt_stream_parallel(std::istream& is,
+			       std::ostream& os,
+			       const std::string& pass,
+			       const std::string& salt) const;
+  void decrypt_stream_parallel(std::istream& is,
+			       std::ostream& os,
+			       const std::string& pass,
+			       const std::string& salt) const;
+  /**
+   * Is the cipher an AEAD cipher?
+   */
+  bool aead() const;
+  /**
+   * Derive the key and IV with the selected KDF.
+   * @param st  The operation state.
+   */
+  void derive(state_t& st) const;
+  /**
+   * Describe the KDF settings for the key cache id.
+   */
+  std::string kdf_id() const;
+  /**
+   * AEAD versions of encrypt_stream() and decrypt_stream().
+   */
+  void encrypt_stream_aead(std::istream& is,
+			   std::ostream& os,
+			   const std::string& pass,
+			   const std::string& salt) const;
+  void decrypt_stream_aead(std::istream& is,
+			   std::ostream& os,
+			   const std::string& pass) const;
+  /**
+   * Encrypt with an initialized context: write the prefix and the
+   * ciphertext to out, MIME encoded one block at a time if armor()
+   * is set.
+   * @returns The output length.
+   */
+  size_t seal(EVP_CIPHER_CTX* ctx,
+	      const uchar* prefix,
+	      size_t prefix_len,
+	      const uchar* plaintext,
+	      size_t plaintext_len,
+	      uchar* out) const;
+  /**
+   * Resolve the cipher and digest names to their EVP handles.
+   * @throws runtime_error If either one does not exist.
+   */
+  void resolve();
+  /**
+   * Release the EVP handles.
+   */
+  void release();
   /**
    * Convert string salt to internal format.
+   * @param st    The operation state.
    * @param salt  The salt.
    */
-  void set_salt(const std::string& salt);
+  void set_salt(state_t& st, const std::string& salt) const;
   /**
    * Initialize the cipher: set the key and IV values.
+   * @param st    The operation state.
    * @param pass  The passphrase.
    */
-  void init(const std::string& pass);
+  void init(state_t& st, const std::string& pass) const;
+  /**
+   * Get the statistics to update.
+   * @returns 0 if they are not being collected.
+   */
+  Stats* stats_ptr() const {return m_collect_stats ? &m_stats : 0;}
   
 private:
-  std::string m_pass;
   std::string m_cipher;
   std::string m_digest;
-  aes_salt_t  m_salt;
-  aes_key_t   m_key;
-  aes_iv_t    m_iv;
+  const EVP_CIPHER* m_evp_cipher;
+  const EVP_MD*     m_evp_digest;
   uint        m_count;
+  Kdf         m_kdf;
+  unsigned long long m_kdf_memory;
+  uint        m_kdf_lanes;
+  uint        m_kdf_block;
+  uint        m_chunk_size;
+  KeyCache*   m_key_cache;
+  mutable CtxPool m_ctx_pool;
+  uint        m_threads;
+  bool        m_pipeline;
+  Io          m_io;
+  bool        m_armor;
   bool        m_embed;
   bool        m_debug;
+  bool        m_collect_stats;
+  mutable Stats m_stats;
 };
 
 #endif
@@ -19,15 +19,23 @@
 //   Temple Place, Suite 330, Boston, MA 02111-1307 USA.
 // ================================================================
 #include "cipher.h"
+#include "thread_pool.h"
 #include <cstdarg>
+#include <cerrno>
+#include <cstring> // strerror
+#include <algorithm> // sort
 #include <queue>
+#include <set>
+#include <vector>
 #include <stdexcept>
 #include <string>
 #include <sstream>
 #include <fstream>
 #include <iostream>
 #include <iomanip>
-#include <cstdlib> // exit, atoi
+#include <cstdlib> // exit, atoi, strtoull
+#include <dirent.h>
+#include <sys/stat.h>
 using namespace std;
 
 typedef unsigned int uint;
@@ -42,19 +50,38 @@ void help()
     "\tct - Cipher tool that used to encrypt or decrypt files.\n"
     "\n"
     "SYNOPSIS\n"
-    "\tct [OPTIONS]\n"
+    "\tct [OPTIONS] [FILES]\n"
     "\n"
     "DESCRIPTION\n"
     "\tEncrypt or decrypt a file.\n"
     "\n"
+    "\tIf more than one input is specified (using -i more than once,\n"
+    "\t-I, -r or FILES) the files are processed in parallel. Each\n"
+    "\tinput is written to a separate output file that is named by\n"
+    "\tappending the suffix (-S) when encrypting and stripping it\n"
+    "\twhen decrypting. If -o is specified it is the output directory\n"
+    "\tand the directory structure below -r is preserved. When a fixed\n"
+    "\tsalt is specified the key is only derived once.\n"
+    "\n"
     "OPTIONS\n"
     "\t-b, --debug\t\tTurn on internal debugging.\n"
+    "\t\t\tIt only works for the dbg/ build.\n"
+    "\n"
+    "\t-B, --binary\tThe ciphertext is binary instead of MIME encoded.\n"
+    "\t\t\tIt is the same as openssl enc without -a.\n"
     "\n"
     "\t-c NUM, --count NUM\n"
     "\t\t\tCount of number of init rounds.\n"
+    "\t\t\tFor PBKDF2 it is the number of iterations, for\n"
+    "\t\t\tArgon2id it is the number of passes.\n"
     "\n"
     "\t-C CIPHER, --cipher CIPHER\n"
     "\t\t\tThe name of the cipher to use (ex. aes-256-cbc).\n"
+    "\t\t\tThe AEAD ciphers (aes-128-gcm, aes-192-gcm,\n"
+    "\t\t\taes-256-gcm and chacha20-poly1305) write an\n"
+    "\t\t\tauthenticated, chunked format that is not\n"
+    "\t\t\topenssl compatible. It is detected when\n"
+    "\t\t\tdecrypting.\n"
     "\n"
     "\t-d, --decrypt\tDecrypt.\n"
     "\n"
@@ -65,24 +92,86 @@ void help()
     "\n"
     "\t-h\t\tThis help message.\n"
     "\n"
+    "\t-j NUM, --jobs NUM\n"
+    "\t\t\tThe number of threads to use for counter mode\n"
+    "\t\t\tciphers (ex. aes-256-ctr) and for CBC decryption.\n"
+    "\t\t\tFor multiple inputs it is the number of files that\n"
+    "\t\t\tare processed at the same time.\n"
+    "\t\t\t0 uses one per CPU.\n"
+    "\t\t\tDefault is 1.\n"
+    "\n"
+    "\t--iter NUM\tUse PBKDF2 with NUM iterations.\n"
+    "\t\t\tIt is the same as openssl enc -pbkdf2 -iter NUM.\n"
+    "\n"
     "\t-i FILE, --in FILE\n"
     "\t\t\tThe input file.\n"
+    "\t\t\tIt can be specified more than once.\n"
     "\t\t\tDefault is stdin.\n"
     "\n"
+    "\t--io-uring\tRead and write the files through a Linux io_uring\n"
+    "\t\t\twith several reads and writes in flight. It\n"
+    "\t\t\tfalls back to pread and pwrite if io_uring is\n"
+    "\t\t\tnot available.\n"
+    "\n"
+    "\t-I FILE, --in-list FILE\n"
+    "\t\t\tRead the input file names from FILE, one per line.\n"
+    "\t\t\tUse - for stdin.\n"
+    "\n"
+    "\t--kdf NAME\tThe key derivation function: bytestokey (the\n"
+    "\t\t\tdefault), pbkdf2, scrypt or argon2id. It is not\n"
+    "\t\t\trecorded in the output so it must be specified\n"
+    "\t\t\tfor decryption too.\n"
+    "\n"
+    "\t--kdf-lanes NUM\n"
+    "\t\t\tThe scrypt p or Argon2id lanes. They are derived\n"
+    "\t\t\tin parallel with -j threads. Default is 1.\n"
+    "\n"
+    "\t--kdf-memory NUM\n"
+    "\t\t\tThe scrypt N (a power of 2, default 16384) or\n"
+    "\t\t\tthe Argon2id memory in KiB (default 65536).\n"
+    "\n"
+    "\t--length NUM\tThe number of plaintext bytes to decrypt, see\n"
+    "\t\t\t--offset. Default is the rest of the file.\n"
+    "\n"
     "\t-n, --no-salt-prefix\n"
     "\t\t\tDo not embed the salt prefix.\n"
     "\t\t\tThe result will not be compatible with openssl.\n"
     "\n"
+    "\t--no-pipeline\tRead, encrypt and write on one thread. By\n"
+    "\t\t\tdefault a single input is read ahead and the\n"
+    "\t\t\toutput is written behind on separate threads so\n"
+    "\t\t\tthat the I/O overlaps the cipher.\n"
+    "\n"
+    "\t--offset NUM\tDecrypt the plaintext starting at byte NUM of\n"
+    "\t\t\tthe input file. Only the ciphertext blocks that\n"
+    "\t\t\tcover the range are read. It works for the CBC,\n"
+    "\t\t\tCTR and AEAD ciphers.\n"
+    "\n"
+    "\t--pbkdf2\tUse PBKDF2, the default count is 10000.\n"
+    "\t\t\tIt is the same as openssl enc -pbkdf2.\n"
+    "\n"
     "\t-o FILE, --out FILE\n"
     "\t\t\tThe output file.\n"
+    "\t\t\tFor multiple inputs it is the output directory.\n"
     "\t\t\tDefault is stdout.\n"
     "\n"
     "\t-p PASS, --pass PASS\n"
     "\t\t\tPassphrase.\n"
     "\n"
+    "\t-r DIR, --recursive DIR\n"
+    "\t\t\tProcess all of the regular files below DIR.\n"
+    "\n"
     "\t-s SALT, --salt SALT\n"
     "\t\t\tSalt as a string.\n"
     "\n"
+    "\t--stats\tPrint the time and the bytes processed by each stage\n"
+    "\t\t\t(key derivation, cipher, base64 and I/O) to stderr.\n"
+    "\n"
+    "\t-S SUF, --suffix SUF\n"
+    "\t\t\tThe output file name suffix for multiple inputs.\n"
+    "\t\t\tAn empty suffix overwrites the inputs.\n"
+    "\t\t\tDefault is .enc.\n"
+    "\n"
     "\t-x HEX_SALT, --hex-salt HEX_SALT\n"
     "\t\t\tSalt as hex digits (16).\n"
     "\t\t\tEach character is 2 hex digits.\n"
@@ -117,9 +206,18 @@ void help()
     "\t\t./ct.exe -d -n -s 12345678 -p foobar\n"
     "\tLorem ipsum dolor sit amet\n"
     "\n"
+    "\t% # Encrypt a large file using all of the CPUs.\n"
+    "\t% ./ct.exe -e -C aes-256-ctr -j 0 -p 'Tally Ho!' -i big.tar -o big.tar.enc\n"
+    "\n"
+    "\t% # Encrypt a directory tree 4 files at a time.\n"
+    "\t% ./ct.exe -e -j 4 -s 12345678 -p 'Tally Ho!' -r docs -o docs.enc\n"
+    "\n"
+    "\t% # Decrypt the files in place.\n"
+    "\t% ./ct.exe -d -j 4 -p 'Tally Ho!' docs.enc/*.enc\n"
+    "\n"
     "\t% # Encrypt with ct, decrypt with openssl.\n"
     "\t% ct.exe -x 0102030405060708 -D md5 -p password -i in.txt -o m.out\n"
-    "\t% openssl aes-256-cbc -d -k password -salt -S 0102030405060708 -a -md md5 -in m.out -out test.txt\n"
+    "\t% openssl aes-256-cbc -d -k password -a -md md5 -in m.out -out test.txt\n"
     "\t% diff in.txt test.txt\n"
     "\n"
     "AUTHOR\n"
@@ -173,6 +271,23 @@ uint atoh(char x)
   return 0;
 }
 
+// ================================================================
+// number
+// Parse a non-negative integer option value, exit if it is not
+// valid.
+// ================================================================
+unsigned long long number(const string& opt, const char* arg)
+{
+  char* end = 0;
+  errno = 0;
+  unsigned long long n = strtoull(arg, &end, 10);
+  if (!*arg || *end || errno || arg[0] == '-') {
+    cerr << "ERROR: invalid number '" << arg << "' for " << opt << endl;
+    exit(1);
+  }
+  return n;
+}
+
 // ================================================================
 // Arguments match.
 // ================================================================
@@ -192,6 +307,310 @@ bool match(std::string opt, ...)
   return false;
 }
 
+// ================================================================
+// Input file for the multiple file mode.
+// ================================================================
+struct item_t
+{
+  string ifn;
+  string rel;   // path relative to the output directory
+  string ofn;
+  string error;
+};
+
+// ================================================================
+// Walk a directory tree and collect the regular files.
+// Symbolic links are not followed.
+// ================================================================
+void walk(const string& root, const string& rel, vector<item_t>& items)
+{
+  string dir = rel.empty() ? root : root + "/" + rel;
+  DIR* dp = opendir(dir.c_str());
+  if (!dp) {
+    string msg = "cannot read directory: "+dir+": "+strerror(errno);
+    throw runtime_error(msg);
+  }
+  vector<string> names;
+  for(struct dirent* de=readdir(dp); de; de=readdir(dp)) {
+    string name = de->d_name;
+    if (name != "." && name != "..") {
+      names.push_back(name);
+    }
+  }
+  closedir(dp);
+  sort(names.begin(), names.end());
+
+  for(size_t i=0;i<names.size();++i) {
+    string r = rel.empty() ? names[i] : rel + "/" + names[i];
+    string fn = root + "/" + r;
+    struct stat st;
+    if (lstat(fn.c_str(), &st) != 0) {
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      walk(root, r, items);
+    }
+    else if (S_ISREG(st.st_mode)) {
+      item_t item;
+      item.ifn = fn;
+      item.rel = r;
+      items.push_back(item);
+    }
+  }
+}
+
+// ================================================================
+// Create the parent directories of a file.
+// ================================================================
+void mkdir_parents(const string& fn)
+{
+  for(size_t p=fn.find('/', 1); p != string::npos; p=fn.find('/', p+1)) {
+    string dir = fn.substr(0, p);
+    if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST) {
+      string msg = "cannot create directory: "+dir+": "+strerror(errno);
+      throw runtime_error(msg);
+    }
+  }
+}
+
+// ================================================================
+// Shared state for the multiple file workers.
+// ================================================================
+struct work_t
+{
+  vector<item_t>*   items;
+  size_t            next;
+  pthread_mutex_t   mutex;
+  Cipher::KeyCache* cache;
+  string            cipher;
+  string            digest;
+  uint              count;
+  Cipher::Kdf       kdf;
+  unsigned long long kdf_memory;
+  uint              kdf_lanes;
+  bool              embed;
+  bool              armor;
+  bool              debug;
+  bool              encrypt;
+  bool              stats;
+  Cipher::Io        io;
+  Cipher::Stats     totals;
+  string            pass;
+  string            salt;
+};
+
+// ================================================================
+// Worker that processes files until there are none left. Each
+// worker has its own Cipher object but they share the key cache.
+// ================================================================
+class file_job_t : public ThreadPool::Job
+{
+public:
+  file_job_t(work_t& w) : m_work(w) {}
+  virtual void run()
+  {
+    Cipher mgr(m_work.cipher,m_work.digest,m_work.count,m_work.embed);
+    mgr.kdf(m_work.kdf);
+    mgr.kdf_cost(m_work.kdf_memory, m_work.kdf_lanes);
+    mgr.debug(m_work.debug);
+    mgr.armor(m_work.armor);
+    mgr.key_cache(m_work.cache);
+    mgr.io(m_work.io);
+    mgr.collect_stats(m_work.stats);
+    while (true) {
+      pthread_mutex_lock(&m_work.mutex);
+      size_t k = m_work.next++;
+      pthread_mutex_unlock(&m_work.mutex);
+      if (k >= m_work.items->size()) {
+        break;
+      }
+      item_t& item = (*m_work.items)[k];
+      if (!item.error.empty()) {
+        continue; // it could not be named
+      }
+      try {
+        mkdir_parents(item.ofn);
+        if (m_work.encrypt) {
+          mgr.encrypt_file(item.ifn,item.ofn,m_work.pass,m_work.salt);
+        }
+        else {
+          mgr.decrypt_file(item.ifn,item.ofn,m_work.pass,m_work.salt);
+        }
+      }
+      catch (exception& e) {
+        item.error = e.what();
+      }
+    }
+    m_work.totals += mgr.stats();
+  }
+private:
+  work_t& m_work;
+};
+
+// ================================================================
+// Encrypt or decrypt multiple files.
+// ================================================================
+int process_files(vector<item_t>& items,
+                  const string& odir,
+                  const string& suffix,
+                  work_t& work,
+                  uint jobs,
+                  uint v)
+{
+  // Name the outputs.
+  set<string> names;
+  for(size_t i=0;i<items.size();++i) {
+    item_t& item = items[i];
+    string base = odir.empty() ? item.ifn : odir + "/" + item.rel;
+    if (work.encrypt || suffix.empty()) {
+      item.ofn = base + suffix;
+    }
+    else if (base.size() > suffix.size() &&
+             base.compare(base.size()-suffix.size(), suffix.size(), suffix) == 0) {
+      item.ofn = base.substr(0, base.size()-suffix.size());
+    }
+    else {
+      item.error = "missing suffix " + suffix;
+    }
+    if (item.error.empty() && !names.insert(item.ofn).second) {
+      item.error = "duplicate output file: " + item.ofn;
+    }
+  }
+
+  // Derive the key for a fixed salt once, before the workers start.
+  Cipher::KeyCache cache(64);
+  if (!work.salt.empty()) {
+    Cipher mgr(work.cipher,work.digest,work.count,work.embed);
+    mgr.kdf(work.kdf);
+    mgr.kdf_cost(work.kdf_memory, work.kdf_lanes);
+    mgr.threads(jobs);
+    mgr.key_cache(&cache);
+    mgr.prefetch(work.pass, work.salt);
+  }
+
+  work.items = &items;
+  work.next = 0;
+  work.cache = &cache;
+  pthread_mutex_init(&work.mutex, 0);
+  {
+    uint n = jobs ? jobs : ThreadPool::cpus();
+    if (n > items.size()) {
+      n = items.size() ? items.size() : 1;
+    }
+    ThreadPool pool(n);
+    vector<file_job_t*> workers;
+    for(uint i=0;i<n;++i) {
+      workers.push_back(new file_job_t(work));
+      pool.submit(workers.back());
+    }
+    for(uint i=0;i<n;++i) {
+      pool.wait(workers[i]);
+      delete workers[i];
+    }
+  }
+  pthread_mutex_destroy(&work.mutex);
+
+  // Report.
+  size_t failed = 0;
+  for(size_t i=0;i<items.size();++i) {
+    if (!items[i].error.empty()) {
+      cerr << "ERROR: " << items[i].ifn << ": " << items[i].error << endl;
+      ++failed;
+    }
+    else if (v > 1) {
+      cout << items[i].ifn << " -> " << items[i].ofn << endl;
+    }
+  }
+  if (v) {
+    cout << "processed " << items.size() << " files, "
+         << failed << " failed, "
+         << cache.misses() << " key derivations" << endl;
+  }
+  if (work.stats) {
+    cerr << work.totals.str();
+  }
+  return failed ? 1 : 0;
+}
+
+// ================================================================
+// Encrypt or decrypt one input.
+// ================================================================
+void run(Cipher& mgr,
+         bool encrypt,
+         const string& ifn,
+         const string& ofn,
+         const string& pass,
+         const string& salt,
+         bool range,
+         unsigned long long offset,
+         unsigned long long length)
+{
+  // A byte range only reads the blocks that cover it.
+  if (range) {
+    if (encrypt || ifn.empty()) {
+      throw runtime_error("--offset and --length need -d and an input file");
+    }
+    if (ifn == ofn) {
+      throw runtime_error("--offset and --length cannot overwrite the input file");
+    }
+    if (!ofn.empty()) {
+      mgr.decrypt_range(ifn,ofn,offset,length,pass,salt);
+      return;
+    }
+    mgr.decrypt_range(ifn,cout,offset,length,pass,salt);
+    cout.flush();
+    if (!cout) {
+      throw runtime_error("write failed");
+    }
+    return;
+  }
+
+  // The data is streamed so that large files do not have to
+  // fit in memory. The file functions allow the input and
+  // output to be the same file and they memory map the input.
+  if (!ifn.empty() && !ofn.empty()) {
+    if (encrypt) {
+      mgr.encrypt_file(ifn,ofn,pass,salt);
+    }
+    else {
+      mgr.decrypt_file(ifn,ofn,pass,salt);
+    }
+  }
+  else if (!ifn.empty()) {
+    if (encrypt) {
+      mgr.encrypt_file(ifn,cout,pass,salt);
+    }
+    else {
+      mgr.decrypt_file(ifn,cout,pass,salt);
+    }
+    cout.flush();
+    if (!cout) {
+      throw runtime_error("write failed");
+    }
+  }
+  else {
+    ofstream ofs;
+    if (!ofn.empty()) {
+      ofs.open(ofn.c_str(), ios::out | ios::binary);
+      if (!ofs) {
+	string msg = "cannot write file: "+ofn;
+	throw runtime_error(msg);
+      }
+    }
+    ostream& os = ofn.empty() ? cout : ofs;
+    if (encrypt) {
+      mgr.encrypt_stream(cin,os,pass,salt);
+    }
+    else {
+      mgr.decrypt_stream(cin,os,pass,salt);
+    }
+    os.flush();
+    if (!os) {
+      throw runtime_error("write failed");
+    }
+  }
+}
+
 // ================================================================
 // MAIN
 // ================================================================
@@ -199,15 +618,32 @@ int main(int argc,char** argv)
 {
   string ifn;
   string ofn;
+  vector<string> ifns;
+  string ilist;
+  string rdir;
+  string suffix=".enc";
+  bool   multi = false;
   string pass;
   string salt;
   string cipher=CIPHER_DEFAULT_CIPHER;
   string digest=CIPHER_DEFAULT_DIGEST;
   uint   count=CIPHER_DEFAULT_COUNT;
+  bool   count_set = false;
+  string kdf;
+  unsigned long long kdf_memory = 0;
+  uint   kdf_lanes = 1;
+  uint   jobs=1;
   uint   v=0;
   bool   debug = false;
   bool   encrypt = true;
   bool   embed = true;
+  bool   armor = true;
+  bool   stats = false;
+  bool   pipeline = true;
+  Cipher::Io io = Cipher::IO_STREAMS;
+  bool   range = false;
+  unsigned long long offset = 0;
+  unsigned long long length = (unsigned long long)-1;
 
   queue<string> cache;
   int i = 1;
@@ -223,6 +659,14 @@ int main(int argc,char** argv)
       increment = true;
     }
 
+    // Anything that is not an option is an input file.
+    if (opt.size() > 0 and opt[0] != '-') {
+      ifns.push_back(opt);
+      multi = true;
+      i++;
+      continue;
+    }
+
     // Create the new (pseudo) option strings.
     if (opt.size() > 2 and opt[1] != '-') {
       for(uint j=1; j<opt.size(); j++) {
@@ -238,16 +682,31 @@ int main(int argc,char** argv)
     // Allow both long and short form specifications.
     if (match(opt, "-h", "--help", 0)) { help(); }
     else if (match(opt, "-b", "--debug", 0)) { debug = true; }
-    else if (match(opt, "-c", "--count", 0)) { CHK_ARG count = atoi(argv[i]);}
+    else if (match(opt, "-B", "--binary", 0)) { armor = false; }
+    else if (match(opt, "-c", "--count", 0)) { CHK_ARG count = atoi(argv[i]); count_set = true; }
     else if (match(opt, "-C", "--cipher", 0)) { CHK_ARG cipher = argv[i];}
     else if (match(opt, "-d", "--decrypt", 0)) { encrypt = false; }
     else if (match(opt, "-D", "--digest", 0)) { CHK_ARG digest = argv[i];}
     else if (match(opt, "-e", "--encrypt", 0)) { encrypt = true; }
-    else if (match(opt, "-i", "--in", 0)) { CHK_ARG ifn = argv[i];}
+    else if (match(opt, "--iter", 0)) { CHK_ARG count = number(opt, argv[i]); count_set = true; kdf = "pbkdf2"; }
+    else if (match(opt, "-i", "--in", 0)) { CHK_ARG ifns.push_back(argv[i]);}
+    else if (match(opt, "--io-uring", 0)) { io = Cipher::IO_URING; }
+    else if (match(opt, "-I", "--in-list", 0)) { CHK_ARG ilist = argv[i]; multi = true; }
+    else if (match(opt, "-j", "--jobs", 0)) { CHK_ARG jobs = atoi(argv[i]);}
+    else if (match(opt, "--kdf", 0)) { CHK_ARG kdf = argv[i]; }
+    else if (match(opt, "--kdf-lanes", 0)) { CHK_ARG kdf_lanes = number(opt, argv[i]); }
+    else if (match(opt, "--kdf-memory", 0)) { CHK_ARG kdf_memory = number(opt, argv[i]); }
+    else if (match(opt, "--length", 0)) { CHK_ARG length = number(opt, argv[i]); range = true; }
     else if (match(opt, "-n", "--no-salt-prefix", 0)) { embed = false; }
+    else if (match(opt, "--no-pipeline", 0)) { pipeline = false; }
+    else if (match(opt, "--offset", 0)) { CHK_ARG offset = number(opt, argv[i]); range = true; }
+    else if (match(opt, "--pbkdf2", 0)) { kdf = "pbkdf2"; }
     else if (match(opt, "-o", "--out", 0)) { CHK_ARG ofn = argv[i]; }
     else if (match(opt, "-p", "--pass", 0)) { CHK_ARG pass = argv[i]; }
+    else if (match(opt, "-r", "--recursive", 0)) { CHK_ARG rdir = argv[i]; multi = true; }
     else if (match(opt, "-s", "--salt", 0)) { CHK_ARG salt = argv[i]; }
+    else if (match(opt, "-S", "--suffix", 0)) { CHK_ARG suffix = argv[i]; }
+    else if (match(opt, "--stats", 0)) { stats = true; }
     else if (match(opt, "-v", "--verbose", 0)) { ++v; }
     else if (match(opt, "-V", "--version", 0)) {
       cout << "Cipher version: " << Cipher::get_version() << endl;
@@ -293,6 +752,32 @@ int main(int argc,char** argv)
     }
   }
 
+  if (ifns.size() > 1) {
+    multi = true;
+  }
+  else if (ifns.size() == 1) {
+    ifn = ifns[0];
+  }
+
+  // The names are the ones that openssl uses.
+  Cipher::Kdf ekdf = Cipher::BYTES_TO_KEY;
+  if (kdf == "pbkdf2") {
+    ekdf = Cipher::PBKDF2;
+    if (!count_set) {
+      count = 10000; // the openssl enc -pbkdf2 default
+    }
+  }
+  else if (kdf == "scrypt") {
+    ekdf = Cipher::SCRYPT;
+  }
+  else if (kdf == "argon2id") {
+    ekdf = Cipher::ARGON2ID;
+  }
+  else if (!kdf.empty() && kdf != "bytestokey") {
+    cerr << "ERROR: unknown key derivation function " << kdf << endl;
+    exit(1);
+  }
+
   // Print out some useful information.
   if (v) {
     PKV(ifn);
@@ -302,66 +787,95 @@ int main(int argc,char** argv)
     PKV(cipher);
     PKV(digest);
     PKV(count);
+    PKV(kdf);
+    PKV(jobs);
+    PKV(armor);
     PKV(debug);
   }
 
-  try {
-    // Collect the input data.
-    string in;
-    if (ifn.empty()) {
-      string x((istreambuf_iterator<char>(cin)),
-	       istreambuf_iterator<char>());
-      in = x;
-    }
-    else {
-      ifstream ifs(ifn.c_str());
-      if (!ifs) {
-	string msg = "cannot read file: "+ifn;
-	throw runtime_error(msg);
+  if (multi) {
+    vector<item_t> items;
+    try {
+      for(size_t j=0;j<ifns.size();++j) {
+        item_t item;
+        item.ifn = ifns[j];
+        item.rel = ifns[j].substr(ifns[j].rfind('/')+1);
+        items.push_back(item);
+      }
+      if (!ilist.empty()) {
+        ifstream ifs;
+        if (ilist != "-") {
+          ifs.open(ilist.c_str());
+          if (!ifs) {
+            string msg = "cannot read file: "+ilist;
+            throw runtime_error(msg);
+          }
+        }
+        istream& is = ilist == "-" ? cin : ifs;
+        string line;
+        while (getline(is, line)) {
+          if (!line.empty()) {
+            item_t item;
+            item.ifn = line;
+            item.rel = line.substr(line.rfind('/')+1);
+            items.push_back(item);
+          }
+        }
       }
-      string x((istreambuf_iterator<char>(ifs)),
-	       istreambuf_iterator<char>());
-      ifs.close();
-      in = x;
+      if (!rdir.empty()) {
+        walk(rdir, "", items);
+      }
+    }
+    catch (exception& e) {
+      cerr << "ERROR: " << e.what() << endl;
+      return 1;
     }
-    if (v) {
-      cout << "input: (" << in.size() << ")" << endl;
-      cout << "<begin>" << endl;
-      cout << in << endl;
-      cout << "<endl>" << endl;
+
+    work_t work;
+    work.cipher = cipher;
+    work.digest = digest;
+    work.count = count;
+    work.kdf = ekdf;
+    work.kdf_memory = kdf_memory;
+    work.kdf_lanes = kdf_lanes;
+    work.embed = embed;
+    work.armor = armor;
+    work.debug = debug;
+    work.encrypt = encrypt;
+    work.stats = stats;
+    work.io = io;
+    work.pass = pass;
+    work.salt = salt;
+    try {
+      return process_files(items, ofn, suffix, work, jobs, v);
     }
-    if (in.empty()) {
-      throw runtime_error("zero length input is not supported");
+    catch (exception& e) {
+      cerr << "ERROR: " << e.what() << endl;
+      return 1;
     }
+  }
 
+  try {
     Cipher mgr(cipher,digest,count,embed);
+    mgr.kdf(ekdf);
+    mgr.kdf_cost(kdf_memory, kdf_lanes);
     mgr.debug(debug);
-    string out;
-    if (encrypt) {
-      out = mgr.encrypt(in,pass,salt);
+    mgr.threads(jobs);
+    mgr.pipeline(pipeline);
+    mgr.io(io);
+    mgr.armor(armor);
+    mgr.collect_stats(stats);
+    try {
+      run(mgr, encrypt, ifn, ofn, pass, salt, range, offset, length);
     }
-    else {
-      out = mgr.decrypt(in,pass,salt);
-    }
-
-    // Write the output data.
-    if (ofn.empty()) {
-      cout << out;
-      if (encrypt) {
-	cout << endl;
+    catch (...) {
+      if (stats) {
+        cerr << mgr.stats().str();
       }
+      throw;
     }
-    else {
-      ofstream ofs(ofn.c_str());
-      if (!ofs) {
-	string msg = "cannot write file: "+ofn;
-	throw runtime_error(msg);
-      }
-      ofs << out;
-      if (encrypt) {
-	ofs << endl;
-      }
-      ofs.close();
+    if (stats) {
+      cerr << mgr.stats().str();
     }
   }
   catch (exception& e) {
@@ -5,14 +5,24 @@
 // Author:      Joe Linoff
 // ================================================================
 #include "cipher.h"
+#include "base64.h"
+#include "thread_pool.h"
+#include "async_io.h"
 #include <string>
 #include <vector>
+#include <set>
 #include <stdexcept>
 #include <fstream>
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 #include <cstdlib> // exit, atoi
 #include <cstdio>
+#include <cstring> // memcmp
+#include <cctype>  // isalnum
+#include <fcntl.h>  // open
+#include <unistd.h> // access, close, fork
+#include <sys/wait.h> // waitpid
 using namespace std;
 
 // ================================================================
@@ -272,6 +282,1822 @@ void test_cipher4(pair<int,int>& st,int v)
  
 }
 
+// ================================================================
+// test_cipher5 - stream a file in small chunks.
+// ================================================================
+void test_cipher5(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 5" << endl;
+  }
+  string pass  = "Tally Ho!";
+  string salt  = "12345678"; // must be 8 characters
+  string ifn = "test_cipher5.txt";
+  string efn = "test_cipher5.dat";
+  string dfn = "test_cipher5.out";
+
+  // Make the plaintext larger than several chunks and
+  // not a multiple of the chunk or block size.
+  string plaintext;
+  for(uint i=0;i<200;++i) {
+    plaintext += "Lorem ipsum dolor sit amet, consectetur adipiscing elit.\n";
+  }
+  plaintext += "tail";
+
+  ofstream ofs(ifn.c_str());
+  ofs << plaintext;
+  ofs.close();
+
+  // The streamed file must match the in memory result.
+  Cipher c1;
+  string ciphertext = c1.encrypt(plaintext,pass,salt) + "\n";
+
+  Cipher c;
+  if (v>1) {
+    c.debug();
+  }
+  c.chunk_size(7);
+  c.encrypt_file(ifn,efn,pass,salt);
+  c.chunk_size(61);
+  c.decrypt_file(efn,dfn,pass);
+
+  ifstream ifs1(efn.c_str());
+  string str1((istreambuf_iterator<char>(ifs1)),
+	      istreambuf_iterator<char>());
+  ifs1.close();
+  ifstream ifs2(dfn.c_str());
+  string str2((istreambuf_iterator<char>(ifs2)),
+	      istreambuf_iterator<char>());
+  ifs2.close();
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test5:\t";
+  if (ciphertext == str1 && plaintext == str2) {
+    cout << "passed";
+    remove(ifn.c_str());
+    remove(efn.c_str());
+    remove(dfn.c_str());
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
+// ================================================================
+// test_cipher6 - incremental encrypt and decrypt.
+// ================================================================
+void test_cipher6(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 6" << endl;
+  }
+  string pass  = "Tally Ho!";
+  string salt  = "12345678"; // must be 8 characters
+  string plaintext;
+  for(uint i=0;i<50;++i) {
+    plaintext += "Lorem ipsum dolor sit amet, consectetur adipiscing elit.\n";
+  }
+
+  Cipher c;
+  if (v>1) {
+    c.debug();
+  }
+
+  // Push the data in frames of varying sizes.
+  Cipher::Encryptor enc(c);
+  Cipher::StringSink ct;
+  enc.begin(pass, salt);
+  for(size_t i=0, n=1; i<plaintext.size(); i+=n, n=(n*3)%97+1) {
+    size_t len = min(n, plaintext.size()-i);
+    enc.update((const Cipher::uchar*)plaintext.data()+i, len, ct);
+  }
+  enc.finish(ct);
+
+  // It must match the one-shot result.
+  Cipher c1;
+  Cipher::kv1_t x = c1.decode_base64(c1.encrypt(plaintext,pass,salt));
+  string expected((const char*)x.first, x.second);
+  delete [] x.first;
+
+  // Decrypt one byte at a time.
+  Cipher::Decryptor dec(c);
+  Cipher::StringSink pt;
+  dec.begin(pass);
+  for(size_t i=0; i<ct.str().size(); ++i) {
+    dec.update((const Cipher::uchar*)ct.str().data()+i, 1, pt);
+  }
+  dec.finish(pt);
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test6:\t";
+  if (ct.str() == expected && pt.str() == plaintext) {
+    cout << "passed";
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
+// ================================================================
+// test_cipher7 - derived key cache.
+// ================================================================
+void test_cipher7(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 7" << endl;
+  }
+  string pass  = "Tally Ho!";
+  string plaintext = "Lorem ipsum dolor sit amet, consectetur adipiscing elit.";
+
+  Cipher c("aes-256-cbc", "sha256", 1000);
+  if (v>1) {
+    c.debug();
+  }
+  string ct1 = c.encrypt(plaintext, pass, "12345678");
+  string ct2 = c.encrypt(plaintext, pass, "ABCDEFGH");
+  string ct3 = c.encrypt(plaintext, pass, "abcdefgh");
+
+  // Repeated decryptions of the same salt hit the cache.
+  Cipher::KeyCache cache(2);
+  c.key_cache(&cache);
+  bool ok = true;
+  for(uint i=0;i<3;++i) {
+    ok = ok && c.decrypt(ct1, pass) == plaintext;
+  }
+  ok = ok && cache.hits() == 2 && cache.misses() == 1;
+
+  // The least recently used entry is evicted.
+  ok = ok && c.decrypt(ct2, pass) == plaintext;
+  ok = ok && c.decrypt(ct3, pass) == plaintext;
+  ok = ok && c.decrypt(ct2, pass) == plaintext;
+  ok = ok && c.decrypt(ct1, pass) == plaintext;
+  ok = ok && cache.size() == 2 && cache.hits() == 3 && cache.misses() == 4;
+
+  // A different passphrase must not hit.
+  string bad;
+  try {
+    bad = c.decrypt(ct1, "wrong");
+  }
+  catch (exception& e) {
+  }
+  ok = ok && bad != plaintext && cache.misses() == 5;
+
+  // prefetch() fills the cache for an AEAD cipher too.
+  Cipher g("aes-256-gcm", "sha256", 1000);
+  Cipher::KeyCache gcache(2);
+  g.key_cache(&gcache);
+  g.prefetch(pass, "12345678");
+  ok = ok && gcache.size() == 1 && gcache.misses() == 1;
+  ok = ok && g.decrypt(g.encrypt(plaintext, pass, "12345678"), pass) == plaintext;
+  ok = ok && gcache.misses() == 1 && gcache.hits() == 2;
+  if (v) {
+    PKV(cache.hits());
+    PKV(cache.misses());
+  }
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test7:\t";
+  if (ok) {
+    cout << "passed";
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
+// ================================================================
+// test_cipher8 - the configured cipher is used.
+// ================================================================
+void test_cipher8(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 8" << endl;
+  }
+  string pass  = "Tally Ho!";
+  string salt  = "12345678"; // must be 8 characters
+  string plaintext = "Lorem ipsum dolor sit amet, consectetur adipiscing elit.";
+
+  const char* ciphers[] = {"aes-128-cbc", "aes-192-cbc", "aes-128-ctr", "aes-256-ctr", 0};
+  Cipher c0;
+  string ct0 = c0.encrypt(plaintext, pass, salt);
+  bool ok = true;
+  for(const char** p=ciphers; *p; ++p) {
+    Cipher c(*p, "sha256");
+    if (v>1) {
+      c.debug();
+    }
+    string ct = c.encrypt(plaintext, pass, salt);
+    string pt = c.decrypt(ct, pass);
+    if (v) {
+      PKV(*p);
+      PKV(ct);
+    }
+    ok = ok && ct != ct0 && pt == plaintext;
+  }
+
+  // Unknown names are reported by the constructor.
+  try {
+    Cipher c("no-such-cipher", "sha256");
+    ok = false;
+  }
+  catch (exception& e) {
+  }
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test8:\t";
+  if (ok) {
+    cout << "passed";
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
+// ================================================================
+// test_cipher9 - parallel counter mode files.
+// ================================================================
+void test_cipher9(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 9" << endl;
+  }
+  string pass  = "Tally Ho!";
+  string salt  = "12345678"; // must be 8 characters
+  string ifn = "test_cipher9.txt";
+  string efn = "test_cipher9.dat";
+  string dfn = "test_cipher9.out";
+  string plaintext;
+  for(uint i=0;i<300;++i) {
+    plaintext += "Lorem ipsum dolor sit amet, consectetur adipiscing elit.\n";
+  }
+  plaintext += "tail";
+  ofstream ofs(ifn.c_str());
+  ofs << plaintext;
+  ofs.close();
+
+  bool ok = true;
+  for(uint embed=0;embed<2;++embed) {
+    // The parallel output must match the serial output.
+    Cipher c1("aes-256-ctr", "sha256", 1, embed);
+    string ciphertext = c1.encrypt(plaintext,pass,salt) + "\n";
+
+    Cipher c("aes-256-ctr", "sha256", 1, embed);
+    if (v>1) {
+      c.debug();
+    }
+    c.threads(4);
+    c.chunk_size(100); // many small segments
+    c.encrypt_file(ifn,efn,pass,salt);
+    c.decrypt_file(efn,dfn,pass,salt);
+
+    ifstream ifs1(efn.c_str());
+    string str1((istreambuf_iterator<char>(ifs1)),
+		istreambuf_iterator<char>());
+    ifs1.close();
+    ifstream ifs2(dfn.c_str());
+    string str2((istreambuf_iterator<char>(ifs2)),
+		istreambuf_iterator<char>());
+    ifs2.close();
+    ok = ok && ciphertext == str1 && plaintext == str2;
+  }
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test9:\t";
+  if (ok) {
+    cout << "passed";
+    remove(ifn.c_str());
+    remove(efn.c_str());
+    remove(dfn.c_str());
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
+// ================================================================
+// test_cipher10 - parallel CBC decryption.
+// ================================================================
+void test_cipher10(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 10" << endl;
+  }
+  string pass  = "Tally Ho!";
+  string efn = "test_cipher10.dat";
+  string dfn = "test_cipher10.out";
+  bool ok = true;
+
+  // Try sizes around the segment and block boundaries.
+  size_t sizes[] = {0, 1, 15, 16, 17, 80, 95, 96, 97, 1000, 4099};
+  for(uint i=0;i<sizeof(sizes)/sizeof(sizes[0]);++i) {
+    string plaintext;
+    for(size_t j=0;j<sizes[i];++j) {
+      plaintext += char('a' + (j*7)%26);
+    }
+    Cipher c1;
+    string ciphertext = c1.encrypt(plaintext,pass) + "\n";
+    ofstream ofs(efn.c_str());
+    ofs << ciphertext;
+    ofs.close();
+
+    Cipher c;
+    if (v>1) {
+      c.debug();
+    }
+    c.threads(3);
+    c.chunk_size(100); // many small segments
+    c.decrypt_file(efn,dfn,pass);
+
+    ifstream ifs(dfn.c_str());
+    string str((istreambuf_iterator<char>(ifs)),
+	       istreambuf_iterator<char>());
+    ifs.close();
+    if (v) {
+      PKV(sizes[i]);
+      PKV(str.size());
+    }
+    ok = ok && plaintext == str;
+  }
+
+  // A bad passphrase is caught by the padding check on the
+  // last segment.
+  Cipher c;
+  c.threads(3);
+  c.chunk_size(100);
+  try {
+    c.decrypt_file(efn,dfn,"wrong");
+    ok = false;
+  }
+  catch (exception& e) {
+  }
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test10:\t";
+  if (ok) {
+    cout << "passed";
+    remove(efn.c_str());
+    remove(dfn.c_str());
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
+// ================================================================
+// test_cipher11 - binary ciphertext.
+// ================================================================
+void test_cipher11(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 11" << endl;
+  }
+  string pass  = "Tally Ho!";
+  string salt  = "12345678"; // must be 8 characters
+  string ifn = "test_cipher11.txt";
+  string efn = "test_cipher11.dat";
+  string dfn = "test_cipher11.out";
+  string plaintext;
+  for(uint i=0;i<100;++i) {
+    plaintext += "Lorem ipsum dolor sit amet, consectetur adipiscing elit.\n";
+  }
+  ofstream ofs(ifn.c_str());
+  ofs << plaintext;
+  ofs.close();
+
+  // The binary ciphertext is the decoded armored ciphertext.
+  Cipher c1;
+  Cipher::kv1_t x = c1.decode_base64(c1.encrypt(plaintext,pass,salt));
+  string expected((const char*)x.first, x.second);
+  delete [] x.first;
+
+  Cipher c;
+  if (v>1) {
+    c.debug();
+  }
+  c.armor(false);
+  string ciphertext = c.encrypt(plaintext,pass,salt);
+  bool ok = ciphertext == expected && c.decrypt(ciphertext,pass) == plaintext;
+
+  // Same for the streaming functions, serial and parallel.
+  c.chunk_size(100);
+  c.encrypt_file(ifn,efn,pass,salt);
+  ifstream ifs1(efn.c_str(), ios::binary);
+  string str1((istreambuf_iterator<char>(ifs1)),
+	      istreambuf_iterator<char>());
+  ifs1.close();
+  ok = ok && str1 == expected;
+  for(uint t=1;t<=3;t+=2) {
+    c.threads(t);
+    c.decrypt_file(efn,dfn,pass);
+    ifstream ifs2(dfn.c_str());
+    string str2((istreambuf_iterator<char>(ifs2)),
+		istreambuf_iterator<char>());
+    ifs2.close();
+    ok = ok && str2 == plaintext;
+  }
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test11:\t";
+  if (ok) {
+    cout << "passed";
+    remove(ifn.c_str());
+    remove(efn.c_str());
+    remove(dfn.c_str());
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
+// ================================================================
+// test_cipher12 - plaintext with NUL bytes.
+// ================================================================
+void test_cipher12(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 12" << endl;
+  }
+  string pass  = "Tally Ho!";
+  string ifn = "test_cipher12.bin";
+  string efn = "test_cipher12.dat";
+  string dfn = "test_cipher12.out";
+  string plaintext;
+  for(uint i=0;i<1000;++i) {
+    plaintext += char((i * 37) % 256); // includes zeros
+  }
+  ofstream ofs(ifn.c_str(), ios::binary);
+  ofs << plaintext;
+  ofs.close();
+
+  bool ok = true;
+  for(uint armor=0;armor<2;++armor) {
+    Cipher c;
+    if (v>1) {
+      c.debug();
+    }
+    c.armor(armor);
+    ok = ok && c.decrypt(c.encrypt(plaintext,pass),pass) == plaintext;
+    c.encrypt_file(ifn,efn,pass);
+    c.decrypt_file(efn,dfn,pass);
+    ifstream ifs(dfn.c_str(), ios::binary);
+    string str((istreambuf_iterator<char>(ifs)),
+	       istreambuf_iterator<char>());
+    ifs.close();
+    ok = ok && str == plaintext;
+  }
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test12:\t";
+  if (ok) {
+    cout << "passed";
+    remove(ifn.c_str());
+    remove(efn.c_str());
+    remove(dfn.c_str());
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
+// ================================================================
+// test_cipher13
+// ================================================================
+void test_cipher13(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 13" << endl;
+  }
+  string pass = "Tally Ho!";
+  string salt = "12345678";
+  const char* ciphers[] = {"aes-256-cbc", "aes-128-ctr"};
+  uint sizes[] = {0, 1, 15, 16, 31, 32, 47, 48, 100, 3000, 10000};
+
+  bool ok = true;
+  for(uint i=0;i<2;++i) {
+    for(uint armor=0;armor<2;++armor) {
+      for(uint j=0;j<sizeof(sizes)/sizeof(sizes[0]);++j) {
+	Cipher c(ciphers[i], "sha256");
+	if (v>1) {
+	  c.debug();
+	}
+	c.armor(armor);
+	string plaintext;
+	for(uint k=0;k<sizes[j];++k) {
+	  plaintext += char((k * 37) % 256);
+	}
+	// The buffer output must match the string output.
+	vector<Cipher::uchar> ct(c.max_output_size(plaintext.size()));
+	size_t ctlen = c.encrypt((const Cipher::uchar*)plaintext.data(),
+				 plaintext.size(),
+				 ct.empty() ? 0 : &ct[0], ct.size(),
+				 pass, salt);
+	string expected = c.encrypt(plaintext, pass, salt);
+	ok = ok && string((char*)&ct[0], ctlen) == expected;
+
+	vector<Cipher::uchar> pt(c.max_output_size(ctlen, false) + 1);
+	size_t ptlen = c.decrypt(&ct[0], ctlen, &pt[0], pt.size(), pass);
+	ok = ok && string((char*)&pt[0], ptlen) == plaintext;
+	if (v && !ok) {
+	  cout << DBG_PRE << ciphers[i] << " " << armor << " " << sizes[j] << endl;
+	  break;
+	}
+      }
+    }
+  }
+
+  // A short output buffer is rejected.
+  try {
+    Cipher c;
+    Cipher::uchar out[16];
+    c.encrypt((const Cipher::uchar*)"abc", 3, out, sizeof(out), pass);
+    ok = false;
+  }
+  catch (exception&) {
+  }
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test13:\t";
+  if (ok) {
+    cout << "passed";
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
+// ================================================================
+// test_cipher14
+// ================================================================
+void test_cipher14(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 14" << endl;
+  }
+  typedef Base64::uchar uchar;
+  bool ok = true;
+
+  // Every implementation must match the scalar one and openssl.
+  Base64::Impl impls[] = {Base64::SCALAR, Base64::SSE41, Base64::AVX2};
+  uint sizes[] = {0, 1, 2, 3, 47, 48, 49, 51, 52, 53, 95, 96, 100, 1000, 4099};
+  for(uint i=0;i<sizeof(impls)/sizeof(impls[0]);++i) {
+    if (!Base64::select(impls[i])) {
+      continue;
+    }
+    if (v) {
+      cout << DBG_PRE << "impl: " << Base64::impl() << endl;
+    }
+    for(uint j=0;j<sizeof(sizes)/sizeof(sizes[0]);++j) {
+      vector<uchar> data(sizes[j] + 1);
+      for(uint k=0;k<sizes[j];++k) {
+	data[k] = (uchar)((k * 131 + j) % 256);
+      }
+      size_t len = sizes[j];
+      vector<uchar> mt(Base64::encode_size(len) + 1);
+      size_t mtlen = Base64::encode(&data[0], len, &mt[0]);
+
+      // EVP_EncodeUpdate()/EVP_EncodeFinal() is what openssl enc -a uses.
+      vector<uchar> ref(Base64::encode_size(len) + 80);
+      int n1 = 0;
+      int n2 = 0;
+      EVP_ENCODE_CTX* ctx = EVP_ENCODE_CTX_new();
+      EVP_EncodeInit(ctx);
+      if (len) {
+	EVP_EncodeUpdate(ctx, &ref[0], &n1, &data[0], len);
+      }
+      EVP_EncodeFinal(ctx, &ref[n1], &n2);
+      EVP_ENCODE_CTX_free(ctx);
+      ok = ok && mtlen == size_t(n1 + n2) && memcmp(&mt[0], &ref[0], mtlen) == 0;
+
+      // Decode in one piece and in odd sized pieces.
+      for(uint piece=1;piece<=mtlen+1;piece+=(piece < 8 ? 1 : 61)) {
+	Base64::Decoder dec;
+	vector<uchar> out(Base64::decode_size(mtlen) + 8);
+	size_t n = 0;
+	for(size_t off=0;off<mtlen;off+=piece) {
+	  size_t k = mtlen - off < piece ? mtlen - off : piece;
+	  n += dec.decode(&mt[off], k, &out[n]);
+	}
+	n += dec.finish(&out[n]);
+	ok = ok && n == len && memcmp(&out[0], &data[0], len) == 0;
+      }
+    }
+
+    // Each byte value in the middle of a long line is either
+    // decoded, skipped (white space) or rejected.
+    for(uint c=0;c<256;++c) {
+      string str(128, 'A');
+      str[70] = (char)c;
+      bool alpha = isalnum(c) || c == '+' || c == '/';
+      bool space = c == ' ' || c == '\t' || c == '\r' || c == '\n';
+      vector<uchar> out(Base64::decode_size(str.size()));
+      bool valid = true;
+      try {
+	Base64::Decoder dec;
+	size_t n = dec.decode((const uchar*)str.data(), str.size(), &out[0]);
+	n += dec.finish(&out[n]);
+      }
+      catch (exception&) {
+	valid = false;
+      }
+      if (valid != (alpha || space)) {
+	if (v) {
+	  cout << DBG_PRE << "byte: " << c << endl;
+	}
+	ok = false;
+      }
+    }
+  }
+  Base64::select(Base64::AUTO);
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test14:\t";
+  if (ok) {
+    cout << "passed";
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
+// ================================================================
+// test_cipher15
+// ================================================================
+void test_cipher15(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 15" << endl;
+  }
+  string pass = "Tally Ho!";
+  string salt = "12345678";
+  string ifn = "test_cipher15.bin";
+  string efn = "test_cipher15.dat";
+  string dfn = "test_cipher15.out";
+  string plaintext;
+  for(uint i=0;i<300000;++i) {
+    plaintext += char((i * 7 + i / 256) % 256);
+  }
+  ofstream ofs(ifn.c_str(), ios::binary);
+  ofs << plaintext;
+  ofs.close();
+
+  // The memory mapped file paths (serial and parallel) must
+  // match the stream paths.
+  bool ok = true;
+  const char* ciphers[] = {"aes-256-cbc", "aes-256-ctr"};
+  for(uint i=0;i<2;++i) {
+    for(uint armor=0;armor<2;++armor) {
+      for(uint threads=1;threads<=4;threads+=3) {
+	Cipher c(ciphers[i], "sha256");
+	if (v>1) {
+	  c.debug();
+	}
+	c.armor(armor);
+	c.threads(threads);
+	c.chunk_size(16*1024);
+	c.encrypt_file(ifn,efn,pass,salt);
+	c.decrypt_file(efn,dfn,pass);
+	ok = ok && c.file_read(dfn) == plaintext;
+
+	ifstream ifs(ifn.c_str(), ios::binary);
+	ostringstream expected;
+	c.encrypt_stream(ifs,expected,pass,salt);
+	ostringstream ct;
+	c.encrypt_file(ifn,ct,pass,salt);
+	ok = ok && ct.str() == expected.str() && c.file_read(efn) == ct.str();
+
+	ostringstream pt;
+	c.decrypt_file(efn,pt,pass);
+	ok = ok && pt.str() == plaintext;
+	if (v && !ok) {
+	  cout << DBG_PRE << ciphers[i] << " " << armor << " " << threads << endl;
+	  break;
+	}
+      }
+    }
+  }
+
+  // Devices cannot be mapped, they are read.
+  {
+    Cipher c;
+    ostringstream ct;
+    c.encrypt_file("/dev/null",ct,pass);
+    ok = ok && c.decrypt(ct.str(),pass).empty() && c.file_read("/dev/null").empty();
+  }
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test15:\t";
+  if (ok) {
+    cout << "passed";
+    remove(ifn.c_str());
+    remove(efn.c_str());
+    remove(dfn.c_str());
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
+// ================================================================
+// test_cipher16
+// ================================================================
+void test_cipher16(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 16" << endl;
+  }
+  string pass = "Tally Ho!";
+  string salt = "12345678";
+  vector<string> records;
+  for(uint i=0;i<100;++i) {
+    string rec;
+    for(uint j=0;j<(i * 13) % 300;++j) {
+      rec += char((i + j * 7) % 256);
+    }
+    records.push_back(rec);
+  }
+  records.push_back(records[5]); // duplicate
+
+  bool ok = true;
+  const char* ciphers[] = {"aes-256-cbc", "aes-128-ctr"};
+  for(uint i=0;i<2;++i) {
+    for(uint armor=0;armor<2;++armor) {
+      Cipher c(ciphers[i], "sha256");
+      if (v>1) {
+	c.debug();
+      }
+      c.armor(armor);
+      vector<string> ct;
+      vector<string> pt;
+
+      // Compatible records, with and without a fixed salt.
+      c.encrypt_batch(records, ct, pass, salt);
+      for(size_t j=0;j<records.size();++j) {
+	ok = ok && ct[j] == c.encrypt(records[j], pass, salt);
+      }
+      c.encrypt_batch(records, ct, pass);
+      for(size_t j=0;j<records.size();++j) {
+	ok = ok && c.decrypt(ct[j], pass) == records[j];
+      }
+      c.decrypt_batch(ct, pt, pass);
+      ok = ok && pt == records;
+
+      // Shared key records, the IVs differ so duplicates do not.
+      c.encrypt_batch(records, ct, pass, "", true);
+      ok = ok && ct[5] != ct.back();
+      c.decrypt_batch(ct, pt, pass, "", true);
+      ok = ok && pt == records;
+      if (v && !ok) {
+	cout << DBG_PRE << ciphers[i] << " " << armor << endl;
+	break;
+      }
+    }
+  }
+
+  // A bad record is reported.
+  try {
+    Cipher c;
+    vector<string> ct(1, "short");
+    vector<string> pt;
+    c.armor(false);
+    c.decrypt_batch(ct, pt, pass, "", true);
+    ok = false;
+  }
+  catch (exception&) {
+  }
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test16:\t";
+  if (ok) {
+    cout << "passed";
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
+// ================================================================
+// Key cache shared by Cipher objects in several threads.
+// ================================================================
+class key_cache_job_t : public ThreadPool::Job
+{
+public:
+  key_cache_job_t(Cipher::KeyCache& kc, uint id) : m_kc(kc), m_id(id), m_ok(false) {}
+  virtual void run()
+  {
+    Cipher c;
+    c.key_cache(&m_kc);
+    m_ok = true;
+    for(uint i=0;i<50;++i) {
+      string pt = "record " + string(1, char('a' + (i + m_id) % 26));
+      string ct = c.encrypt(pt, "Tally Ho!", i % 2 ? "12345678" : "87654321");
+      if (c.decrypt(ct, "Tally Ho!", "") != pt) {
+	m_ok = false;
+      }
+    }
+  }
+  bool ok() const {return m_ok;}
+private:
+  Cipher::KeyCache& m_kc;
+  uint              m_id;
+  bool              m_ok;
+};
+
+void test_cipher17(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 17" << endl;
+  }
+  Cipher::KeyCache kc(8);
+  ThreadPool pool(4);
+  vector<key_cache_job_t*> jobs;
+  for(uint i=0;i<8;++i) {
+    jobs.push_back(new key_cache_job_t(kc, i));
+    pool.submit(jobs.back());
+  }
+  bool ok = true;
+  for(uint i=0;i<jobs.size();++i) {
+    pool.wait(jobs[i]);
+    ok = ok && jobs[i]->ok();
+    delete jobs[i];
+  }
+
+  // There are two salts, so there should only be a couple of
+  // derivations per salt even if the threads raced.
+  if (kc.size() != 2 || kc.misses() > 2 * 8 || kc.hits() + kc.misses() != 8 * 100) {
+    ok = false;
+  }
+  if (v) {
+    cout << DBG_PRE << "cipher_test17: hits=" << kc.hits() << " misses=" << kc.misses() << endl;
+  }
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test17:\t";
+  if (ok) {
+    cout << "passed";
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
+// ================================================================
+// Per stage statistics.
+// ================================================================
+void test_cipher18(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 18" << endl;
+  }
+  typedef Cipher::Stats S;
+  bool ok = true;
+  string pt(1000, 'x');
+
+  // Nothing is collected by default.
+  Cipher c;
+  string ct = c.encrypt(pt, "Tally Ho!");
+  for(uint i=0;i<S::STAGES;++i) {
+    if (c.stats().calls(S::Stage(i))) {
+      ok = false;
+    }
+  }
+
+  c.collect_stats();
+  ct = c.encrypt(pt, "Tally Ho!");
+  c.decrypt(ct, "Tally Ho!");
+  const S& s = c.stats();
+  if (s.calls(S::KDF) != 2 || s.calls(S::CIPHER) != 2 || s.calls(S::BASE64) != 2 ||
+      s.bytes(S::CIPHER) != 1000 + 1008 || // the padded ciphertext is 1008 bytes
+      s.bytes(S::BASE64) != 1024 + ct.size()) {
+    ok = false;
+  }
+
+  // A bad passphrase is a cipher error.
+  try {
+    c.decrypt(ct, "bad");
+  }
+  catch (exception&) {
+  }
+  if (s.errors(S::CIPHER) != 1 || s.errors(S::BASE64) != 0) {
+    ok = false;
+  }
+
+  // The parallel path updates them from the worker threads.
+  c.clear_stats();
+  c.threads(4);
+  c.chunk_size(4096);
+  string fn = "test_cipher18.txt";
+  string pt2(100000, 'y');
+  c.file_write(fn, pt2);
+  c.encrypt_file(fn, fn, "Tally Ho!");
+  c.decrypt_file(fn, fn, "Tally Ho!");
+  if (c.file_read(fn) != pt2 || s.calls(S::CIPHER) < 25 || s.errors(S::CIPHER)) {
+    ok = false;
+  }
+  remove(fn.c_str());
+  if (v) {
+    cout << s.str();
+  }
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test18:\t";
+  if (ok) {
+    cout << "passed";
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
+// ================================================================
+// Test the AEAD format: round trips with every supported
+// cipher, serial and parallel, armored and binary, detection
+// of the format on decrypt and of modified or truncated data.
+// ================================================================
+void test_cipher19(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 19" << endl;
+  }
+  bool ok = true;
+  const char* ciphers[] = {"aes-128-gcm", "aes-256-gcm", "chacha20-poly1305"};
+  string pt;
+  for(uint i=0;i<10000;++i) {
+    pt += char(i * 7 + i / 256);
+  }
+  string fn = "test_cipher19.txt";
+  for(uint i=0;i<sizeof(ciphers)/sizeof(ciphers[0]);++i) {
+    for(uint j=0;j<4;++j) {
+      Cipher c(ciphers[i], CIPHER_DEFAULT_DIGEST, CIPHER_DEFAULT_COUNT, true);
+      c.armor(j & 1);
+      c.threads(j & 2 ? 4 : 1);
+      c.chunk_size(1000);
+
+      // The default configuration decrypts it, the algorithm
+      // comes from the header.
+      Cipher d;
+      d.armor(j & 1);
+      string ct = c.encrypt(pt, "Tally Ho!");
+      if (d.decrypt(ct, "Tally Ho!") != pt || c.decrypt(ct, "Tally Ho!") != pt ||
+          c.decrypt(c.encrypt("", "Tally Ho!"), "Tally Ho!") != "" ||
+          c.decrypt(c.encrypt(pt.substr(0, 3000), "Tally Ho!"), "Tally Ho!") != pt.substr(0, 3000)) {
+        if (v) {
+          cout << DBG_PRE << ciphers[i] << " " << j << " round trip failed" << endl;
+        }
+        ok = false;
+      }
+
+      c.file_write(fn, pt);
+      c.encrypt_file(fn, fn, "Tally Ho!");
+      d.threads(c.threads());
+      d.decrypt_file(fn, fn, "Tally Ho!");
+      if (c.file_read(fn) != pt) {
+        if (v) {
+          cout << DBG_PRE << ciphers[i] << " " << j << " file round trip failed" << endl;
+        }
+        ok = false;
+      }
+
+      // Every modification is caught by the tags.
+      if (j & 1) {
+        continue;
+      }
+      string bad[4] = {ct, ct, ct, ct.substr(0, 32 + 1016 * 5)};
+      bad[0][32 + 1016 * 4 + 10] ^= 1;  // ciphertext
+      bad[1][20] ^= 1;                  // nonce
+      bad[2].erase(32 + 1016 * 2, 1016); // a dropped chunk
+      for(uint k=0;k<4;++k) {
+        try {
+          c.decrypt(bad[k], "Tally Ho!");
+          ok = false;
+        }
+        catch (exception&) {
+        }
+      }
+    }
+  }
+
+  // The AEAD ciphers are only supported by the stream API.
+  Cipher g("aes-256-gcm", "sha1", 1, true);
+  Cipher::uchar buf[256];
+  try {
+    g.encrypt((const Cipher::uchar*)"abc", 3, buf, sizeof(buf), "Tally Ho!");
+    ok = false;
+  }
+  catch (exception&) {
+  }
+  remove(fn.c_str());
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test19:\t";
+  if (ok) {
+    cout << "passed";
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
+// ================================================================
+// Test decrypt_range: random slices of CBC, CTR and AEAD files,
+// armored and binary, must match the plaintext.
+// ================================================================
+void test_cipher20(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 20" << endl;
+  }
+  bool ok = true;
+  const char* ciphers[] = {"aes-256-cbc", "aes-128-ctr", "aes-256-gcm", "des-ede3-cbc"};
+  string pt;
+  for(uint i=0;i<50003;++i) {
+    pt += char(i * 13 + i / 256);
+  }
+  const unsigned long long ranges[][2] = {
+    {0, 1}, {0, 50003}, {15, 17}, {4095, 2}, {4096, 4096}, {49990, 100},
+    {50002, 1}, {50003, 10}, {60000, 10}, {1000, 0}
+  };
+  string fn = "test_cipher20.txt";
+  for(uint i=0;i<sizeof(ciphers)/sizeof(ciphers[0]);++i) {
+    for(uint j=0;j<2;++j) {
+      Cipher c(ciphers[i], CIPHER_DEFAULT_DIGEST);
+      c.armor(j == 0);
+      c.chunk_size(4096);
+      c.threads(2);
+      c.file_write(fn, pt);
+      c.encrypt_file(fn, fn, "Tally Ho!");
+      for(uint k=0;k<sizeof(ranges)/sizeof(ranges[0]);++k) {
+        unsigned long long off = ranges[k][0];
+        unsigned long long len = ranges[k][1];
+        string exp = off < pt.size() ? pt.substr(off, len) : "";
+        if (c.decrypt_range(fn, off, len, "Tally Ho!") != exp) {
+          if (v) {
+            cout << DBG_PRE << ciphers[i] << " " << j << " "
+                 << off << " " << len << " failed" << endl;
+          }
+          ok = false;
+        }
+      }
+    }
+  }
+
+  // A bad passphrase is caught by the padding or the tag when
+  // the range includes them.
+  for(uint i=0;i<3;i+=2) {
+    Cipher c(ciphers[i], CIPHER_DEFAULT_DIGEST);
+    c.file_write(fn, pt);
+    c.encrypt_file(fn, fn, "Tally Ho!");
+    try {
+      c.decrypt_range(fn, 49990, 100, "bad");
+      ok = false;
+    }
+    catch (exception&) {
+    }
+  }
+
+  // Trailing blank lines and spaces of an armored file are
+  // ignored however many there are.
+  {
+    Cipher c("aes-256-cbc", CIPHER_DEFAULT_DIGEST);
+    c.file_write(fn, pt);
+    c.encrypt_file(fn, fn, "Tally Ho!");
+    ofstream ofs(fn.c_str(), ios::app | ios::binary);
+    ofs << string(40, '\n') << string(5000, ' ') << "\n";
+    ofs.close();
+    if (c.decrypt_range(fn, 49990, 100, "Tally Ho!") != pt.substr(49990) ||
+        c.decrypt_range(fn, 0, 50003, "Tally Ho!") != pt) {
+      ok = false;
+    }
+  }
+
+  // Other modes cannot seek.
+  Cipher ofb("aes-256-ofb", CIPHER_DEFAULT_DIGEST);
+  ofb.encrypt_file(fn, fn, "Tally Ho!");
+  try {
+    ofb.decrypt_range(fn, 0, 10, "Tally Ho!");
+    ok = false;
+  }
+  catch (exception&) {
+  }
+  remove(fn.c_str());
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test20:\t";
+  if (ok) {
+    cout << "passed";
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
+// ================================================================
+// The ciphertext that OpenSSL produces for the KDF settings of
+// test_cipher21.
+// ================================================================
+string test_cipher21_expected(Cipher::Kdf kdf, const string& pt)
+{
+  // The openssl enc -pbkdf2 layout: the key followed by the IV.
+  const char* salt = "12345678";
+  unsigned char kiv[48];
+  if (kdf == Cipher::PBKDF2) {
+    PKCS5_PBKDF2_HMAC("Tally Ho!", 9, (const unsigned char*)salt, 8, 1000,
+		      EVP_sha256(), sizeof(kiv), kiv);
+  }
+  else {
+    EVP_PBE_scrypt("Tally Ho!", 9, (const unsigned char*)salt, 8, 1024, 8, 4,
+		   0, kiv, sizeof(kiv));
+  }
+  EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+  string ct = string("Salted__") + salt;
+  ct.resize(16 + pt.size() + 16);
+  int n1 = 0;
+  int n2 = 0;
+  EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, kiv, kiv + 32);
+  EVP_EncryptUpdate(ctx, (unsigned char*)&ct[16], &n1,
+		    (const unsigned char*)pt.data(), pt.size());
+  EVP_EncryptFinal_ex(ctx, (unsigned char*)&ct[16 + n1], &n2);
+  EVP_CIPHER_CTX_free(ctx);
+  ct.resize(16 + n1 + n2);
+  return ct;
+}
+
+// ================================================================
+// Test the key derivation functions: PBKDF2 and scrypt must
+// produce the same key and IV as OpenSSL, with the scrypt lanes
+// on one thread or several, and the key cache must keep the
+// KDFs apart.
+// ================================================================
+void test_cipher21(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 21" << endl;
+  }
+  bool ok = true;
+  string pt = "Lorem ipsum dolor sit amet, consectetur adipiscing elit.";
+
+  Cipher c("aes-256-cbc", "sha256", 1000);
+  c.armor(false);
+  c.kdf(Cipher::PBKDF2);
+  if (c.encrypt(pt, "Tally Ho!", "12345678") != test_cipher21_expected(Cipher::PBKDF2, pt)) {
+    ok = false;
+  }
+
+  c.kdf(Cipher::SCRYPT);
+  c.kdf_cost(1024, 4, 8);
+  string exp = test_cipher21_expected(Cipher::SCRYPT, pt);
+  for(uint t=1;t<=4;t+=3) {
+    c.threads(t);
+    if (c.encrypt(pt, "Tally Ho!", "12345678") != exp ||
+	c.decrypt(exp, "Tally Ho!") != pt) {
+      if (v) {
+	cout << DBG_PRE << "scrypt with " << t << " threads failed" << endl;
+      }
+      ok = false;
+    }
+  }
+
+  // Costs over the memory limit are refused before anything is
+  // allocated, including r * p values whose buffer is over 4G.
+  unsigned long long costs[][3] = {{1ULL << 20, 1, 16}, {16384, 1U << 20, 512}};
+  for(uint i=0;i<2;++i) {
+    Cipher big;
+    big.kdf(Cipher::SCRYPT);
+    big.kdf_cost(costs[i][0], costs[i][1], costs[i][2]);
+    try {
+      big.encrypt(pt, "Tally Ho!");
+      ok = false;
+    }
+    catch (runtime_error&) {
+    }
+  }
+
+  // The cache id includes the KDF so a key derived by one is not
+  // used by another.
+  Cipher::KeyCache cache;
+  Cipher a;
+  a.key_cache(&cache);
+  string ct = a.encrypt(pt, "Tally Ho!", "12345678");
+  a.kdf(Cipher::PBKDF2);
+  try {
+    if (a.decrypt(ct, "Tally Ho!") == pt) {
+      ok = false;
+    }
+  }
+  catch (exception&) {
+  }
+  if (cache.size() != 2) {
+    ok = false;
+  }
+
+  // Argon2id needs OpenSSL 3.2.
+#ifdef CIPHER_HAVE_ARGON2
+  a.kdf(Cipher::ARGON2ID);
+  a.kdf_cost(1024, 2);
+  if (a.decrypt(a.encrypt(pt, "Tally Ho!"), "Tally Ho!") != pt) {
+    ok = false;
+  }
+#else
+  try {
+    a.kdf(Cipher::ARGON2ID);
+    ok = false;
+  }
+  catch (exception&) {
+  }
+#endif
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test21:\t";
+  if (ok) {
+    cout << "passed";
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
+// ================================================================
+// Test the fused string API: encrypt() and decrypt() must produce
+// the same output as the two pass path for sizes around the block
+// boundaries.
+// ================================================================
+void test_cipher22(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 22" << endl;
+  }
+  bool ok = true;
+  size_t sizes[] = {0, 1, 15, 16, 47, 48, 1000, 49136, 49151, 49152, 49153, 98304, 200000};
+  for(uint a=0;a<2;++a) {
+    Cipher c;
+    c.armor(a == 0);
+    for(uint i=0;i<sizeof(sizes)/sizeof(sizes[0]);++i) {
+      string pt(sizes[i], 0);
+      for(size_t j=0;j<pt.size();++j) {
+        pt[j] = char(j * 7 + i);
+      }
+      string ct = c.encrypt(pt, "Tally Ho!", "12345678");
+
+      Cipher::Key k;
+      c.make_key(k, "Tally Ho!", "12345678");
+      Cipher::kv1_t x = c.encode_cipher(k, pt);
+      string two = a == 0 ? c.encode_base64(x.first, x.second) : string((char*)x.first, x.second);
+      delete [] x.first;
+      if (ct != two || c.decrypt(ct, "Tally Ho!") != pt) {
+        if (v) {
+          cout << DBG_PRE << "armor=" << (a == 0) << " size=" << sizes[i] << endl;
+        }
+        ok = false;
+      }
+    }
+  }
+
+  // Each call is still recorded once per stage.
+  Cipher c;
+  c.collect_stats();
+  string ct = c.encrypt(string(200000, 'x'), "Tally Ho!");
+  c.decrypt(ct, "Tally Ho!");
+  const Cipher::Stats& s = c.stats();
+  if (s.calls(Cipher::Stats::CIPHER) != 2 || s.calls(Cipher::Stats::BASE64) != 2 ||
+      s.bytes(Cipher::Stats::BASE64) != 200032 + ct.size() || // 16 + the padded 200016
+      s.errors(Cipher::Stats::CIPHER) || s.errors(Cipher::Stats::BASE64)) {
+    ok = false;
+  }
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test22:\t";
+  if (ok) {
+    cout << "passed";
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
+// ================================================================
+// Test the streaming pipeline: the output must be the same as
+// the serial output and a write error must be reported.
+// ================================================================
+void test_cipher23(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 23" << endl;
+  }
+  bool ok = true;
+  string pt(300000, 0);
+  for(size_t i=0;i<pt.size();++i) {
+    pt[i] = char(i * 13);
+  }
+  for(uint a=0;a<2;++a) {
+    Cipher c;
+    c.armor(a == 0);
+    c.chunk_size(4096); // many chunks through the rings
+    string ct = c.encrypt(pt, "Tally Ho!", "12345678");
+    c.pipeline();
+    istringstream is(pt);
+    ostringstream os;
+    c.encrypt_stream(is, os, "Tally Ho!", "12345678");
+    istringstream is2(os.str());
+    ostringstream os2;
+    c.decrypt_stream(is2, os2, "Tally Ho!");
+    if (os.str() != ct + (a == 0 ? "\n" : "") || os2.str() != pt) {
+      ok = false;
+    }
+
+    // A failed write is an error, not a short file.
+    istringstream is3(pt);
+    ostringstream os3;
+    os3.setstate(ios::badbit);
+    try {
+      c.encrypt_stream(is3, os3, "Tally Ho!");
+      ok = false;
+    }
+    catch (exception&) {
+    }
+  }
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test23:\t";
+  if (ok) {
+    cout << "passed";
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
+// ================================================================
+// Test the IO_URING backend of the file functions against the
+// streams and AsyncIO with both implementations.
+// ================================================================
+void test_cipher24(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 24" << endl;
+    cout << DBG_PRE << "io_uring available: " << AsyncIO::available() << endl;
+  }
+  bool ok = true;
+  string fn  = "test_cipher24.txt";
+  string efn = "test_cipher24.enc";
+  string dfn = "test_cipher24.dec";
+  size_t sizes[] = {0, 1, 4096, 4097, 40000};
+  for(uint i=0;i<sizeof(sizes)/sizeof(sizes[0]);++i) {
+    string pt(sizes[i], 0);
+    for(size_t j=0;j<pt.size();++j) {
+      pt[j] = char(j * 17 + i);
+    }
+    Cipher c;
+    c.chunk_size(4096); // more chunks than buffers
+    c.file_write(fn, pt, false);
+    c.encrypt_file(fn, efn, "Tally Ho!", "12345678");
+    string expected = c.file_read(efn);
+    c.io(Cipher::IO_URING);
+    if (c.file_read(fn) != pt) {
+      ok = false;
+    }
+    c.encrypt_file(fn, efn, "Tally Ho!", "12345678");
+    c.decrypt_file(efn, dfn, "Tally Ho!");
+    if (c.file_read(efn) != expected || c.file_read(dfn) != pt) {
+      ok = false;
+    }
+
+    // In place.
+    c.encrypt_file(dfn, dfn, "Tally Ho!", "12345678");
+    if (c.file_read(dfn) != expected) {
+      ok = false;
+    }
+  }
+
+  // Queued writes and reads at offsets.
+  AsyncIO::Backend backends[] = {AsyncIO::AUTO, AsyncIO::PREAD};
+  for(uint b=0;b<2;++b) {
+    AsyncIO io(3, 1000, backends[b]);
+    int fd = open(fn.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    for(uint k=0;k<io.depth();++k) {
+      memset(io.buffer(k), 'a' + k, io.buffer_size());
+      io.write(k, fd, k * 1000, 1000);
+    }
+    for(uint k=0;k<io.depth();++k) {
+      if (io.wait(k) != 1000) {
+        ok = false;
+      }
+    }
+    for(uint k=0;k<io.depth();++k) {
+      io.read(k, fd, 2500 - k * 1000, 1000);
+    }
+    size_t expect[] = {500, 1000, 1000};
+    for(uint k=0;k<io.depth();++k) {
+      size_t n = io.wait(k);
+      if (n != expect[k] || io.buffer(k)[0] != "cba"[k] || io.buffer(k)[n-1] != "ccb"[k]) {
+        ok = false;
+      }
+    }
+    close(fd);
+  }
+  if (AsyncIO(1, 1, AsyncIO::PREAD).backend() != AsyncIO::PREAD) {
+    ok = false;
+  }
+  remove(fn.c_str());
+  remove(efn.c_str());
+  remove(dfn.c_str());
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test24:\t";
+  if (ok) {
+    cout << "passed";
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
+// ================================================================
+// Salts generated by several threads at once.
+// ================================================================
+class salt_job_t : public ThreadPool::Job
+{
+public:
+  salt_job_t() : m_salts(20000) {}
+  virtual void run()
+  {
+    for(size_t i=0;i<m_salts.size();++i) {
+      Cipher::uchar salt[8];
+      Cipher::random_bytes(salt, sizeof(salt));
+      m_salts[i].assign((char*)salt, sizeof(salt));
+    }
+  }
+  const vector<string>& salts() const {return m_salts;}
+private:
+  vector<string> m_salts;
+};
+
+// ================================================================
+// Test the random salts: unique across threads and across a
+// fork, and different for each encryption.
+// ================================================================
+void test_cipher25(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 25" << endl;
+  }
+  bool ok = true;
+  Cipher c;
+  if (c.encrypt("secret", "Tally Ho!") == c.encrypt("secret", "Tally Ho!")) {
+    ok = false;
+  }
+
+  ThreadPool pool(4);
+  vector<salt_job_t*> jobs;
+  for(uint i=0;i<4;++i) {
+    jobs.push_back(new salt_job_t);
+    pool.submit(jobs.back());
+  }
+  set<string> seen;
+  size_t total = 0;
+  for(uint i=0;i<jobs.size();++i) {
+    pool.wait(jobs[i]);
+    seen.insert(jobs[i]->salts().begin(), jobs[i]->salts().end());
+    total += jobs[i]->salts().size();
+    delete jobs[i];
+  }
+  if (seen.size() != total) {
+    ok = false;
+  }
+
+  // The child must not replay the bytes left in the parent pool.
+  Cipher::uchar a[8];
+  Cipher::uchar b[8];
+  Cipher::random_bytes(a, sizeof(a)); // fill the pool
+  int fds[2];
+  if (pipe(fds) == 0) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      Cipher::random_bytes(b, sizeof(b));
+      ssize_t n = write(fds[1], b, sizeof(b));
+      _exit(n == sizeof(b) ? 0 : 1);
+    }
+    Cipher::random_bytes(a, sizeof(a));
+    ssize_t n = read(fds[0], b, sizeof(b));
+    waitpid(pid, 0, 0);
+    close(fds[0]);
+    close(fds[1]);
+    if (pid < 0 || n != sizeof(b) || memcmp(a, b, sizeof(a)) == 0) {
+      ok = false;
+    }
+  }
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test25:\t";
+  if (ok) {
+    cout << "passed";
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
+// ================================================================
+// Job for test 26: every kind of call on a shared Cipher.
+// ================================================================
+class shared_job_t : public ThreadPool::Job
+{
+public:
+  shared_job_t(const Cipher& c, uint id, const string& ref)
+    : m_c(c), m_id(id), m_ref(ref), m_calls(0), m_ok(true) {}
+  virtual void run()
+  {
+    try {
+      for(uint i=0;i<200;++i) {
+        step(i);
+      }
+    }
+    catch (exception&) {
+      m_ok = false;
+    }
+  }
+  bool ok() const {return m_ok;}
+  uint calls() const {return m_calls;}
+private:
+  void check(bool b) {m_ok = m_ok && b;}
+  void step(uint i)
+  {
+    ostringstream os;
+    os << "record " << m_id << ":" << i << " " << string(i % 97, 'x');
+    string pt   = os.str();
+    string pass = "pass " + os.str().substr(0, 10);
+
+    // Random salt and the same salt as the reference.
+    string ct = m_c.encrypt(pt, pass);
+    check(m_c.decrypt(ct, pass) == pt);
+    check(m_c.encrypt("shared", "Tally Ho!", "12345678") == m_ref);
+
+    // The low level calls with their own key.
+    ct = m_c.encrypt(pt, pass, "saltsalt");
+    Cipher::Key k;
+    m_c.make_key(k, pass, "saltsalt");
+    Cipher::kv1_t x = m_c.encode_cipher(k, pt);
+    string two = m_c.encode_base64(x.first, x.second);
+    check(two == ct);
+    check(m_c.decode_cipher(k, x.first+16, x.second-16) == pt);
+    delete [] x.first;
+    m_calls += 5;
+
+    // Streams, an Encryptor and a batch every few steps.
+    if (i % 10 == 0) {
+      istringstream is(pt);
+      ostringstream es;
+      m_c.encrypt_stream(is, es, pass);
+      istringstream ds(es.str());
+      ostringstream out;
+      m_c.decrypt_stream(ds, out, pass);
+      check(out.str() == pt);
+
+      Cipher::Encryptor enc(m_c);
+      Cipher::StringSink sink;
+      enc.begin(pass);
+      enc.update((const Cipher::uchar*)pt.data(), pt.size(), sink);
+      enc.finish(sink);
+      Cipher::Decryptor dec(m_c);
+      Cipher::StringSink back;
+      dec.begin(pass);
+      dec.update((const Cipher::uchar*)sink.str().data(), sink.str().size(), back);
+      dec.finish(back);
+      check(back.str() == pt);
+
+      vector<string> records(5, pt);
+      vector<string> cts;
+      vector<string> pts;
+      m_c.encrypt_batch(records, cts, pass);
+      m_c.decrypt_batch(cts, pts, pass);
+      check(pts == records);
+      m_calls += 2;
+    }
+  }
+private:
+  const Cipher& m_c;
+  uint          m_id;
+  string        m_ref;
+  uint          m_calls;
+  bool          m_ok;
+};
+
+// ================================================================
+// One Cipher shared by a pool of threads without locks: the
+// results must match the single threaded ones and the shared
+// key cache and statistics must stay consistent.
+// ================================================================
+void test_cipher26(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 26" << endl;
+  }
+  bool ok = true;
+  Cipher::KeyCache cache(16);
+  Cipher c;
+  c.key_cache(&cache);
+  c.collect_stats();
+  string ref = c.encrypt("shared", "Tally Ho!", "12345678");
+  c.clear_stats();
+
+  const uint n = 8;
+  ThreadPool pool(n);
+  vector<shared_job_t*> jobs;
+  for(uint i=0;i<n;++i) {
+    jobs.push_back(new shared_job_t(c, i, ref));
+    pool.submit(jobs.back());
+  }
+  unsigned long long calls = 0;
+  for(uint i=0;i<jobs.size();++i) {
+    pool.wait(jobs[i]);
+    if (!jobs[i]->ok()) {
+      if (v) {
+        cout << DBG_PRE << "job " << i << " failed" << endl;
+      }
+      ok = false;
+    }
+    calls += jobs[i]->calls();
+    delete jobs[i];
+  }
+
+  // Every derivation or cache hit is one KDF call: one for each
+  // string call, stream, Encryptor and Decryptor and one per
+  // record for the batches because the salts are random.
+  const unsigned long long kdf = calls + n * 20 * (2 + 10);
+  if (c.stats().calls(Cipher::Stats::KDF) != kdf || c.stats().errors(Cipher::Stats::KDF)) {
+    if (v) {
+      cout << DBG_PRE << "kdf calls " << c.stats().calls(Cipher::Stats::KDF) << " != " << kdf << endl;
+    }
+    ok = false;
+  }
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test26:\t";
+  if (ok) {
+    cout << "passed";
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
+// ================================================================
+// Test that a failed decryption leaves an existing output file
+// as it was with both file backends.
+// ================================================================
+void test_cipher27(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 27" << endl;
+  }
+  bool ok = true;
+  string fn  = "test_cipher27.txt";
+  string efn = "test_cipher27.enc";
+  string dfn = "test_cipher27.dec";
+  string pt(200000, 0);
+  for(size_t j=0;j<pt.size();++j) {
+    pt[j] = char(j * 13);
+  }
+  string old = "keep me\n";
+  Cipher::Io ios[] = {Cipher::IO_STREAMS, Cipher::IO_URING};
+  for(uint i=0;i<2;++i) {
+    Cipher c;
+    c.io(ios[i]);
+    c.chunk_size(4096);
+    c.file_write(fn, pt, false);
+    c.encrypt_file(fn, efn, "Tally Ho!", "12345678");
+    c.file_write(dfn, old, false);
+    try {
+      c.decrypt_file(efn, dfn, "wrong");
+      ok = false;
+    }
+    catch (exception&) {
+    }
+    if (c.file_read(dfn) != old) {
+      if (v) {
+        cout << DBG_PRE << "io " << i << ": output changed" << endl;
+      }
+      ok = false;
+    }
+    c.decrypt_file(efn, dfn, "Tally Ho!");
+    if (c.file_read(dfn) != pt) {
+      ok = false;
+    }
+  }
+  remove(fn.c_str());
+  remove(efn.c_str());
+  remove(dfn.c_str());
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test27:\t";
+  if (ok) {
+    cout << "passed";
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
+// ================================================================
+// Test that decrypting a truncated AEAD container fails the
+// authentication and leaves no output file.
+// ================================================================
+void test_cipher28(pair<int,int>& st,int v)
+{
+  if (v) {
+    cout << DBG_PRE << "Cipher Test 28" << endl;
+  }
+  bool ok = true;
+  string fn  = "test_cipher28.txt";
+  string efn = "test_cipher28.enc";
+  string dfn = "test_cipher28.dec";
+  string pt(200000, 0);
+  for(size_t j=0;j<pt.size();++j) {
+    pt[j] = char(j * 7);
+  }
+  Cipher::Io ios[] = {Cipher::IO_STREAMS, Cipher::IO_URING};
+  for(uint i=0;i<2;++i) {
+    Cipher c("aes-256-gcm", "sha256", 1000);
+    c.io(ios[i]);
+    c.chunk_size(4096);
+    c.file_write(fn, pt, false);
+    c.encrypt_file(fn, efn, "Tally Ho!", "12345678");
+    string ct = c.file_read(efn);
+    c.file_write(efn, ct.substr(0, ct.size() - 100), false);
+    remove(dfn.c_str());
+    try {
+      c.decrypt_file(efn, dfn, "Tally Ho!");
+      ok = false;
+    }
+    catch (exception&) {
+    }
+    if (access(dfn.c_str(), F_OK) == 0) {
+      if (v) {
+        cout << DBG_PRE << "io " << i << ": partial output left" << endl;
+      }
+      ok = false;
+    }
+  }
+  remove(fn.c_str());
+  remove(efn.c_str());
+  remove(dfn.c_str());
+
+  st.first += 1;
+  cout << DBG_PRE << "cipher_test28:\t";
+  if (ok) {
+    cout << "passed";
+  }
+  else {
+    cout << "failed";
+    st.second += 1;
+  }
+  cout << endl;
+}
+
 // ================================================================
 // test
 // ================================================================
@@ -283,6 +2109,30 @@ pair<int,int> test(int v)
     test_cipher2(st,v);
     test_cipher3(st,v);
     test_cipher4(st,v);
+    test_cipher5(st,v);
+    test_cipher6(st,v);
+    test_cipher7(st,v);
+    test_cipher8(st,v);
+    test_cipher9(st,v);
+    test_cipher10(st,v);
+    test_cipher11(st,v);
+    test_cipher12(st,v);
+    test_cipher13(st,v);
+    test_cipher14(st,v);
+    test_cipher15(st,v);
+    test_cipher16(st,v);
+    test_cipher17(st,v);
+    test_cipher18(st,v);
+    test_cipher19(st,v);
+    test_cipher20(st,v);
+    test_cipher21(st,v);
+    test_cipher22(st,v);
+    test_cipher23(st,v);
+    test_cipher24(st,v);
+    test_cipher25(st,v);
+    test_cipher26(st,v);
+    test_cipher27(st,v);
+    test_cipher28(st,v);
   }
   catch (exception& e) {
     cout << "ERROR: " << e.what() << endl;
@@ -317,6 +2167,6 @@ int main(int argc,char** argv)
       exit(1);
     }
   }
-  test(v);
-  return 0;
+  pair<int,int> st = test(v);
+  return st.second ? 1 : 0;
 }
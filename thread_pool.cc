@@ -0,0 +1,154 @@
+// ================================================================
+// Description: Thread pool class.
+// Copyright:   Copyright (c) 2012 by Joe Linoff
+// Version:     1.3.0
+// Author:      Joe Linoff
+//
+// LICENSE
+//   The cipher package is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of the
+//   License, or (at your option) any later version.
+//
+//   The cipher package is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details. You should have received
+//   a copy of the GNU General Public License along with the change
+//   tool; if not, write to the Free Software Foundation, Inc., 59
+//   Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+// ================================================================
+#include "thread_pool.h"
+#include <stdexcept>
+#include <unistd.h>       // sysconf
+using namespace std;
+
+// ================================================================
+// Constructor.
+// ================================================================
+ThreadPool::ThreadPool(uint nthreads)
+  : m_stop(false)
+{
+  pthread_mutex_init(&m_mutex, 0);
+  pthread_cond_init(&m_work, 0);
+  pthread_cond_init(&m_done, 0);
+  if (nthreads == 0) {
+    nthreads = cpus();
+  }
+  for(uint i=0;i<nthreads;++i) {
+    pthread_t tid;
+    if (pthread_create(&tid, 0, worker, this)) {
+      if (m_threads.empty()) {
+	pthread_cond_destroy(&m_done);
+	pthread_cond_destroy(&m_work);
+	pthread_mutex_destroy(&m_mutex);
+	throw runtime_error("ThreadPool(): pthread_create() failed");
+      }
+      break; // run with the threads that we have
+    }
+    m_threads.push_back(tid);
+  }
+}
+
+// ================================================================
+// Destructor.
+// ================================================================
+ThreadPool::~ThreadPool()
+{
+  pthread_mutex_lock(&m_mutex);
+  m_stop = true;
+  pthread_cond_broadcast(&m_work);
+  pthread_mutex_unlock(&m_mutex);
+  for(uint i=0;i<m_threads.size();++i) {
+    pthread_join(m_threads[i], 0);
+  }
+  pthread_cond_destroy(&m_done);
+  pthread_cond_destroy(&m_work);
+  pthread_mutex_destroy(&m_mutex);
+}
+
+// ================================================================
+// submit
+// ================================================================
+void ThreadPool::submit(Job* job)
+{
+  pthread_mutex_lock(&m_mutex);
+  job->m_done = false;
+  job->m_error.clear();
+  m_queue.push_back(job);
+  pthread_cond_signal(&m_work);
+  pthread_mutex_unlock(&m_mutex);
+}
+
+// ================================================================
+// wait
+// ================================================================
+void ThreadPool::wait(Job* job)
+{
+  pthread_mutex_lock(&m_mutex);
+  while (!job->m_done) {
+    pthread_cond_wait(&m_done, &m_mutex);
+  }
+  string error = job->m_error;
+  pthread_mutex_unlock(&m_mutex);
+  if (!error.empty()) {
+    throw runtime_error(error);
+  }
+}
+
+// ================================================================
+// cpus
+// ================================================================
+ThreadPool::uint ThreadPool::cpus()
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+}
+
+// ================================================================
+// worker
+// ================================================================
+void* ThreadPool::worker(void* arg)
+{
+  static_cast<ThreadPool*>(arg)->loop();
+  return 0;
+}
+
+// ================================================================
+// loop
+// ================================================================
+void ThreadPool::loop()
+{
+  pthread_mutex_lock(&m_mutex);
+  for(;;) {
+    while (m_queue.empty() && !m_stop) {
+      pthread_cond_wait(&m_work, &m_mutex);
+    }
+    if (m_queue.empty()) {
+      break; // stopped and drained
+    }
+    Job* job = m_queue.front();
+    m_queue.pop_front();
+    pthread_mutex_unlock(&m_mutex);
+
+    string error;
+    try {
+      job->run();
+    }
+    catch (exception& e) {
+      error = e.what();
+      if (error.empty()) {
+	error = "unknown error";
+      }
+    }
+    catch (...) {
+      error = "unknown error";
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    job->m_error = error;
+    job->m_done = true;
+    pthread_cond_broadcast(&m_done);
+  }
+  pthread_mutex_unlock(&m_mutex);
+}
@@ -0,0 +1,128 @@
+// ================================================================
+// Description: Thread pool class.
+// Copyright:   Copyright (c) 2012 by Joe Linoff
+// Version:     1.3.0
+// Author:      Joe Linoff
+//
+// LICENSE
+//   The cipher package is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of the
+//   License, or (at your option) any later version.
+//       
+//   The cipher package is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details. You should have received
+//   a copy of the GNU General Public License along with the change
+//   tool; if not, write to the Free Software Foundation, Inc., 59
+//   Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+// ================================================================
+#ifndef thread_pool_h
+#define thread_pool_h
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <pthread.h>
+
+/**
+ * Fixed size pool of worker threads.
+ *
+ * It is used to encrypt or decrypt independent segments of a file
+ * in parallel. It uses pthreads directly so that it works with old
+ * (pre-c++11) compilers.
+ *
+ * Here is how you would use it.
+ * @code
+ *   class MyJob : public ThreadPool::Job
+ *   {
+ *   public:
+ *     virtual void run() { ... }
+ *   };
+ *
+ *   ThreadPool pool(4);
+ *   MyJob a, b;
+ *   pool.submit(&a);
+ *   pool.submit(&b);
+ *   pool.wait(&a); // throws if run() threw
+ *   pool.wait(&b);
+ * @endcode
+ * @author Joe Linoff
+ */
+class ThreadPool
+{
+public:
+  typedef unsigned int uint;
+
+  /**
+   * Unit of work. The pool does not own the jobs, they must
+   * outlive the call to wait().
+   */
+  class Job
+  {
+  public:
+    Job() : m_done(true) {}
+    virtual ~Job() {}
+    /**
+     * Do the work. Exceptions are caught and re-thrown by wait().
+     */
+    virtual void run() = 0;
+  private:
+    friend class ThreadPool;
+    bool        m_done;
+    std::string m_error;
+  };
+public:
+  /**
+   * Constructor.
+   * @param nthreads  The number of threads, 0 for one per CPU.
+   * @throws runtime_error If the threads cannot be created.
+   */
+  explicit ThreadPool(uint nthreads);
+
+  /**
+   * Destructor.
+   * The queued jobs are finished before the threads exit.
+   */
+  ~ThreadPool();
+
+  /**
+   * Queue a job.
+   * @param job  The job.
+   */
+  void submit(Job* job);
+
+  /**
+   * Wait for a job to finish.
+   * @param job  The job.
+   * @throws runtime_error If the job failed.
+   */
+  void wait(Job* job);
+
+  /**
+   * Get the number of threads.
+   * @returns The number of threads.
+   */
+  uint size() const {return m_threads.size();}
+
+  /**
+   * Get the number of online CPUs.
+   * @returns The number of CPUs, at least 1.
+   */
+  static uint cpus();
+private:
+  ThreadPool(const ThreadPool&);
+  ThreadPool& operator=(const ThreadPool&);
+  static void* worker(void* arg);
+  void loop();
+private:
+  pthread_mutex_t        m_mutex;
+  pthread_cond_t         m_work;
+  pthread_cond_t         m_done;
+  std::deque<Job*>       m_queue;
+  std::vector<pthread_t> m_threads;
+  bool                   m_stop;
+};
+
+#endif